@@ -1,4 +1,6 @@
 #include <ccan/err/err.h>
+#include <stdlib.h>
+#include <sys/types.h>
 #include "block.h"
 #include "utils.h"
 
@@ -12,6 +14,127 @@ bool block_eq(const struct block *b, const u8 *key)
 	return memcmp(b->id, key, sizeof(b->id)) == 0;
 }
 
+void block_map_init(struct block_map *block_map)
+{
+	block_htable_init(&block_map->added);
+	block_map->cached = NULL;
+	block_map->num_cached = 0;
+	block_map->index = NULL;
+	block_map->index_mask = 0;
+	block_map->dead = NULL;
+}
+
+void block_map_init_sized(struct block_map *block_map, size_t size)
+{
+	block_map_init(block_map);
+	block_htable_init_sized(&block_map->added, size);
+}
+
+void block_map_init_cached(struct block_map *block_map,
+			   struct block *cached, size_t num_cached,
+			   const u32 *index, size_t num_slots)
+{
+	block_map_init(block_map);
+	block_map->cached = cached;
+	block_map->num_cached = num_cached;
+	block_map->index = index;
+	block_map->index_mask = num_slots - 1;
+}
+
+void block_map_clear(struct block_map *block_map)
+{
+	block_htable_clear(&block_map->added);
+	free(block_map->dead);
+	block_map->dead = NULL;
+}
+
+size_t block_index_slot(const u8 *key, size_t num_slots)
+{
+	return hash_sha(key) & (num_slots - 1);
+}
+
+static bool cached_is_dead(const struct block_map *block_map, size_t i)
+{
+	return block_map->dead && (block_map->dead[i / 8] & (1 << (i % 8)));
+}
+
+/* Index of the live cached block with this key, or -1. */
+static ssize_t find_cached(const struct block_map *block_map, const u8 *key)
+{
+	size_t slot;
+
+	if (!block_map->index)
+		return -1;
+
+	for (slot = block_index_slot(key, block_map->index_mask + 1);
+	     block_map->index[slot];
+	     slot = (slot + 1) & block_map->index_mask) {
+		size_t i = block_map->index[slot] - 1;
+
+		if (i < block_map->num_cached
+		    && block_eq(&block_map->cached[i], key))
+			return cached_is_dead(block_map, i) ? -1 : i;
+	}
+	return -1;
+}
+
+void block_map_add(struct block_map *block_map, struct block *b)
+{
+	block_htable_add(&block_map->added, b);
+}
+
+bool block_map_delkey(struct block_map *block_map, const u8 *key)
+{
+	ssize_t i;
+
+	if (block_htable_delkey(&block_map->added, key))
+		return true;
+
+	i = find_cached(block_map, key);
+	if (i < 0)
+		return false;
+	/* Rare (a block stored twice): the index is read-only. */
+	if (!block_map->dead) {
+		block_map->dead = calloc((block_map->num_cached + 7) / 8, 1);
+		if (!block_map->dead)
+			err(1, "Allocating block cache bitmap");
+	}
+	block_map->dead[i / 8] |= (1 << (i % 8));
+	return true;
+}
+
+struct block *block_map_get(const struct block_map *block_map, const u8 *key)
+{
+	struct block *b = block_htable_get(&block_map->added, key);
+	ssize_t i;
+
+	if (b)
+		return b;
+	i = find_cached(block_map, key);
+	return i < 0 ? NULL : &block_map->cached[i];
+}
+
+struct block *block_map_next(const struct block_map *block_map,
+			     struct block_map_iter *it)
+{
+	while (it->i < block_map->num_cached) {
+		size_t i = it->i++;
+
+		if (!cached_is_dead(block_map, i))
+			return &block_map->cached[i];
+	}
+	if (it->i++ == block_map->num_cached)
+		return block_htable_first(&block_map->added, &it->it);
+	return block_htable_next(&block_map->added, &it->it);
+}
+
+struct block *block_map_first(const struct block_map *block_map,
+			      struct block_map_iter *it)
+{
+	it->i = 0;
+	return block_map_next(block_map, it);
+}
+
 bool add_block(struct block_map *block_map,
 	       struct block *b,
 	       struct block **genesis,
@@ -58,25 +181,25 @@ bool add_block(struct block_map *block_map,
 
 bool set_height(struct block_map *block_map, struct block *b)
 {
-	struct block *i, *prev;
+	struct block *i;
+	s32 height;
 
 	if (b->height != -1)
 		return true;
 
+	/* Find the last ancestor with a known height. */
+	height = 0;
 	i = b;
 	do {
-		prev = block_map_get(block_map, i->bh.prev_hash);
-		if (!prev)
+		i = block_map_get(block_map, i->bh.prev_hash);
+		if (!i)
 			return false;
-		prev->next = i;
-		i = prev;
+		height++;
 	} while (i->height == -1);
 
-	/* Now iterate forward, setting height for all. */
-	b->next = NULL;
-	for (i = prev->next; i; i = i->next) {
-		i->height = prev->height + 1;
-		prev = i;
-	}
+	/* Now walk back again, setting height for all. */
+	height += i->height;
+	for (i = b; i->height == -1; i = block_map_get(block_map, i->bh.prev_hash))
+		i->height = height--;
 	return true;
 }
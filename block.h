@@ -23,20 +23,129 @@ const u8 *keyof_block_map(const struct block *b);
 bool block_eq(const struct block *b, const u8 *key);
 
 /**
- * Defines the block_map and the following methods:
+ * Defines the block_htable and the following methods:
  *
- *   block_map_init
- *   block_map_clear
- *   block_map_add
- *   block_map_del
- *   block_map_get
- *   block_map_first
- *   block_map_next
+ *   block_htable_init
+ *   block_htable_clear
+ *   block_htable_add
+ *   block_htable_del
+ *   block_htable_get
+ *   block_htable_first
+ *   block_htable_next
  *
  * See ccan/htable/htable_type.h for more details.
  * 
  */
-HTABLE_DEFINE_TYPE(struct block, keyof_block_map, hash_sha, block_eq, block_map);
+HTABLE_DEFINE_TYPE(struct block, keyof_block_map, hash_sha, block_eq, block_htable);
+
+/**
+ * block_map - Every known block, by ID.
+ *
+ * @added: blocks added with block_map_add()
+ * @cached: blocks used in place from the block cache (or NULL)
+ * @num_cached: number of @cached blocks
+ * @index: open-addressed hash index of @cached: each slot is 0 or
+ *         one more than the index of a cached block
+ * @index_mask: number of @index slots, minus one
+ * @dead: bitmap of @cached blocks since deleted (or NULL)
+ *
+ * The cached blocks and their index are precomputed on disk, so using
+ * them costs page faults rather than hashing every block.
+ */
+struct block_map {
+	struct block_htable added;
+	struct block *cached;
+	size_t num_cached;
+	const u32 *index;
+	size_t index_mask;
+	u8 *dead;
+};
+
+struct block_map_iter {
+	size_t i;
+	struct block_htable_iter it;
+};
+
+/**
+ * Initialize an empty block map.
+ *
+ *  @param block_map -- pointer to the block map
+ */
+void block_map_init(struct block_map *block_map);
+
+/**
+ * Initialize an empty block map, sized for some number of blocks.
+ *
+ *  @param block_map -- pointer to the block map
+ *  @param size      -- expected number of blocks
+ */
+void block_map_init_sized(struct block_map *block_map, size_t size);
+
+/**
+ * Initialize a block map over an array of cached blocks and their
+ * precomputed index (see block_index_slot()).  Both must outlive the
+ * block map; the blocks may be modified (eg. their height set).
+ *
+ *  @param block_map  -- pointer to the block map
+ *  @param cached     -- array of blocks
+ *  @param num_cached -- number of blocks in @cached
+ *  @param index      -- index slots
+ *  @param num_slots  -- number of index slots (a power of 2)
+ */
+void block_map_init_cached(struct block_map *block_map,
+			   struct block *cached, size_t num_cached,
+			   const u32 *index, size_t num_slots);
+
+/**
+ * Free the block map's memory (but not the blocks).
+ *
+ *  @param block_map -- pointer to the block map
+ */
+void block_map_clear(struct block_map *block_map);
+
+/**
+ * Add a block to the block map (it must not already be present).
+ *
+ *  @param block_map -- pointer to the block map
+ *  @param b         -- pointer to a block struct
+ */
+void block_map_add(struct block_map *block_map, struct block *b);
+
+/**
+ * Remove the block with this ID from the block map, if present.
+ *
+ *  @param block_map -- pointer to the block map
+ *  @param key       -- pointer to a SHA256 block hash
+ */
+bool block_map_delkey(struct block_map *block_map, const u8 *key);
+
+/**
+ * Look up a block by ID (NULL if not found).
+ *
+ *  @param block_map -- pointer to the block map
+ *  @param key       -- pointer to a SHA256 block hash
+ */
+struct block *block_map_get(const struct block_map *block_map, const u8 *key);
+
+/**
+ * Iterate over every block: cached ones first, then added ones.
+ *
+ *  @param block_map -- pointer to the block map
+ *  @param it        -- pointer to the iterator
+ */
+struct block *block_map_first(const struct block_map *block_map,
+			      struct block_map_iter *it);
+struct block *block_map_next(const struct block_map *block_map,
+			     struct block_map_iter *it);
+
+/**
+ * The first index slot to probe for a block ID.  Slots are probed
+ * linearly from here until the block or an empty slot is found.
+ *
+ *  @param key       -- pointer to a SHA256 block hash
+ *  @param num_slots -- number of index slots (a power of 2)
+ */
+size_t block_index_slot(const u8 *key, size_t num_slots);
 
 /**
  * Add the given block to the block map.
@@ -67,7 +176,7 @@ bool add_block(struct block_map *block_map, struct block *b, struct block **gene
 /**
  * Sets the heights of blocks in the block map if possible.
  *
- * Finds the last block with a known height then iterates forward
+ * Finds the last block with a known height then walks forward
  * setting the height of the rest of the blocks.
  *
  *  @param block_map -- pointer to the block map
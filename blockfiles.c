@@ -1,23 +1,35 @@
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <ccan/tal/tal.h>
 #include <ccan/err/err.h>
 #include <ccan/tal/path/path.h>
 #include <ccan/tal/str/str.h>
 #include <ccan/short_types/short_types.h>
+#include <ccan/container_of/container_of.h>
+#include <ccan/list/list.h>
+#include <assert.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <pwd.h>
 #include <dirent.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "io.h"
 #include "blockfiles.h"
 #include "parse.h"
 
 #define CHUNK (128 * 1024 * 1024)
-#define NUM_BLOCKFILES 2
+
+/* Block files scanned per thread between merges. */
+#define SCAN_FILES_PER_THREAD 4
 
 #define BITCOIN_DIR_NAME        ".bitcoin"
 #define BITCOIN_BLOCKS_DIR_NAME "blocks"
 #define TESTNET_DIR_NAME        "testnet3"
+#define XOR_KEY_NAME            "xor.dat"
+#define XOR_KEY_SIZE            8
 
 static void add_name(char ***names_p, unsigned int num, char *name)
 {
@@ -84,131 +96,593 @@ char **block_filenames(tal_t *ctx, const char *path, bool testnet)
 	return names;
 }
 
-struct file *block_file(char **block_fnames, unsigned int index, bool use_mmap)
+const u8 *block_xor_key(const tal_t *ctx, char **block_fnames)
 {
-	/* Cache pointers (must be static) */
-	static struct file f[NUM_BLOCKFILES];
-	static size_t next;
-
+	u8 *key;
+	char *name = NULL;
 	size_t i;
+	int fd;
+
+	for (i = 0; i < tal_count(block_fnames) && !name; i++) {
+		if (block_fnames[i])
+			name = path_join(ctx,
+					 path_dirname(ctx, block_fnames[i]),
+					 XOR_KEY_NAME);
+	}
+	if (!name)
+		return NULL;
 
-	/* Check cache. */
-	for (i = 0; i < NUM_BLOCKFILES; i++) {
-		/* Cache hit */
-		if (f[i].name == block_fnames[index])
-			return f+i;
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		/* Older bitcoinds don't obfuscate. */
+		if (errno == ENOENT) {
+			tal_free(name);
+			return NULL;
+		}
+		err(1, "Opening %s", name);
 	}
+	key = tal_arr(ctx, u8, XOR_KEY_SIZE);
+	if (read(fd, key, XOR_KEY_SIZE) != XOR_KEY_SIZE)
+		errx(1, "%s is not a %u byte key", name, XOR_KEY_SIZE);
+	close(fd);
+	tal_free(name);
 
-	/* Cache miss. */
-	i = next;
-	if (f[i].name) {
-		/* Evict current cache slot. */
-		file_close(&f[i]);
+	/* An all-zero key (-blocksxor=0) changes nothing. */
+	for (i = 0; i < XOR_KEY_SIZE; i++) {
+		if (key[i])
+			return key;
 	}
+	return tal_free(key);
+}
+
+void block_file_open(struct file *f, const char *name, bool use_mmap,
+		     const u8 *xor_key)
+{
+	/* A mapping would show the obfuscated bytes. */
+	file_open(f, name, 0,
+		  O_RDONLY | (use_mmap && !xor_key ? 0 : O_NO_MMAP));
+	f->xor_key = xor_key;
+}
+
+/**
+ * pooled_file - An open block file in a block file pool.
+ *
+ * @list: place in the pool's list, most recently used first
+ * @f: the open file
+ * @filenum: which block file it is
+ * @refs: how many users currently hold it
+ *
+ * Entries are malloc'ed so files can be opened from any thread, and
+ * never move, so @f stays put while it is held.
+ */
+struct pooled_file {
+	struct list_node list;
+	struct file f;
+	unsigned int filenum;
+	size_t refs;
+};
 
-	/* Store open file in cache. */
-	file_open(&f[i], block_fnames[index], 0,
-		  O_RDONLY | (use_mmap ? 0 : O_NO_MMAP));
+/**
+ * done_range - Part of a block file which has been finished with.
+ *
+ * @filenum: which block file
+ * @start: offset of the start of the range
+ * @end: offset just past the end of the range
+ */
+struct done_range {
+	unsigned int filenum;
+	off_t start, end;
+};
 
-	/* Increment cache pointer. */
-	next++;
-	if (next == NUM_BLOCKFILES)
-		next = 0;
+struct block_file_pool {
+	pthread_mutex_t lock;
+	char **block_fnames;
+	bool use_mmap;
+	const u8 *xor_key;
+	size_t max_open, num_open;
+	struct list_head files;
+	size_t hits, misses;
 
-	/* Return (now cached) file handle. */
-	return f + i;
+	/* Finished ranges still mapped, oldest first (a ring buffer), if
+	 * limited to max_mapped bytes. */
+	u64 max_mapped, mapped, released;
+	struct done_range *done;
+	size_t done_first, done_num, done_max;
+};
+
+static void close_pooled_file(struct block_file_pool *pool,
+			      struct pooled_file *pf)
+{
+	list_del(&pf->list);
+	file_close(&pf->f);
+	free(pf);
+	pool->num_open--;
 }
 
-size_t read_blockfiles(tal_t *tal_ctx ,
-		       bool use_testnet, bool quiet, bool use_mmap, 
-		       char **block_fnames, 
-		       struct block_map *block_map, 
-		       struct block **genesis, 
-		       unsigned long block_end)
+/* Closes the least recently used idle files until few enough are open. */
+static void trim_pool(struct block_file_pool *pool)
 {
-	u32 netmarker;
-	if (use_testnet) {
-		netmarker = 0x0709110B;
+	struct pooled_file *pf, *prev;
+
+	list_for_each_rev_safe(&pool->files, pf, prev, list) {
+		if (pool->num_open <= pool->max_open)
+			break;
+		if (!pf->refs)
+			close_pooled_file(pool, pf);
+	}
+}
+
+static void destroy_block_file_pool(struct block_file_pool *pool)
+{
+	struct pooled_file *pf, *next;
+
+	list_for_each_safe(&pool->files, pf, next, list)
+		close_pooled_file(pool, pf);
+	free(pool->done);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+struct block_file_pool *block_file_pool_new(const tal_t *ctx,
+					    char **block_fnames,
+					    size_t max_open, u64 max_mapped,
+					    bool use_mmap, const u8 *xor_key)
+{
+	struct block_file_pool *pool = tal(ctx, struct block_file_pool);
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->block_fnames = block_fnames;
+	pool->use_mmap = use_mmap;
+	pool->xor_key = xor_key;
+	pool->max_open = max_open ? max_open : 1;
+	pool->num_open = 0;
+	list_head_init(&pool->files);
+	pool->hits = pool->misses = 0;
+	pool->max_mapped = max_mapped;
+	pool->mapped = pool->released = 0;
+	pool->done = NULL;
+	pool->done_first = pool->done_num = pool->done_max = 0;
+	tal_add_destructor(pool, destroy_block_file_pool);
+	return pool;
+}
+
+struct file *block_file_get(struct block_file_pool *pool, unsigned int index)
+{
+	struct pooled_file *pf;
+
+	pthread_mutex_lock(&pool->lock);
+	list_for_each(&pool->files, pf, list) {
+		if (pf->filenum == index) {
+			pool->hits++;
+			goto found;
+		}
+	}
+
+	pool->misses++;
+	pf = malloc(sizeof(*pf));
+	if (!pf)
+		err(1, "Allocating block file %s", pool->block_fnames[index]);
+	block_file_open(&pf->f, pool->block_fnames[index], pool->use_mmap,
+			pool->xor_key);
+	/* Blocks are mostly read forwards through each file. */
+	if (pf->f.mmap)
+		madvise(pf->f.mmap, pf->f.len, MADV_SEQUENTIAL);
+	else
+		posix_fadvise(pf->f.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	pf->filenum = index;
+	pf->refs = 0;
+	list_add(&pool->files, &pf->list);
+	pool->num_open++;
+	/* Make room, now that we won't be the one closed. */
+	pf->refs++;
+	trim_pool(pool);
+	pthread_mutex_unlock(&pool->lock);
+	return &pf->f;
+
+found:
+	list_del(&pf->list);
+	list_add(&pool->files, &pf->list);
+	pf->refs++;
+	pthread_mutex_unlock(&pool->lock);
+	return &pf->f;
+}
+
+void block_file_put(struct block_file_pool *pool, struct file *f)
+{
+	struct pooled_file *pf = container_of(f, struct pooled_file, f);
+
+	pthread_mutex_lock(&pool->lock);
+	assert(pf->refs);
+	pf->refs--;
+	trim_pool(pool);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Drops a finished range's pages from memory (they are re-read from
+ * the file if anyone still needs them). */
+static void release_range(struct block_file_pool *pool,
+			  const struct done_range *r)
+{
+	struct pooled_file *pf;
+	off_t page = getpagesize(), start, end;
+
+	list_for_each(&pool->files, pf, list) {
+		if (pf->filenum == r->filenum)
+			goto found;
+	}
+	/* Closed since, so already unmapped. */
+	return;
+
+found:
+	start = r->start & ~(page - 1);
+	end = (r->end + page - 1) & ~(page - 1);
+	if (pf->f.mmap) {
+		if (end > pf->f.len)
+			end = (pf->f.len + page - 1) & ~(page - 1);
+		madvise(pf->f.mmap + start, end - start, MADV_DONTNEED);
+	}
+	posix_fadvise(pf->f.fd, start, end - start, POSIX_FADV_DONTNEED);
+	pool->released += r->end - r->start;
+}
+
+void block_file_done(struct block_file_pool *pool, const struct block *b)
+{
+	off_t start = b->pos, end = b->pos + block_tx_len(b);
+	struct done_range *last;
+
+	if (!pool->max_mapped)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+
+	/* Blocks in a file often follow each other: extend the last range. */
+	last = pool->done_num
+		? &pool->done[(pool->done_first + pool->done_num - 1) % pool->done_max]
+		: NULL;
+	if (last && last->filenum == b->filenum
+	    && start >= last->end && start - last->end <= getpagesize()) {
+		pool->mapped += end - last->end;
+		last->end = end;
 	} else {
-		netmarker = 0xD9B4BEF9;
-	}
-        
-	block_map_init(block_map);
-	size_t num_misses = 0;
-	off_t last_discard;
-	size_t i, block_count = 0;
-	struct block *b;
-	for (i = 0; i < tal_count(block_fnames); i++) {
-		off_t off = 0;
-
-		/* new-style starts from 1, old-style starts from 0 */
-		if (!block_fnames[i]) {
-			if (i) {
-                                warnx("Missing block info for %zu", i);
-			}
-			continue;
+		if (pool->done_num == pool->done_max) {
+			size_t i, old_max = pool->done_max;
+			struct done_range *old = pool->done;
+
+			pool->done_max = old_max ? old_max * 2 : 64;
+			pool->done = malloc(pool->done_max * sizeof(*pool->done));
+			if (!pool->done)
+				err(1, "Allocating %zu mapped ranges", pool->done_max);
+			for (i = 0; i < pool->done_num; i++)
+				pool->done[i] = old[(pool->done_first + i) % old_max];
+			pool->done_first = 0;
+			free(old);
 		}
+		last = &pool->done[(pool->done_first + pool->done_num++) % pool->done_max];
+		last->filenum = b->filenum;
+		last->start = start;
+		last->end = end;
+		pool->mapped += end - start;
+	}
 
-		if (!quiet) {
-			fprintf(stderr, "bitcoin-iterate: Processing %s (%zi/%zu files, %zi blocks)\n",
-				block_fnames[i], i+1, tal_count(block_fnames), block_count);
+	/* Over budget: release the oldest ranges. */
+	while (pool->mapped > pool->max_mapped && pool->done_num) {
+		struct done_range *r = &pool->done[pool->done_first];
+
+		release_range(pool, r);
+		pool->mapped -= r->end - r->start;
+		pool->done_first = (pool->done_first + 1) % pool->done_max;
+		pool->done_num--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void block_file_pool_print_stats(const struct block_file_pool *pool)
+{
+	fprintf(stderr, "bitcoin-iterate: Block files: %zu hits, %zu misses (%zu kept open)\n",
+		pool->hits, pool->misses, pool->max_open);
+	if (pool->max_mapped)
+		fprintf(stderr, "bitcoin-iterate: Released %.1f MB of finished blocks to stay under %.1f MB mapped\n",
+			pool->released / (1024.0 * 1024.0),
+			pool->max_mapped / (1024.0 * 1024.0));
+}
+
+void block_buffer_init(struct block_buffer *bb)
+{
+	bb->buf = NULL;
+	bb->cap = 0;
+}
+
+void block_buffer_free(struct block_buffer *bb)
+{
+	free(bb->buf);
+	block_buffer_init(bb);
+}
+
+size_t block_tx_len(const struct block *b)
+{
+	varint_t n = b->bh.transaction_count;
+	size_t count_len = n < 0xfd ? 1 : n <= 0xffff ? 3 : n <= 0xffffffff ? 5 : 9;
+
+	return b->bh.len - 80 - count_len;
+}
+
+struct file *block_transactions(struct block_buffer *bb, struct file *f,
+				const struct block *b, off_t *off)
+{
+	size_t len = block_tx_len(b);
+
+	if (f->mmap) {
+		*off = b->pos;
+		return f;
+	}
+
+	if (len > bb->cap) {
+		free(bb->buf);
+		bb->cap = len;
+		bb->buf = malloc(bb->cap);
+		if (!bb->buf)
+			err(1, "Allocating %zu bytes for block", bb->cap);
+	}
+	file_read(f, b->pos, len, bb->buf);
+
+	bb->f.name = f->name;
+	bb->f.fd = -1;
+	bb->f.len = len;
+	bb->f.mmap = bb->buf;
+	bb->f.xor_key = NULL;
+	*off = 0;
+	return &bb->f;
+}
+
+void block_readahead(struct file *f, const struct block *b)
+{
+	if (!f->mmap)
+		posix_fadvise(f->fd, b->pos, block_tx_len(b),
+			      POSIX_FADV_WILLNEED);
+}
+
+/**
+ * skip - A gap skipped while looking for the next block header.
+ *
+ * @start: offset the gap starts at
+ * @len: length of the gap
+ * @at_end: whether the gap ran to the end of the file
+ */
+struct skip {
+	off_t start, len;
+	bool at_end;
+};
+
+/**
+ * file_scan - Everything found while scanning one block file.
+ *
+ * Filled in by scanning threads, which cannot use tal, so the arrays
+ * are malloc'ed; the merge step copies the blocks into tal memory.
+ * @state is where the scan started and, after it, what was scanned;
+ * @unchanged is set if the file didn't need scanning at all;
+ * @padding counts the zero bytes skipped between (and after) blocks.
+ */
+struct file_scan {
+	struct blockfile_state state;
+	bool unchanged;
+	u64 padding;
+	struct block *blocks;
+	size_t num_blocks, max_blocks;
+	struct skip *skips;
+	size_t num_skips, max_skips;
+};
+
+/**
+ * scan_batch - A run of consecutive block files scanned concurrently.
+ */
+struct scan_batch {
+	char **block_fnames;
+	struct blockfile_state *states;
+	size_t first;
+	struct file_scan *scans;
+	u32 netmarker;
+	bool use_mmap;
+	const u8 *xor_key;
+};
+
+static void *grow_array(void *arr, size_t *max, size_t num, size_t size)
+{
+	if (num < *max)
+		return arr;
+	*max = *max ? *max * 2 : 64;
+	arr = realloc(arr, *max * size);
+	if (!arr)
+		err(1, "Allocating %zu scan entries", *max);
+	return arr;
+}
+
+static void add_skip(struct file_scan *scan, off_t start, off_t len, bool at_end)
+{
+	scan->skips = grow_array(scan->skips, &scan->max_skips,
+				 scan->num_skips, sizeof(*scan->skips));
+	scan->skips[scan->num_skips].start = start;
+	scan->skips[scan->num_skips].len = len;
+	scan->skips[scan->num_skips].at_end = at_end;
+	scan->num_skips++;
+}
+
+static void scan_blockfile(void *arg, size_t task)
+{
+	struct scan_batch *batch = arg;
+	struct file_scan *scan = &batch->scans[task];
+	size_t filenum = batch->first + task;
+	struct file f;
+	struct stat st;
+	off_t off, last_discard;
+
+	memset(scan, 0, sizeof(*scan));
+	if (!batch->block_fnames[filenum])
+		return;
+
+	if (batch->states) {
+		scan->state = batch->states[filenum];
+		if (stat(batch->block_fnames[filenum], &st) != 0)
+			err(1, "Could not stat %s", batch->block_fnames[filenum]);
+		if (st.st_size == scan->state.len
+		    && st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec
+		       == scan->state.mtime) {
+			scan->unchanged = true;
+			return;
 		}
+	}
 
-		last_discard = off = 0;
-		for (;;) {
-			off_t block_start;
-			struct file *f = block_file(block_fnames, i, use_mmap);
+	block_file_open(&f, batch->block_fnames[filenum], batch->use_mmap,
+			batch->xor_key);
+	off = last_discard = scan->state.end;
+	for (;;) {
+		off_t block_start = off;
+		struct block *b;
 
-			block_start = off;
-			if (!next_block_header_prefix(f, &off, netmarker)) {
-                                if (off != block_start) {
-                                        warnx("Skipped %lu at end of %s",
-					      off - block_start, block_fnames[i]);
-				}
-                                break;
-			}
-			if (off != block_start) {
-                                warnx("Skipped %lu@%lu in %s",
-				      off - block_start, block_start,
-				      block_fnames[i]);
+		if (!next_block_header_prefix(&f, &off, batch->netmarker,
+					      &scan->padding)) {
+			if (off != block_start)
+				add_skip(scan, block_start, off - block_start, true);
+			break;
+		}
+		if (off != block_start)
+			add_skip(scan, block_start, off - block_start, false);
+
+		block_start = off;
+		scan->blocks = grow_array(scan->blocks, &scan->max_blocks,
+					  scan->num_blocks, sizeof(*scan->blocks));
+		b = &scan->blocks[scan->num_blocks];
+		b->filenum = filenum;
+		b->height = -1;
+		if (!read_block_header(&b->bh, &f, &off,
+				       b->id, batch->netmarker))
+			break;
+		b->pos = off;
+		scan->num_blocks++;
+
+		skip_transactions(&b->bh, block_start, &off);
+		scan->state.end = off;
+		if (off > last_discard + CHUNK && f.mmap) {
+			size_t len = CHUNK;
+			if ((size_t)last_discard + len > f.len) {
+				len = f.len - last_discard;
 			}
+			madvise(f.mmap + last_discard, len, MADV_DONTNEED);
+			last_discard += len;
+		}
+	}
+	if (batch->states) {
+		/* Blocks appended after we stat'ed will be rescanned next time. */
+		scan->state.len = st.st_size;
+		scan->state.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	}
+	file_close(&f);
+}
+
+size_t read_blockfiles(tal_t *tal_ctx,
+		       bool use_testnet, bool quiet, bool use_mmap,
+		       const u8 *xor_key, struct thread_pool *pool,
+		       char **block_fnames,
+		       struct blockfile_state *states,
+		       struct block_map *block_map,
+		       struct block **genesis,
+		       unsigned long block_end)
+{
+	struct scan_batch batch;
+	size_t i, batch_size, num_misses = 0, block_count = 0;
+	size_t num_files = tal_count(block_fnames);
+	bool done = false;
 
-			block_start = off;
-			b = tal(tal_ctx, struct block);
-			b->filenum = i;
-			b->height = -1;
-			if (!read_block_header(&b->bh, f, &off,
-					       b->id, netmarker)) {
-                                tal_free(b);
-				break;
+	batch.block_fnames = block_fnames;
+	batch.states = states;
+	batch.use_mmap = use_mmap;
+	batch.xor_key = xor_key;
+	if (use_testnet) {
+		batch.netmarker = 0x0709110B;
+	} else {
+		batch.netmarker = 0xD9B4BEF9;
+	}
+
+	/* Scanning more files than we have threads keeps them all busy;
+	 * scanning far more wastes work if we stop early for block_end. */
+	batch_size = thread_pool_size(pool) * SCAN_FILES_PER_THREAD;
+	if (!pool)
+		batch_size = 1;
+	batch.scans = tal_arr(tal_ctx, struct file_scan, batch_size);
+
+	for (batch.first = 0; batch.first < num_files && !done; batch.first += batch_size) {
+		size_t n = num_files - batch.first;
+
+		if (n > batch_size)
+			n = batch_size;
+		thread_pool_run(pool, n, scan_blockfile, &batch);
+
+		/* Merge in file order, exactly as a serial scan would. */
+		for (i = 0; i < n; i++) {
+			struct file_scan *scan = &batch.scans[i];
+			size_t j, filenum = batch.first + i;
+			struct block *blocks;
+
+			if (done)
+				goto free_scan;
+
+			/* new-style starts from 1, old-style starts from 0 */
+			if (!block_fnames[filenum]) {
+				if (filenum) {
+					warnx("Missing block info for %zu", filenum);
+				}
+				continue;
 			}
 
-			b->pos = off;
-                        //if block b exists and can be added to the block map
-                        if (add_block(block_map, b, genesis, block_fnames, &num_misses)) { 
-                                /* Go 100 past the block they asked
-				 * for (avoid minor forks) */
-                                if (block_end != -1UL && b->height > block_end + 100) {
-                                        if (!genesis) {
-                                                errx(1, "Could not find a genesis block.");
-					}
-                                        i = tal_count(block_fnames);
-                                        break;
+			if (scan->unchanged)
+				continue;
+			if (states)
+				states[filenum] = scan->state;
+
+			/* Files and blocks so far include those from the cache. */
+			if (!quiet) {
+				fprintf(stderr, "bitcoin-iterate: Processing %s (%zi/%zu files, %zi blocks)\n",
+					block_fnames[filenum], filenum+1, num_files,
+					block_map->num_cached + block_count);
+			}
+			for (j = 0; j < scan->num_skips; j++) {
+				if (scan->skips[j].at_end) {
+					warnx("Skipped %lu at end of %s",
+					      scan->skips[j].len, block_fnames[filenum]);
+				} else {
+					warnx("Skipped %lu@%lu in %s",
+					      scan->skips[j].len, scan->skips[j].start,
+					      block_fnames[filenum]);
 				}
-                        }
+			}
+			if (!quiet && scan->padding) {
+				fprintf(stderr, "bitcoin-iterate: %s has %llu bytes of zero padding\n",
+					block_fnames[filenum],
+					(unsigned long long)scan->padding);
+			}
+
+			blocks = tal_dup(tal_ctx, struct block,
+					     scan->blocks, scan->num_blocks, 0);
+			for (j = 0; j < scan->num_blocks; j++) {
+				struct block *b = &blocks[j];
 
-			skip_transactions(&b->bh, block_start, &off);
-			if (off > last_discard + CHUNK && f->mmap) {
-                                size_t len = CHUNK;
-                                if ((size_t)last_discard + len > f->len) {
-                                        len = f->len - last_discard;
+				//if block b exists and can be added to the block map
+				if (add_block(block_map, b, genesis, block_fnames, &num_misses)) {
+					/* Go 100 past the block they asked
+					 * for (avoid minor forks) */
+					if (block_end != -1UL && b->height > block_end + 100) {
+						if (!*genesis) {
+							errx(1, "Could not find a genesis block.");
+						}
+						done = true;
+						break;
+					}
 				}
-                                madvise(f->mmap + last_discard, len,
-                                        MADV_DONTNEED);
-                                last_discard += len;
+				block_count++;
 			}
-			block_count++;
+		free_scan:
+			free(scan->blocks);
+			free(scan->skips);
 		}
 	}
+	tal_free(batch.scans);
 	return block_count;
 }
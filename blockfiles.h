@@ -1,7 +1,10 @@
 #ifndef BITCOIN_ITERATE_BLOCKFILES_H
 #define BITCOIN_ITERATE_BLOCKFILES_H
 #include <ccan/tal/tal.h>
+#include <ccan/short_types/short_types.h>
 #include "block.h"
+#include "io.h"
+#include "threadpool.h"
 
 /**
  * Returns an array in which each string is the path to a blockfile on
@@ -15,18 +18,174 @@
 char **block_filenames(tal_t *ctx, const char *base, bool testnet);
 
 /**
- * Returns an open file handle for the block file at the given index
- * in the array of block filenames.
+ * Returns the key bitcoind obfuscates block files with (the 8 bytes
+ * of xor.dat beside them), or NULL if they aren't obfuscated.
+ *
+ * @param ctx          -- pointer to tal context
+ * @param block_fnames -- an array of block filenames (strings)
+ */
+const u8 *block_xor_key(const tal_t *ctx, char **block_fnames);
+
+/**
+ * Opens a block file for reading.
+ *
+ * Block files obfuscated with xor_key are never mapped, even if
+ * use_mmap is set: they are read (and de-obfuscated) instead.
+ *
+ * @param f        -- the file to open
+ * @param name     -- the block file's name
+ * @param use_mmap -- whether to use memory mapping
+ * @param xor_key  -- the key from block_xor_key() (may be NULL)
+ */
+void block_file_open(struct file *f, const char *name, bool use_mmap,
+		     const u8 *xor_key);
+
+struct block_file_pool;
+
+/**
+ * Returns a pool of open block files, which keeps the most recently
+ * used files open so blocks can be read from them without reopening
+ * (and remapping) a file every time chain order moves between files.
  *
- * Keeps a temporary cache so repeated calls with the same array of
- * block filenames and index will return the same open file handle.
+ * The pool can be shared between threads.  Its statistics count how
+ * often a requested file was already open (hits) or not (misses).
  *
+ * If max_mapped is set, blocks which have been finished with (see
+ * block_file_done()) are dropped from memory, oldest first, once more
+ * than max_mapped bytes of them would otherwise stay resident.
+ *
+ * @param ctx          -- pointer to tal context; freeing the pool closes its files
  * @param block_fnames -- an array of block filenames (strings)
- * @param index        -- the index of the block file to open in the array of filenames
+ * @param max_open     -- how many files to keep open when not in use
+ * @param max_mapped   -- bytes of finished blocks to keep in memory (0 for no limit)
  * @param use_mmap     -- whether to use memory mapping when handling block files
+ * @param xor_key      -- the key block files are obfuscated with (or NULL)
+ */
+struct block_file_pool *block_file_pool_new(const tal_t *ctx,
+					    char **block_fnames,
+					    size_t max_open, u64 max_mapped,
+					    bool use_mmap, const u8 *xor_key);
+
+/**
+ * Returns an open file handle for the block file at the given index
+ * in the array of block filenames, which stays open until it is given
+ * back with block_file_put().
+ *
+ * More than max_open files are opened if that many are in use at
+ * once; the extra ones are closed when they are given back.
+ *
+ * @param pool  -- the block file pool
+ * @param index -- the index of the block file to open in the array of filenames
+ */
+struct file *block_file_get(struct block_file_pool *pool, unsigned int index);
+
+/**
+ * Gives back a file handle from block_file_get().
+ *
+ * @param pool -- the block file pool
+ * @param f    -- the file handle
+ */
+void block_file_put(struct block_file_pool *pool, struct file *f);
+
+/**
+ * Notes that a block's transactions are no longer needed, so its pages
+ * can be dropped from memory (unmapped, and dropped from the page
+ * cache) if the pool is over its max_mapped budget.
+ *
+ * Dropped pages are simply read again if they are used after all.
+ *
+ * @param pool -- the block file pool
+ * @param b    -- the block
+ */
+void block_file_done(struct block_file_pool *pool, const struct block *b);
+
+/**
+ * Prints the block file pool's hits and misses to stderr.
+ *
+ * @param pool -- the block file pool
+ */
+void block_file_pool_print_stats(const struct block_file_pool *pool);
+
+/**
+ * Returns the number of bytes from a block's first transaction (at
+ * b->pos) to its end.
+ *
+ * @param b -- the block
+ */
+size_t block_tx_len(const struct block *b);
+
+/**
+ * block_buffer - A reusable buffer holding one block's transactions.
+ *
+ * @f: a file over @buf, which the parse functions read like a mapped file
+ * @buf: the transactions of the last block read
+ * @cap: allocated size of @buf
+ *
+ * @buf is malloc'ed, so buffers can be used by parsing threads.
+ */
+struct block_buffer {
+	struct file f;
+	u8 *buf;
+	size_t cap;
+};
+
+/**
+ * Initializes an empty block buffer.
+ *
+ * @param bb -- the block buffer
+ */
+void block_buffer_init(struct block_buffer *bb);
+
+/**
+ * Frees a block buffer's memory.
  *
+ * @param bb -- the block buffer
  */
-struct file *block_file(char **block_fnames, unsigned int index, bool use_mmap);
+void block_buffer_free(struct block_buffer *bb);
+
+/**
+ * Returns a file to parse a block's transactions from, and sets *off
+ * to the first one.
+ *
+ * A mapped file is returned as it is.  Otherwise all the block's
+ * transactions are read into the buffer with a single read, rather
+ * than a read for every field, and the returned file (and anything
+ * parsed from it) is only valid until the buffer is next used.
+ *
+ * @param bb  -- the block buffer to read into
+ * @param f   -- the block's (open) block file
+ * @param b   -- the block
+ * @param off -- set to the offset of the block's first transaction
+ */
+struct file *block_transactions(struct block_buffer *bb, struct file *f,
+				const struct block *b, off_t *off);
+
+/**
+ * Asks the kernel to start reading a block's transactions in the
+ * background, so block_transactions() won't have to wait for them.
+ * Does nothing for a mapped file.
+ *
+ * @param f -- the block's (open) block file
+ * @param b -- the block
+ */
+void block_readahead(struct file *f, const struct block *b);
+
+/**
+ * blockfile_state - How much of a block file has been scanned.
+ *
+ * @len: length of the file when it was scanned
+ * @mtime: modification time of the file (in nanoseconds) when scanned
+ * @end: offset just past the last complete block found
+ *
+ * bitcoind only ever appends blocks to block files (over the zeroes it
+ * preallocates), so a file can be rescanned from @end to find any
+ * blocks added since.
+ */
+struct blockfile_state {
+	u64 len;
+	s64 mtime;
+	u64 end;
+};
 
 /**
  * Reads blockfiles from disk from the genesis block to the given end
@@ -37,13 +196,24 @@ struct file *block_file(char **block_fnames, unsigned int index, bool use_mmap);
  *
  * Block parsing may extend up to 100 blocks past the intended ending
  * block (to avoid minor forks).
+ *
+ * Block files are scanned concurrently on the given thread pool, then
+ * merged into the block map in file order.
+ *
+ * If states are given, each file is only scanned from its state's end
+ * offset, files whose length and modification time match their state
+ * are not scanned at all, and the states are updated to match what
+ * was scanned.
  * 
  * @param tal_ctx      -- pointer to tal context
  * @param use_testnet  -- whether to use testnet
  * @param quiet        -- whether to silence output
  * @param use_mmap     -- whether to use memory mapping when handling block files
+ * @param xor_key      -- the key block files are obfuscated with (or NULL)
+ * @param pool         -- thread pool to scan block files on (NULL to scan serially)
  * @param block_fnames -- an array of block filenames (strings)
- * @param block_map    -- the block map to populate
+ * @param states       -- scan state of each block file (or NULL to scan them all)
+ * @param block_map    -- the (initialized) block map to add blocks to
  * @param genesis      -- pointer to genesis block struct
  * @param block_end    -- height of specified end block (-1 for end of chain)
  * @return number of blocks parsed
@@ -51,7 +221,9 @@ struct file *block_file(char **block_fnames, unsigned int index, bool use_mmap);
  */
 size_t read_blockfiles(tal_t *tal_ctx,
 		       bool use_testnet, bool quiet, bool use_mmap,
-		       char **block_fnames, struct block_map *block_map,
+		       const u8 *xor_key, struct thread_pool *pool,
+		       char **block_fnames, struct blockfile_state *states,
+		       struct block_map *block_map,
 		       struct block **genesis, unsigned long block_end);
 
 #endif /* BITCOIN_ITERATE_BLOCKFILES_H */
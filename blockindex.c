@@ -0,0 +1,246 @@
+#include <ccan/err/err.h>
+#include <ccan/endian/endian.h>
+#include <ccan/tal/path/path.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blockindex.h"
+#include "leveldb.h"
+#include "io.h"
+#include "blockfiles.h"
+
+#define BLOCK_INDEX_DIR_NAME	"index"
+
+/* Key prefix of block index records (followed by the block hash). */
+#define DB_BLOCK_INDEX		'b'
+
+/* Bits of a record's nStatus (see bitcoind's chain.h). */
+#define BLOCK_HAVE_DATA		8
+#define BLOCK_HAVE_UNDO		16
+#define BLOCK_FAILED_MASK	(32 | 64)
+
+/* Serialized block header: version to nonce, inclusive. */
+#define BLOCK_HEADER_SIZE	80
+
+/**
+ * pull_core_varint - Decode one of bitcoind's VARINTs.
+ *
+ * These are the MSB-first base-128 integers bitcoind uses on disk,
+ * not the CompactSize integers inside blocks.
+ */
+static bool pull_core_varint(const u8 **p, const u8 *end, u64 *v)
+{
+	*v = 0;
+	while (*p < end) {
+		u8 c = *(*p)++;
+
+		if (*v > (~(u64)0 >> 7))
+			return false;
+		*v = (*v << 7) | (c & 0x7F);
+		if (!(c & 0x80))
+			return true;
+		(*v)++;
+	}
+	return false;
+}
+
+static u32 pull_le32(const u8 **p)
+{
+	le32 v;
+
+	memcpy(&v, *p, sizeof(v));
+	*p += sizeof(v);
+	return le32_to_cpu(v);
+}
+
+static size_t varint_size(varint_t v)
+{
+	if (v < 0xfd)
+		return 1;
+	if (v <= 0xffff)
+		return 3;
+	if (v <= 0xffffffff)
+		return 5;
+	return 9;
+}
+
+/* Decodes a CDiskBlockIndex; returns false unless its data is usable.
+ * Sets b->pos to the offset of the block data (after length). */
+static bool decode_block_index(const struct leveldb_record *rec,
+			       struct block *b)
+{
+	const u8 *p = rec->value, *end = rec->value + rec->valuelen;
+	u64 version, height, status, ntx, file = 0, datapos = 0, undopos;
+
+	if (rec->keylen != 1 + sizeof(b->id))
+		return false;
+
+	if (!pull_core_varint(&p, end, &version)
+	    || !pull_core_varint(&p, end, &height)
+	    || !pull_core_varint(&p, end, &status)
+	    || !pull_core_varint(&p, end, &ntx))
+		return false;
+	if ((status & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO))
+	    && !pull_core_varint(&p, end, &file))
+		return false;
+	if ((status & BLOCK_HAVE_DATA)
+	    && !pull_core_varint(&p, end, &datapos))
+		return false;
+	if ((status & BLOCK_HAVE_UNDO)
+	    && !pull_core_varint(&p, end, &undopos))
+		return false;
+	if (end - p < BLOCK_HEADER_SIZE)
+		return false;
+
+	if (!(status & BLOCK_HAVE_DATA) || (status & BLOCK_FAILED_MASK))
+		return false;
+
+	memcpy(b->id, rec->key + 1, sizeof(b->id));
+	b->height = height;
+	b->filenum = file;
+	b->pos = datapos;
+	b->bh.version = pull_le32(&p);
+	memcpy(b->bh.prev_hash, p, sizeof(b->bh.prev_hash));
+	p += sizeof(b->bh.prev_hash);
+	memcpy(b->bh.merkle_hash, p, sizeof(b->bh.merkle_hash));
+	p += sizeof(b->bh.merkle_hash);
+	b->bh.timestamp = pull_le32(&p);
+	b->bh.target = pull_le32(&p);
+	b->bh.nonce = pull_le32(&p);
+	b->bh.transaction_count = ntx;
+	return true;
+}
+
+static int block_filepos_cmp(const void *a, const void *b)
+{
+	const struct block *ba = a, *bb = b;
+
+	if (ba->filenum != bb->filenum)
+		return ba->filenum < bb->filenum ? -1 : 1;
+	if (ba->pos != bb->pos)
+		return ba->pos < bb->pos ? -1 : 1;
+	return 0;
+}
+
+static int block_height_cmp(const void *a, const void *b)
+{
+	const struct block *ba = a, *bb = b;
+
+	if (ba->height != bb->height)
+		return ba->height < bb->height ? -1 : 1;
+	return 0;
+}
+
+/* Fills in marker and length from the 8 bytes before each block's
+ * data, and moves pos to the first transaction.  Blocks which don't
+ * check out get height -1.  @blocks is sorted by file and position, so
+ * each file is opened once. */
+static void read_block_lengths(struct block *blocks, size_t num,
+			       char **block_fnames, bool use_mmap,
+			       const u8 *xor_key, u32 netmarker)
+{
+	struct file f;
+	bool open = false;
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		struct block *b = &blocks[i];
+		le32 prefix[2];
+		const void *p;
+
+		if (b->filenum >= tal_count(block_fnames)
+		    || !block_fnames[b->filenum]) {
+			warnx("Block index refers to missing block file %u",
+			      b->filenum);
+			b->height = -1;
+			continue;
+		}
+		if (!open || f.name != block_fnames[b->filenum]) {
+			if (open)
+				file_close(&f);
+			block_file_open(&f, block_fnames[b->filenum],
+					use_mmap, xor_key);
+			open = true;
+		}
+		if (b->pos < sizeof(prefix) || b->pos > f.len) {
+			warnx("Block index position %lu out of range in %s",
+			      b->pos, f.name);
+			b->height = -1;
+			continue;
+		}
+
+		p = file_read(&f, b->pos - sizeof(prefix), sizeof(prefix), prefix);
+		if (p != prefix)
+			memcpy(prefix, p, sizeof(prefix));
+		if (le32_to_cpu(prefix[0]) != netmarker
+		    || b->pos + le32_to_cpu(prefix[1]) > f.len) {
+			warnx("No block at %lu in %s", b->pos, f.name);
+			b->height = -1;
+			continue;
+		}
+		b->bh.D9B4BEF9 = netmarker;
+		b->bh.len = le32_to_cpu(prefix[1]);
+		b->pos += BLOCK_HEADER_SIZE + varint_size(b->bh.transaction_count);
+	}
+	if (open)
+		file_close(&f);
+}
+
+size_t read_blockindex(tal_t *tal_ctx,
+		       bool use_testnet, bool quiet, bool use_mmap,
+		       const u8 *xor_key, char **block_fnames,
+		       struct block_map *block_map,
+		       struct block **genesis)
+{
+	const u8 prefix = DB_BLOCK_INDEX;
+	struct leveldb_record *recs;
+	struct block *blocks;
+	char *indexdir = NULL;
+	size_t i, num = 0, num_misses = 0, block_count = 0;
+	u32 netmarker = use_testnet ? 0x0709110B : 0xD9B4BEF9;
+
+	for (i = 0; i < tal_count(block_fnames) && !indexdir; i++) {
+		if (block_fnames[i])
+			indexdir = path_join(tal_ctx,
+					     path_dirname(tal_ctx, block_fnames[i]),
+					     BLOCK_INDEX_DIR_NAME);
+	}
+	if (!indexdir)
+		errx(1, "No block files to find a block index beside");
+
+	if (!quiet)
+		fprintf(stderr, "bitcoin-iterate: Reading block index at %s\n", indexdir);
+
+	recs = leveldb_read(tal_ctx, indexdir, &prefix, sizeof(prefix));
+	blocks = tal_arr(tal_ctx, struct block, tal_count(recs));
+	for (i = 0; i < tal_count(recs); i++) {
+		if (decode_block_index(&recs[i], &blocks[num]))
+			num++;
+	}
+	tal_free(recs);
+
+	qsort(blocks, num, sizeof(*blocks), block_filepos_cmp);
+	read_block_lengths(blocks, num, block_fnames, use_mmap, xor_key,
+			   netmarker);
+
+	/* In height order every parent is added before its children. */
+	qsort(blocks, num, sizeof(*blocks), block_height_cmp);
+	block_map_init_sized(block_map, num);
+	for (i = 0; i < num; i++) {
+		struct block *b = &blocks[i];
+
+		if (b->height < 0)
+			continue;
+		/* Skip blocks we can't connect (eg. missing parent data) */
+		if (!is_zero(b->bh.prev_hash)
+		    && !block_map_get(block_map, b->bh.prev_hash))
+			continue;
+		add_block(block_map, b, genesis, block_fnames, &num_misses);
+		block_count++;
+	}
+
+	if (!quiet)
+		fprintf(stderr, "bitcoin-iterate: Read %zu blocks from block index (%zu not usable)\n",
+			block_count, tal_count(blocks) - block_count);
+	return block_count;
+}
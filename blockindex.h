@@ -0,0 +1,39 @@
+/*******************************************************************************
+ *
+ *  = blockindex.h
+ *
+ *  Defines a function for loading blocks from bitcoind's own block
+ *  index (the LevelDB database in blocks/index) rather than scanning
+ *  every block file.
+ *
+ */
+#ifndef BITCOIN_ITERATE_BLOCKINDEX_H
+#define BITCOIN_ITERATE_BLOCKINDEX_H
+#include <ccan/tal/tal.h>
+#include "block.h"
+
+/**
+ * read_blockindex - Populate the block map from bitcoind's block index.
+ *
+ * @tal_ctx: tal context for the blocks
+ * @use_testnet: whether to use testnet
+ * @quiet: whether to silence output
+ * @use_mmap: whether to use memory mapping when handling block files
+ * @xor_key: the key block files are obfuscated with (or NULL)
+ * @block_fnames: array of block filenames (the index lives beside them)
+ * @block_map: the block map to initialize and populate
+ * @genesis: set to the genesis block
+ *
+ * Only blocks whose data is stored (and which connect back to genesis
+ * through such blocks) are added; their heights come from the index.
+ * Each block's length is read from the 4 bytes before its data.
+ *
+ * Returns the number of blocks added.
+ */
+size_t read_blockindex(tal_t *tal_ctx,
+		       bool use_testnet, bool quiet, bool use_mmap,
+		       const u8 *xor_key, char **block_fnames,
+		       struct block_map *block_map,
+		       struct block **genesis);
+
+#endif /* BITCOIN_ITERATE_BLOCKINDEX_H */
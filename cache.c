@@ -4,12 +4,19 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <ccan/build_assert/build_assert.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/tal/path/path.h>
+#include <ccan/tal/str/str.h>
 #include <ccan/tal/grab_file/grab_file.h>
 #include <ccan/err/err.h>
 #include "cache.h"
 #include "blockfiles.h"
+#include "blockindex.h"
 
 /*
  * ================================================================================
@@ -18,114 +25,301 @@
  */
   
 
-static size_t read_blockcache(const tal_t *tal_ctx,
-			      bool quiet,
-			      struct block_map *block_map,
-			      const char *blockcache,
-			      struct block **genesis,
-			      char **block_fnames)
+#define BLOCKCACHE_NAME		"blockcache"
+#define BLOCKCACHE_TESTNET_NAME	"blockcache-testnet"
+#define BLOCKCACHE_MAGIC	0x656863616b636c62ULL	/* "blkcache" */
+#define BLOCKCACHE_VERSION	2
+
+/*
+ * The block cache is this header, then every block found (as struct
+ * block, in height order), then an open-addressed hash index of those
+ * blocks (see block_index_slot()), then the scan state of every block
+ * file.  It is mapped and used in place, so loading it costs page
+ * faults rather than parsing and hashing every block.
+ *
+ * Updates write a new cache and rename it over the old one, which
+ * leaves the old one mapped and intact for this run.
+ */
+struct blockcache_header {
+	u64 magic;
+	u32 version;
+	u32 block_size;
+	u64 num_blocks;
+	u32 num_slots;
+	u32 num_files;
+};
+
+/**
+ * blockcache - A mapped block cache.
+ *
+ * @map: the mapping
+ * @len: length of @map
+ * @blocks: the cached blocks
+ * @num_blocks: how many there are
+ * @index: the index slots
+ * @num_slots: how many there are
+ * @states: scan state of each block file the cache covers
+ */
+struct blockcache {
+	void *map;
+	size_t len;
+	struct block *blocks;
+	size_t num_blocks;
+	const u32 *index;
+	size_t num_slots;
+	struct blockfile_state *states;
+};
+
+/* Block files are never truncated or removed by bitcoind, except by
+ * pruning or reindexing, in which case we rebuild the cache. */
+static bool blockcache_is_valid(bool quiet, const struct blockcache *cache,
+				char **block_fnames)
 {
-	size_t i, num, num_misses = 0;
-	struct block *b = grab_file(tal_ctx, blockcache);
+	size_t i;
+	struct stat st;
 
-	if (!b)
-		err(1, "Could not read %s", blockcache);
+	for (i = 0; i < tal_count(cache->states); i++) {
+		if (!cache->states[i].len)
+			continue;
+		if (i >= tal_count(block_fnames) || !block_fnames[i]) {
+			if (!quiet)
+				fprintf(stderr, "bitcoin-iterate: Block file %zu is missing: rebuilding cache\n", i);
+			return false;
+		}
+		if (stat(block_fnames[i], &st) != 0)
+			err(1, "Could not stat %s", block_fnames[i]);
+		if ((u64)st.st_size < cache->states[i].len) {
+			if (!quiet)
+				fprintf(stderr, "bitcoin-iterate: %s has shrunk: rebuilding cache\n", block_fnames[i]);
+			return false;
+		}
+	}
+	return true;
+}
 
-	num = (tal_count(b) - 1) / sizeof(*b);
-	if (!quiet)
-		fprintf(stderr, "bitcoin-iterate: Adding %zu blocks from cache at %s\n", num, blockcache);
+static void unmap_blockcache(struct blockcache *cache)
+{
+	munmap(cache->map, cache->len);
+}
 
-	block_map_init_sized(block_map, num);
-	for (i = 0; i < num; i++)
-		add_block(block_map, &b[i], genesis, block_fnames, &num_misses);
+/* Maps the cache privately: blocks without a height yet may get one. */
+static struct blockcache *read_blockcache(const tal_t *tal_ctx,
+					  bool quiet,
+					  const char *blockcache,
+					  char **block_fnames)
+{
+	struct blockcache_header hdr;
+	struct blockcache *cache;
+	struct stat st;
+	size_t off;
+	int fd = open(blockcache, O_RDONLY);
+
+	if (fd < 0) {
+		if (errno != ENOENT)
+			err(1, "Could not open %s", blockcache);
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0)
+		err(1, "Could not stat %s", blockcache);
+	if (st.st_size < sizeof(hdr)
+	    || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	    || hdr.magic != BLOCKCACHE_MAGIC
+	    || hdr.version != BLOCKCACHE_VERSION
+	    || hdr.block_size != sizeof(struct block)
+	    || hdr.num_blocks > st.st_size / sizeof(struct block)
+	    || (hdr.num_slots & (hdr.num_slots - 1))
+	    || hdr.num_slots <= hdr.num_blocks
+	    || sizeof(hdr) + hdr.num_blocks * sizeof(struct block)
+	       + hdr.num_slots * sizeof(u32)
+	       + hdr.num_files * sizeof(struct blockfile_state) != st.st_size)
+		goto invalid;
+
+	cache = tal(tal_ctx, struct blockcache);
+	cache->len = st.st_size;
+	cache->map = mmap(NULL, cache->len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (cache->map == MAP_FAILED)
+		err(1, "Could not map %s", blockcache);
+	close(fd);
+	tal_add_destructor(cache, unmap_blockcache);
+
+	off = sizeof(hdr);
+	cache->blocks = (struct block *)((char *)cache->map + off);
+	cache->num_blocks = hdr.num_blocks;
+	off += hdr.num_blocks * sizeof(struct block);
+	cache->index = (const u32 *)((char *)cache->map + off);
+	cache->num_slots = hdr.num_slots;
+	off += hdr.num_slots * sizeof(u32);
+	cache->states = tal_dup(cache, struct blockfile_state,
+				(struct blockfile_state *)((char *)cache->map + off),
+				hdr.num_files, 0);
+
+	/* Blocks are in height order, and unknown heights sort last. */
+	if (!cache->num_blocks || !is_zero(cache->blocks[0].bh.prev_hash)) {
+		warnx("Invalid block cache %s: rebuilding it", blockcache);
+		return tal_free(cache);
+	}
+	if (!blockcache_is_valid(quiet, cache, block_fnames))
+		return tal_free(cache);
+	return cache;
 
-	return num;
+invalid:
+	close(fd);
+	warnx("Invalid block cache %s: rebuilding it", blockcache);
+	return NULL;
 }
 
-static bool blockcache_is_valid(bool quiet, const char *blockcache, char *last_block_fname)
+static void write_all(int fd, const void *p, size_t len, const char *fname)
 {
-  struct stat cache_st, block_st;
-  
-  if (stat(last_block_fname, &block_st) != 0)
-    errx(1, "Could not stat %s", last_block_fname);
-  if (stat(blockcache, &cache_st) == 0) {
-    if (block_st.st_mtime >= cache_st.st_mtime) {
-      /* Cache file is older than (or as old as) last block file */
-      if (!quiet)
-	fprintf(stderr, "bitcoin-iterate: %s is newer than cache\n", last_block_fname);
-      return false;
-    } else {
-      /* Cache file is newer than last block file */
-      return true;
-    }
-  } else {
-    /* No cache file */
-    return false;
-  }
-}
-void write_blockcache(struct block_map *block_map,
-		      bool quiet,
-		      const char *cachedir,
-		      const char *blockcache)
+	if (write(fd, p, len) != len)
+		err(1, "Short write to %s", fname);
+}
+
+static int block_height_cmp(const void *a, const void *b)
+{
+	const struct block *ba = *(const struct block **)a;
+	const struct block *bb = *(const struct block **)b;
+
+	/* Unknown heights (-1) go last. */
+	if (ba->height != bb->height)
+		return (u32)ba->height < (u32)bb->height ? -1 : 1;
+	if (ba->filenum != bb->filenum)
+		return ba->filenum < bb->filenum ? -1 : 1;
+	return ba->pos < bb->pos ? -1 : ba->pos > bb->pos;
+}
+
+static void write_blockcache(const tal_t *tal_ctx,
+			     struct block_map *block_map,
+			     bool quiet,
+			     const char *cachedir,
+			     const char *blockcache,
+			     const struct blockfile_state *states)
 {
-  struct block_map_iter it;
-  struct block *b;
-  int fd;
+	struct blockcache_header hdr;
+	struct block_map_iter it;
+	struct block *b, **blocks;
+	u32 *index;
+	size_t i, num = 0;
+	char *tmpname = tal_fmt(tal_ctx, "%s.tmp", blockcache);
+	int fd;
+
+	BUILD_ASSERT(sizeof(struct block)
+		     == offsetof(struct block, bh) + sizeof(struct block_header));
+
+	if (!quiet)
+		fprintf(stderr, "bitcoin-iterate: Writing blocks to cache at %s\n", blockcache);
 
-  if (!quiet)
-    fprintf(stderr, "bitcoin-iterate: Writing blocks to cache at %s\n", blockcache);
+	fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0 && errno == ENOENT) {
+		if (mkdir(cachedir, 0700) != 0)
+			err(1, "Creating cachedir '%s'", cachedir);
+		fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	}
+	if (fd < 0)
+		err(1, "Creating '%s' for writing", tmpname);
+
+	blocks = tal_arr(tal_ctx, struct block *, 0);
+	for (b = block_map_first(block_map, &it);
+	     b;
+	     b = block_map_next(block_map, &it)) {
+		tal_resize(&blocks, num + 1);
+		blocks[num++] = b;
+	}
+	qsort(blocks, num, sizeof(*blocks), block_height_cmp);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = BLOCKCACHE_MAGIC;
+	hdr.version = BLOCKCACHE_VERSION;
+	hdr.block_size = sizeof(struct block);
+	hdr.num_blocks = num;
+	hdr.num_files = tal_count(states);
+	/* At most half full, so probes stay short. */
+	for (hdr.num_slots = 16; hdr.num_slots < num * 2; hdr.num_slots *= 2);
+
+	index = tal_arrz(tal_ctx, u32, hdr.num_slots);
+	for (i = 0; i < num; i++) {
+		size_t slot = block_index_slot(blocks[i]->id, hdr.num_slots);
 
-  fd = open(blockcache, O_WRONLY|O_CREAT|O_TRUNC, 0600);
-  if (fd < 0 && errno == ENOENT) {
-    if (mkdir(cachedir, 0700) != 0)
-      err(1, "Creating cachedir '%s'", cachedir);
-    fd = open(blockcache, O_WRONLY|O_CREAT|O_EXCL, 0600);
-  }
-  if (fd < 0)
-    err(1, "Creating '%s' for writing", blockcache);
+		while (index[slot])
+			slot = (slot + 1) & (hdr.num_slots - 1);
+		index[slot] = i + 1;
+	}
+
+	write_all(fd, &hdr, sizeof(hdr), tmpname);
+	for (i = 0; i < num; i++)
+		write_all(fd, blocks[i], sizeof(*blocks[i]), tmpname);
+	write_all(fd, index, hdr.num_slots * sizeof(*index), tmpname);
+	write_all(fd, states, tal_count(states) * sizeof(*states), tmpname);
+	if (close(fd) != 0)
+		err(1, "Writing %s", tmpname);
+	if (rename(tmpname, blockcache) != 0)
+		err(1, "Renaming %s to %s", tmpname, blockcache);
 
-  for (b = block_map_first(block_map, &it);
-       b;
-       b = block_map_next(block_map, &it)) {
-    if (write(fd, b, sizeof(*b)) != sizeof(*b))
-      err(1, "Short write to %s", blockcache);
-  }
-  close(fd);
+	tal_free(blocks);
+	tal_free(index);
+	tal_free(tmpname);
+}
+
+static bool states_changed(const struct blockfile_state *old,
+			   const struct blockfile_state *states)
+{
+	return tal_count(old) != tal_count(states)
+		|| memcmp(old, states, tal_count(states) * sizeof(*states)) != 0;
 }
 
 size_t read_blockchain(tal_t *tal_ctx,
-		       bool quiet, bool use_mmap,
-		       bool use_testnet, char *cachedir,
+		       bool quiet, bool use_mmap, const u8 *xor_key,
+		       bool use_testnet, bool use_block_index,
+		       struct thread_pool *pool,
+		       char *cachedir,
 		       char **block_fnames,
 		       struct block_map *block_map, struct block **genesis, unsigned long block_end)
 {
 	size_t block_count = 0;
-	bool cache_existed = false;
-	char *blockcache;
-	if (cachedir && tal_count(block_fnames)) {
-		size_t last = tal_count(block_fnames) - 1;
-		char *last_block_fname = block_fnames[last];
-		blockcache = path_join(tal_ctx,
-				       cachedir,
-				       path_basename(tal_ctx, last_block_fname));
-		if (blockcache_is_valid(quiet, blockcache, last_block_fname)) {
-			block_count = read_blockcache(tal_ctx, quiet,
-						      block_map, blockcache,
-						      genesis, block_fnames);
-			if (block_count > 0) {
-				cache_existed = true;
-			}
-		}
-	}
-	if (block_count == 0) {
-		block_count = read_blockfiles(tal_ctx,
+	struct blockcache *cache = NULL;
+	char *blockcache = NULL;
+	struct blockfile_state *states = NULL;
+
+	if (use_block_index) {
+		block_count = read_blockindex(tal_ctx,
 					      use_testnet, quiet, use_mmap,
-					      block_fnames,
-					      block_map, genesis, block_end);
+					      xor_key, block_fnames,
+					      block_map, genesis);
+		if (!*genesis)
+			errx(1, "Block index has no genesis block.");
+		return block_count;
 	}
-	if (blockcache && !cache_existed && block_end == -1UL) {
-		write_blockcache(block_map, quiet, cachedir, blockcache);
+	if (cachedir && tal_count(block_fnames)) {
+		blockcache = path_join(tal_ctx, cachedir,
+				       use_testnet ? BLOCKCACHE_TESTNET_NAME
+				       : BLOCKCACHE_NAME);
+		states = tal_arrz(tal_ctx, struct blockfile_state,
+				  tal_count(block_fnames));
+		cache = read_blockcache(tal_ctx, quiet, blockcache, block_fnames);
+	}
+	if (cache) {
+		if (!quiet)
+			fprintf(stderr, "bitcoin-iterate: Using %zu blocks from cache at %s\n",
+				cache->num_blocks, blockcache);
+		memcpy(states, cache->states,
+		       sizeof(*states) * (tal_count(cache->states) < tal_count(states)
+					  ? tal_count(cache->states) : tal_count(states)));
+		block_map_init_cached(block_map, cache->blocks, cache->num_blocks,
+				      cache->index, cache->num_slots);
+		*genesis = &cache->blocks[0];
+		block_count = cache->num_blocks;
+	} else {
+		block_map_init(block_map);
 	}
+
+	/* With a cache, this only scans what was added since. */
+	block_count += read_blockfiles(tal_ctx,
+				       use_testnet, quiet, use_mmap,
+				       xor_key, pool, block_fnames, states,
+				       block_map, genesis, block_end);
+
+	if (blockcache && block_end == -1UL
+	    && (!cache || states_changed(cache->states, states)))
+		write_blockcache(tal_ctx, block_map, quiet, cachedir, blockcache, states);
 	if (!*genesis) {
 		errx(1, "Cache.c, Could not find a genesis block.");
 	} 
@@ -138,69 +332,435 @@ size_t read_blockchain(tal_t *tal_ctx,
  * ================================================================================
  */
 
-bool read_utxo_cache(const tal_t *ctx,
-		     bool quiet,
+#define UTXO_CACHE_MAGIC	0x6f78747574696962ULL	/* "biitutxo" */
+#define UTXO_CACHE_VERSION	3
+
+/* UTXOs per chunk (chunks end on a transaction boundary). */
+#define UTXOS_PER_CHUNK		65536
+
+/* Chunks (de)compressed per thread at a time. */
+#define CHUNKS_PER_THREAD	4
+
+/*
+ * A UTXO snapshot is this header, then independently compressed
+ * (zlib) chunks, then a directory of the chunks.
+ *
+ * UTXOs are sorted by height, transaction number and output index, and
+ * each chunk holds whole transactions in columns: every txid, then
+ * every height (as deltas), timestamp (zig-zag deltas), txnum (delta
+ * if in the same block as the last), output count, then every output
+ * index (as gaps), type, amount and output script (its length, then the
+ * script).  Numbers are varints.
+ */
+struct utxo_cache_header {
+	u64 magic;
+	u32 version;
+	u32 num_chunks;
+	u64 num_utxos;
+	u64 dir_offset;
+};
+
+struct utxo_cache_chunk {
+	u64 offset;
+	u32 len;
+	u32 raw_len;
+	u32 num_utxos;
+	u32 num_txs;
+};
+
+/**
+ * utxo_chunk_job - A batch of chunks for the thread pool.
+ *
+ * Tasks can't use tal, so buffers are malloc'ed.
+ *
+ * @fd: the cache file (reading)
+ * @utxo_map: the UTXO map, for raw scripts (writing)
+ * @utxos: all the UTXOs, sorted (writing)
+ * @starts: index of each chunk's first UTXO, plus the end (writing)
+ * @first: chunk number of task 0
+ * @dir: every chunk's directory entry
+ * @data: compressed data of each task's chunk
+ * @decoded: each task's UTXOs (reading)
+ * @scripts: each task's uncompressed chunk, which the scripts of
+ *           @decoded are offsets into (reading)
+ * @ok: whether each task succeeded
+ */
+struct utxo_chunk_job {
+	int fd;
+	const struct utxo_map *utxo_map;
+	struct utxo **utxos;
+	const size_t *starts;
+	size_t first;
+	struct utxo_cache_chunk *dir;
+	u8 **data;
+	struct utxo **decoded;
+	u8 **scripts;
+	bool *ok;
+};
+
+static void put_varint(u8 **p, u64 v)
+{
+	while (v >= 0x80) {
+		*(*p)++ = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	*(*p)++ = v;
+}
+
+static bool pull_varint(const u8 **p, const u8 *end, u64 *v)
+{
+	unsigned int shift;
+
+	*v = 0;
+	for (shift = 0; shift < 64 && *p < end; shift += 7) {
+		u8 c = *(*p)++;
+
+		*v |= (u64)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static u64 zigzag(s64 v)
+{
+	return ((u64)v << 1) ^ (u64)(v >> 63);
+}
+
+static s64 unzigzag(u64 v)
+{
+	return (s64)(v >> 1) ^ -(s64)(v & 1);
+}
+
+static bool same_tx(const struct utxo *a, const struct utxo *b)
+{
+	return a->height == b->height && a->txnum == b->txnum
+		&& memcmp(a->txid, b->txid, sizeof(a->txid)) == 0;
+}
+
+static void encode_utxo_chunk(void *arg, size_t task)
+{
+	struct utxo_chunk_job *job = arg;
+	size_t chunk = job->first + task;
+	struct utxo **u = job->utxos + job->starts[chunk];
+	size_t i, n = job->starts[chunk + 1] - job->starts[chunk], num_txs = 0;
+	size_t scripts_len = 0;
+	struct utxo_cache_chunk *dir = &job->dir[chunk];
+	u8 *raw, *p, buf[UTXO_SCRIPT_MAX_STANDARD];
+	uLongf len;
+
+	for (i = 0; i < n; i++) {
+		size_t script_len;
+
+		if (i == 0 || !same_tx(u[i-1], u[i]))
+			num_txs++;
+		utxo_script(job->utxo_map, u[i], buf, &script_len);
+		scripts_len += script_len;
+	}
+
+	/* Worst case: every varint at its longest. */
+	raw = malloc(num_txs * (SHA256_DIGEST_LENGTH + 4 * 10)
+		     + n * (5 + 1 + 10 + 5) + scripts_len);
+	if (!raw)
+		err(1, "Allocating UTXO chunk");
+
+	p = raw;
+	for (i = 0; i < n; i++)
+		if (i == 0 || !same_tx(u[i-1], u[i])) {
+			memcpy(p, u[i]->txid, sizeof(u[i]->txid));
+			p += sizeof(u[i]->txid);
+		}
+	for (i = 0; i < n; i++)
+		if (i == 0 || !same_tx(u[i-1], u[i]))
+			put_varint(&p, u[i]->height - (i ? u[i-1]->height : 0));
+	for (i = 0; i < n; i++)
+		if (i == 0 || !same_tx(u[i-1], u[i]))
+			put_varint(&p, zigzag((s64)u[i]->timestamp
+					      - (i ? u[i-1]->timestamp : 0)));
+	for (i = 0; i < n; i++)
+		if (i == 0 || !same_tx(u[i-1], u[i])) {
+			if (i && u[i]->height == u[i-1]->height)
+				put_varint(&p, u[i]->txnum - u[i-1]->txnum);
+			else
+				put_varint(&p, u[i]->txnum);
+		}
+	for (i = 0; i < n; ) {
+		size_t j;
+
+		for (j = i + 1; j < n && same_tx(u[i], u[j]); j++);
+		put_varint(&p, j - i);
+		i = j;
+	}
+	for (i = 0; i < n; i++) {
+		if (i == 0 || !same_tx(u[i-1], u[i]))
+			put_varint(&p, u[i]->index);
+		else
+			put_varint(&p, u[i]->index - u[i-1]->index - 1);
+	}
+	for (i = 0; i < n; i++)
+		*p++ = u[i]->type;
+	for (i = 0; i < n; i++)
+		put_varint(&p, u[i]->amount);
+	for (i = 0; i < n; i++) {
+		const u8 *script;
+		size_t script_len;
+
+		script = utxo_script(job->utxo_map, u[i], buf, &script_len);
+		put_varint(&p, script_len);
+		memcpy(p, script, script_len);
+		p += script_len;
+	}
+
+	dir->raw_len = p - raw;
+	dir->num_utxos = n;
+	dir->num_txs = num_txs;
+	len = compressBound(dir->raw_len);
+	job->data[task] = malloc(len);
+	if (!job->data[task])
+		err(1, "Allocating UTXO chunk");
+	if (compress(job->data[task], &len, raw, dir->raw_len) != Z_OK)
+		errx(1, "Compressing UTXO chunk");
+	dir->len = len;
+	free(raw);
+}
+
+static bool decode_utxo_chunk_raw(const u8 *p, const u8 *end,
+				  const struct utxo_cache_chunk *dir,
+				  struct utxo *u)
+{
+	const u8 *start = p, *txids = p;
+	size_t i, t, n = dir->num_utxos;
+	u64 v, *count;
+	bool ok = false;
+
+	if (end - p < (ptrdiff_t)dir->num_txs * SHA256_DIGEST_LENGTH)
+		return false;
+	p += dir->num_txs * SHA256_DIGEST_LENGTH;
+
+	/* Per-transaction columns go into each tx's first UTXO. */
+	count = malloc(sizeof(*count) * (dir->num_txs + 1));
+	if (!count)
+		err(1, "Allocating UTXO chunk");
+	for (t = 0; t < dir->num_txs; t++) {
+		if (!pull_varint(&p, end, &v))
+			goto out;
+		u[t].height = (t ? u[t-1].height : 0) + v;
+	}
+	for (t = 0; t < dir->num_txs; t++) {
+		if (!pull_varint(&p, end, &v))
+			goto out;
+		u[t].timestamp = (t ? u[t-1].timestamp : 0) + unzigzag(v);
+	}
+	for (t = 0; t < dir->num_txs; t++) {
+		if (!pull_varint(&p, end, &v))
+			goto out;
+		if (t && u[t].height == u[t-1].height)
+			u[t].txnum = u[t-1].txnum + v;
+		else
+			u[t].txnum = v;
+	}
+	for (t = 0, i = 0; t < dir->num_txs; t++) {
+		if (!pull_varint(&p, end, &count[t]) || !count[t]
+		    || count[t] > n - i)
+			goto out;
+		i += count[t];
+	}
+	if (i != n)
+		goto out;
+
+	/* Spread them out, from the end so we don't overwrite any. */
+	for (t = dir->num_txs, i = n; t-- > 0; ) {
+		struct utxo first = u[t];
+
+		while (count[t]--) {
+			i--;
+			memcpy(u[i].txid, txids + t * SHA256_DIGEST_LENGTH,
+			       sizeof(u[i].txid));
+			u[i].height = first.height;
+			u[i].timestamp = first.timestamp;
+			u[i].txnum = first.txnum;
+			/* Mark the first output of each transaction. */
+			u[i].index = count[t] ? 1 : 0;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		bool first = (u[i].index == 0);
+
+		if (!pull_varint(&p, end, &v))
+			goto out;
+		u[i].index = first ? v : u[i-1].index + v + 1;
+	}
+	if (end - p < n)
+		goto out;
+	for (i = 0; i < n; i++)
+		u[i].type = *p++;
+	for (i = 0; i < n; i++)
+		if (!pull_varint(&p, end, &u[i].amount))
+			goto out;
+	/* Scripts are left where they are, for the caller to add. */
+	for (i = 0; i < n; i++) {
+		if (!pull_varint(&p, end, &v) || end - p < v)
+			goto out;
+		u[i].script_type = UTXO_SCRIPT_RAW;
+		u[i].script.ext.len = v;
+		u[i].script.ext.off = p - start;
+		p += v;
+	}
+	ok = (p == end);
+out:
+	free(count);
+	return ok;
+}
+
+static void decode_utxo_chunk(void *arg, size_t task)
+{
+	struct utxo_chunk_job *job = arg;
+	const struct utxo_cache_chunk *dir = &job->dir[job->first + task];
+	u8 *data, *raw;
+	uLongf len = dir->raw_len;
+
+	job->ok[task] = false;
+	job->decoded[task] = NULL;
+	job->scripts[task] = NULL;
+	data = malloc(dir->len);
+	raw = malloc(dir->raw_len);
+	if (!data || !raw)
+		err(1, "Allocating UTXO chunk");
+	if (pread(job->fd, data, dir->len, dir->offset) != dir->len
+	    || uncompress(raw, &len, data, dir->len) != Z_OK
+	    || len != dir->raw_len)
+		goto out;
+
+	/* Zero, so padding doesn't leak uninitialized memory. */
+	job->decoded[task] = calloc(dir->num_utxos, sizeof(struct utxo));
+	if (!job->decoded[task])
+		err(1, "Allocating UTXO chunk");
+	job->ok[task] = decode_utxo_chunk_raw(raw, raw + len, dir,
+					      job->decoded[task]);
+	job->scripts[task] = raw;
+	raw = NULL;
+out:
+	free(data);
+	free(raw);
+}
+
+static bool corrupt_utxo_cache(struct utxo_map *utxo_map, char *file, int fd)
+{
+	warnx("Invalid cache file %s: deleting", file);
+	unlink(file);
+	close(fd);
+	tal_free(file);
+	utxo_map_reset(utxo_map);
+	return false;
+}
+
+bool read_utxo_cache(bool quiet,
+		     struct thread_pool *pool,
 		     struct utxo_map *utxo_map,
 		     const char *cachedir,
 		     const u8 *blockid)
 {
 	char blockhex[hex_str_size(SHA256_DIGEST_LENGTH)];
+	struct utxo_cache_header hdr;
+	struct utxo_chunk_job job;
+	size_t i, batch, utxo_count = 0;
+	struct stat st;
 	char *file;
-	char *contents;
-	size_t bytes;
+	int fd;
+
 	hex_encode(blockid, SHA256_DIGEST_LENGTH, blockhex, sizeof(blockhex));
 	file = path_join(NULL, cachedir, blockhex);
 	if (!quiet)
 		fprintf(stderr, "bitcoin-iterate: Reading UTXOs from cache at %s\n", file);
-  
-	contents = grab_file(file, file);
-	if (!contents) {
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
 		tal_free(file);
 		return false;
 	}
 
-	bytes = tal_count(contents) - 1;
+	if (fstat(fd, &st) != 0)
+		err(1, "Could not stat %s", file);
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	    || hdr.magic != UTXO_CACHE_MAGIC
+	    || hdr.version != UTXO_CACHE_VERSION
+	    || hdr.dir_offset + sizeof(*job.dir) * hdr.num_chunks != st.st_size)
+		return corrupt_utxo_cache(utxo_map, file, fd);
 
-	/* Size UTXO appropriately immediately (slightly oversize). */
-	utxo_map_clear(utxo_map);
-	utxo_map_init_sized(utxo_map, bytes / sizeof(struct utxo));
-	int utxo_count = 0;
+	job.fd = fd;
+	job.dir = tal_arr(file, struct utxo_cache_chunk, hdr.num_chunks);
+	if (pread(fd, job.dir, sizeof(*job.dir) * hdr.num_chunks, hdr.dir_offset)
+	    != sizeof(*job.dir) * hdr.num_chunks)
+		return corrupt_utxo_cache(utxo_map, file, fd);
+	for (i = 0; i < hdr.num_chunks; i++)
+		utxo_count += job.dir[i].num_utxos;
+	if (utxo_count != hdr.num_utxos)
+		return corrupt_utxo_cache(utxo_map, file, fd);
+	utxo_count = 0;
 
-	while (bytes) {
-		struct utxo *utxo;
-		size_t size = sizeof(*utxo);
+	/* Size UTXO appropriately immediately. */
+	utxo_map_reserve(utxo_map, hdr.num_utxos);
 
-		/* Truncated? */
-		if (size > bytes) {
-			warnx("Truncated cache file %s: deleting", file);
-			unlink(file);
-			tal_free(file);
-			return false;
-		}
-		utxo = tal_alloc_(ctx, size, false, TAL_LABEL(struct utxo, ""));
-		memcpy(utxo, contents, size);
-		utxo_map_add(utxo_map, utxo);
+	batch = thread_pool_size(pool) * CHUNKS_PER_THREAD;
+	job.decoded = tal_arr(file, struct utxo *, batch);
+	job.scripts = tal_arr(file, u8 *, batch);
+	job.ok = tal_arr(file, bool, batch);
+	for (job.first = 0; job.first < hdr.num_chunks; job.first += batch) {
+		size_t n = hdr.num_chunks - job.first;
+		bool ok = true;
+
+		if (n > batch)
+			n = batch;
+		thread_pool_run(pool, n, decode_utxo_chunk, &job);
+
+		for (i = 0; i < n; i++) {
+			const struct utxo_cache_chunk *dir = &job.dir[job.first + i];
+			size_t j;
+
+			if (ok && job.ok[i]) {
+				for (j = 0; j < dir->num_utxos; j++) {
+					const struct utxo *u = &job.decoded[i][j];
+					struct utxo *added;
 
-		utxo_count += 1;
-		contents   += size;
-		bytes      -= size;
+					added = utxo_map_add(utxo_map, u->txid, u->index);
+					*added = *u;
+					utxo_set_script(utxo_map, added,
+							job.scripts[i] + u->script.ext.off,
+							u->script.ext.len);
+				}
+				utxo_count += dir->num_utxos;
+			} else
+				ok = false;
+			free(job.decoded[i]);
+			free(job.scripts[i]);
+		}
+		if (!ok)
+			return corrupt_utxo_cache(utxo_map, file, fd);
 	}
+	if (utxo_count != hdr.num_utxos)
+		return corrupt_utxo_cache(utxo_map, file, fd);
+
 	if (!quiet) {
-		fprintf(stderr, "bitcoin-iterate: Read %i UTXOs from cache\n", utxo_count);
+		fprintf(stderr, "bitcoin-iterate: Read %zu UTXOs from cache\n", utxo_count);
 	}
+	close(fd);
 	tal_free(file);
 	return true;
 }
 
 void write_utxo_cache(const struct utxo_map *utxo_map,
 		      bool quiet,
+		      struct thread_pool *pool,
 		      const char *cachedir,
 		      const u8 *blockid)
 {
 	char *file;
 	char blockhex[hex_str_size(SHA256_DIGEST_LENGTH)];
-	struct utxo_map_iter it;
-	struct utxo *utxo;
+	struct utxo_cache_header hdr;
+	struct utxo_chunk_job job;
+	size_t i, num, num_chunks, batch;
+	size_t *starts;
+	off_t off;
 	int fd;
 
 	hex_encode(blockid, SHA256_DIGEST_LENGTH, blockhex, sizeof(blockhex));
@@ -216,16 +776,63 @@ void write_utxo_cache(const struct utxo_map *utxo_map,
 		return;
 	}
 
-	int utxo_count = 0;
-	for (utxo = utxo_map_first(utxo_map, &it);
-	     utxo;
-	     utxo = utxo_map_next(utxo_map, &it)) {
-		size_t size = sizeof(*utxo);
-		if (write(fd, utxo, size) != size)
-			errx(1, "Short write to %s", file);
-		utxo_count += 1;
+	job.utxo_map = utxo_map;
+	job.utxos = utxo_map_sorted(file, utxo_map);
+	num = tal_count(job.utxos);
+
+	/* Chunks end at the first transaction boundary after the limit. */
+	starts = tal_arr(file, size_t, 1);
+	starts[0] = num_chunks = 0;
+	for (i = 0; i < num; i++) {
+		if (i - starts[num_chunks] >= UTXOS_PER_CHUNK
+		    && !same_tx(job.utxos[i-1], job.utxos[i])) {
+			tal_resize(&starts, ++num_chunks + 1);
+			starts[num_chunks] = i;
+		}
+	}
+	if (num) {
+		tal_resize(&starts, ++num_chunks + 1);
+		starts[num_chunks] = num;
+	}
+	job.starts = starts;
+
+	memset(&hdr, 0, sizeof(hdr));
+	off = sizeof(hdr);
+	job.dir = tal_arrz(file, struct utxo_cache_chunk, num_chunks);
+	batch = thread_pool_size(pool) * CHUNKS_PER_THREAD;
+	job.data = tal_arr(file, u8 *, batch);
+	for (job.first = 0; job.first < num_chunks; job.first += batch) {
+		size_t n = num_chunks - job.first;
+
+		if (n > batch)
+			n = batch;
+		thread_pool_run(pool, n, encode_utxo_chunk, &job);
+		for (i = 0; i < n; i++) {
+			struct utxo_cache_chunk *dir = &job.dir[job.first + i];
+
+			dir->offset = off;
+			if (pwrite(fd, job.data[i], dir->len, off) != dir->len)
+				err(1, "Short write to %s", file);
+			off += dir->len;
+			free(job.data[i]);
+		}
 	}
+	if (pwrite(fd, job.dir, sizeof(*job.dir) * num_chunks, off)
+	    != sizeof(*job.dir) * num_chunks)
+		err(1, "Short write to %s", file);
+
+	/* Header last: a partly written file won't look valid. */
+	hdr.magic = UTXO_CACHE_MAGIC;
+	hdr.version = UTXO_CACHE_VERSION;
+	hdr.num_chunks = num_chunks;
+	hdr.num_utxos = num;
+	hdr.dir_offset = off;
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		err(1, "Short write to %s", file);
+	close(fd);
+
 	if (!quiet) {
-		fprintf(stderr, "bitcoin-iterate: Wrote %i UTXOs to cache\n", utxo_count);
+		fprintf(stderr, "bitcoin-iterate: Wrote %zu UTXOs to cache\n", num);
 	}
+	tal_free(file);
 }
@@ -3,25 +3,35 @@
 #include <ccan/tal/tal.h>
 #include "utxo.h"
 #include "block.h"
+#include "threadpool.h"
 
 /**
  *  Reads and assembles the blockchain.
  *
- *  If a cache directory was given and a valid & current block cache
- *  is present in that directory, it will be used to quickly recover
- *  the block_map data.
+ *  If a cache directory was given and a valid block cache is present
+ *  in that directory, it will be used to quickly recover the
+ *  block_map data (the cache is mapped, and its blocks used in place),
+ *  and only block files which have changed since will be read, from
+ *  where the cache left off.  The cache is then rewritten if any new
+ *  blocks were found.
  * 
  *  Otherwise, the block files will be read and the blockchain
  *  assembled.  If a cache directory was given, the block_map data
  *  will be written to the cache.
  *
+ *  If use_block_index is set, blocks are instead loaded from
+ *  bitcoind's own block index and the block cache is not used.
+ *
  *  In either case, the block_map struct will be initialized and
  *  populated with blocks.
  *
  *  @param tal_ctx      -- pointer to the tal context
  *  @param quiet        -- whether to silence output
  *  @param use_mmap     -- whether to use memory mapping to handle block files
+ *  @param xor_key      -- the key block files are obfuscated with (or NULL)
  *  @param use_testnet  -- whether to use testnet
+ *  @param use_block_index -- whether to load blocks from bitcoind's block index
+ *  @param pool         -- thread pool for scanning block files (may be NULL)
  *  @param cachedir     -- the cache directory (string)
  *  @param block_fnames -- an array of block filenames (strings)
  *  @param block_map    -- pointer to the block map to populate
@@ -31,7 +41,9 @@
  *  @return the number of blocks parsed
  */
 size_t read_blockchain(tal_t *tal_ctx,
-		       bool quiet, bool use_mmap, bool use_testnet, 
+		       bool quiet, bool use_mmap, const u8 *xor_key,
+		       bool use_testnet, bool use_block_index,
+		       struct thread_pool *pool,
 		       char *cachedir,
 		       char **block_fnames,
 		       struct block_map *block_map,
@@ -41,15 +53,19 @@ size_t read_blockchain(tal_t *tal_ctx,
 /**
  * Reads the UTXO cache.
  *
- *  @param ctx          -- pointer to the tal context
+ * The cache is a compressed snapshot, read in independent chunks
+ * which are decompressed concurrently on the thread pool.  Invalid
+ * (or old format) caches are deleted.
+ *
  *  @param quiet        -- whether to silence output
- *  @param utxo_map     -- pointer to the UTXO map to populate
+ *  @param pool         -- thread pool to decompress on (may be NULL)
+ *  @param utxo_map     -- pointer to the (empty) UTXO map to populate
  *  @param cachedir     -- the cache directory (string)
  *  @param blockid      -- the ID of the block this cache is valid for
  * 
  */
-bool read_utxo_cache(const tal_t *ctx,
-		     bool quiet,
+bool read_utxo_cache(bool quiet,
+		     struct thread_pool *pool,
 		     struct utxo_map *utxo_map,
 		     const char *cachedir,
 		     const u8 *blockid);
@@ -57,14 +73,19 @@ bool read_utxo_cache(const tal_t *ctx,
 /**
  * Writes the UTXO cache.
  *
+ * UTXOs are grouped by transaction, delta-encoded into columns and
+ * compressed in independent chunks concurrently on the thread pool.
+ *
  *  @param utxo_map     -- pointer to the UTXO map to populate
  *  @param quiet        -- whether to silence output
+ *  @param pool         -- thread pool to compress on (may be NULL)
  *  @param cachedir     -- the cache directory (string)
  *  @param blockid      -- the ID of the block this cache is valid for
  * 
  */
 void write_utxo_cache(const struct utxo_map *utxo_map,
 		      bool quiet,
+		      struct thread_pool *pool,
 		      const char *cachedir,
 		      const u8 *blockid);
 
@@ -4,6 +4,22 @@
 #include <ccan/err/err.h>
 #include "calculations.h"
 
+/* Uses the inputs' prevouts if the block's were resolved already. */
+static void get_input_utxos(const struct utxo_map *utxo_map,
+			    const struct input *inputs, size_t num,
+			    struct utxo **found)
+{
+  size_t j;
+
+  for (j = 0; j < num; j++) {
+    found[j] = inputs[j].prevout;
+    if (!found[j]) {
+      utxo_map_get_batch(utxo_map, inputs, num, found);
+      return;
+    }
+  }
+}
+
 s64 calculate_fees(const struct utxo_map *utxo_map,
 		   const struct transaction *t,
 		   bool is_coinbase)
@@ -14,16 +30,21 @@ s64 calculate_fees(const struct utxo_map *utxo_map,
   if (is_coinbase)
     goto sum_outputs;
 	
-  for (i = 0; i < t->input_count; i++) {
-    struct utxo *utxo;
-
-    utxo = utxo_map_get(utxo_map, t->input[i].txid);
-    if (!utxo) {
-      errx(1, "Could not calculate fees, unknown UTXO for "SHA_FMT,
-	   SHA_VALS(t->input[i].txid));
+  for (i = 0; i < t->input_count; i += UTXO_MAP_BATCH) {
+    struct utxo *found[UTXO_MAP_BATCH];
+    size_t j, num = t->input_count - i;
+
+    if (num > UTXO_MAP_BATCH)
+      num = UTXO_MAP_BATCH;
+    get_input_utxos(utxo_map, &t->input[i], num, found);
+    for (j = 0; j < num; j++) {
+      if (!found[j]) {
+	errx(1, "Could not calculate fees, unknown UTXO for "SHA_FMT,
+	     SHA_VALS(t->input[i+j].txid));
+      }
+
+      total += found[j]->amount;
     }
-
-    total += utxo->amount;
   }
 
  sum_outputs:
@@ -92,18 +113,25 @@ s64 calculate_bdd(const struct utxo_map *utxo_map,
 	if (is_coinbase)
 	  return 0;
 
-	for (i = 0; i < t->input_count; i++) {
-		struct utxo *utxo;
+	for (i = 0; i < t->input_count; i += UTXO_MAP_BATCH) {
+		struct utxo *found[UTXO_MAP_BATCH];
+		size_t j, num = t->input_count - i;
 
-		utxo = utxo_map_get(utxo_map, t->input[i].txid);
-		if (!utxo) {
-			errx(1, "Could not calculate days destroyed, unknown UTXO for "SHA_FMT,
-			     SHA_VALS(t->input[i].txid));
-		}
+		if (num > UTXO_MAP_BATCH)
+			num = UTXO_MAP_BATCH;
+		get_input_utxos(utxo_map, &t->input[i], num, found);
+		for (j = 0; j < num; j++) {
+			const struct utxo *utxo = found[j];
 
-		mul_and_add(&total_over, &total_base,
-			    utxo->amount,
-			    timestamp > utxo->timestamp ? timestamp - utxo->timestamp : 0);
+			if (!utxo) {
+				errx(1, "Could not calculate days destroyed, unknown UTXO for "SHA_FMT,
+				     SHA_VALS(t->input[i+j].txid));
+			}
+
+			mul_and_add(&total_over, &total_base,
+				    utxo->amount,
+				    timestamp > utxo->timestamp ? timestamp - utxo->timestamp : 0);
+		}
 	}
 
 	/* we have satoshi-seconds, convert to satoshi days by dividing by
@@ -5,60 +5,90 @@
  *  Entry point for the 'bitcoin-iterate' command-line program.
  *
  *  Format strings are set by command-line flags.  These format
- *  strings are then used by data-structure-appropriate functions
- *  which delegate to the `print_format` function.
+ *  strings are compiled once, then used by data-structure-appropriate
+ *  functions which delegate to the `print_format` function.
  *
  *  UTXOs are only collected if certain format codes were specified.
  *
  */
 #include <ccan/err/err.h>
 #include <ccan/opt/opt.h>
+#include <ccan/str/str.h>
 #include "iterate.h"
 #include "utils.h"
 #include "format.h"
 
+/* Default --open-files: enough for chain order to move between a few
+ * files, and for a few pipeline workers. */
+#define DEFAULT_OPEN_FILES 8
+
+/* Default --utxo-hot: about 1.4GB of UTXO table. */
+#define DEFAULT_UTXO_HOT (1UL << 24)
+
 static char *blockfmt = NULL, *txfmt = NULL, *inputfmt = NULL, *outputfmt = NULL, *utxofmt = NULL;
+static struct format *blockprog, *txprog, *inputprog, *outputprog, *utxoprog;
 
 static void print_block(const struct utxo_map *utxo_map, struct block *b)
 {
   if (blockfmt) {
-    print_format(blockfmt, utxo_map, b, NULL, 0, NULL, NULL, NULL, NULL);
+    print_format(blockprog, utxo_map, b, NULL, 0, NULL, NULL, NULL, NULL);
   }
 }
 static void print_transaction(const struct utxo_map *utxo_map, struct block *b, struct transaction *t, size_t txnum)
 {
   if (txfmt) {
-    print_format(txfmt, utxo_map, b, t, txnum, NULL, NULL, NULL, NULL);
+    print_format(txprog, utxo_map, b, t, txnum, NULL, NULL, NULL, NULL);
   }
 }
 static void print_input(const struct utxo_map *utxo_map, struct block *b, struct transaction *t, size_t txnum, struct input *i)
 {
   if (inputfmt) {
-    print_format(inputfmt, utxo_map, b, t, txnum, i, NULL, NULL, NULL);
+    print_format(inputprog, utxo_map, b, t, txnum, i, NULL, NULL, NULL);
   }
 }
 static void print_output(const struct utxo_map *utxo_map, struct block *b, struct transaction *t, size_t txnum, struct output *o)
 {
   if (outputfmt) {
-    print_format(outputfmt, utxo_map, b, t, txnum, NULL, o, NULL, NULL);
+    print_format(outputprog, utxo_map, b, t, txnum, NULL, o, NULL, NULL);
   }
 }
 static void print_utxo(const struct utxo_map *utxo_map, struct block *current_block, struct block *last_utxo_block, struct utxo *u)
 {
   if (utxofmt) {
-    print_format(utxofmt, utxo_map, current_block, NULL, 0, NULL, NULL, u, last_utxo_block);
+    print_format(utxoprog, utxo_map, current_block, NULL, 0, NULL, NULL, u, last_utxo_block);
   }
 }
 
+static char *opt_set_utxo_backend(const char *arg, bool *on_disk)
+{
+  if (streq(arg, "memory"))
+    *on_disk = false;
+  else if (streq(arg, "disk"))
+    *on_disk = true;
+  else
+    return "Unknown UTXO backend (use memory or disk)";
+  return NULL;
+}
+
 int main(int argc, char *argv[])
 {
   char *blockdir = NULL, *cachedir = NULL;
   bool use_testnet = false;
   unsigned long block_start = 0, block_end = -1UL;
+  unsigned long start_time = 0, end_time = -1UL;
   u8 tip[SHA256_DIGEST_LENGTH] = { 0 }, start_hash[SHA256_DIGEST_LENGTH] = { 0 };
   bool needs_utxo = false;
+  unsigned int parse_needs = 0;
   unsigned int utxo_period = 144;
+  bool utxo_on_disk = false;
+  unsigned long utxo_hot = DEFAULT_UTXO_HOT;
   bool use_mmap = true;
+  bool use_block_index = false;
+  unsigned int nthreads = 0;
+  bool split_blocks = false;
+  unsigned int prefetch_ahead = 0;
+  unsigned int open_files = DEFAULT_OPEN_FILES;
+  unsigned long max_mapped = 0;
   unsigned progress_marks = 0;
   bool quiet = false;
 
@@ -108,6 +138,8 @@ int main(int argc, char *argv[])
 		     stringify(CHANGE_OUTPUT) ") or different ("
 		     stringify(PAYMENT_OUTPUT) ") owner, or ("
 		     stringify(UNKNOWN_OUTPUT) ") unknown\n"
+		     "  %iL: input UTXO script length (0 for coinbase)\n"
+		     "  %iS: input UTXO script as a hex string\n"
 		     "Valid output format:\n"
 		     "  %oa: output amount\n"
 		     "  %ol: output script length\n"
@@ -137,10 +169,26 @@ int main(int argc, char *argv[])
 		   "Format to print for each UTXO");
   opt_register_arg("--utxo-period", opt_set_uintval, NULL,
 		   &utxo_period, "Loop over UTXOs every this many blocks");
+  opt_register_arg("--utxo-backend", opt_set_utxo_backend, NULL,
+		   &utxo_on_disk, "Keep UTXOs in memory or spill old ones to disk (memory|disk)");
+  opt_register_arg("--utxo-hot", opt_set_ulongval, NULL,
+		   &utxo_hot, "With --utxo-backend=disk, keep at most this many UTXOs in memory");
   opt_register_arg("--progress", opt_set_uintval, NULL,
 		   &progress_marks, "Print . to stderr this many times");
   opt_register_noarg("--no-mmap", opt_set_invbool, &use_mmap,
 		     "Don't mmap the block files");
+  opt_register_noarg("--use-block-index", opt_set_bool, &use_block_index,
+		     "Load blocks from bitcoind's block index, not by scanning block files");
+  opt_register_arg("--threads", opt_set_uintval, NULL, &nthreads,
+		   "Scan and parse blocks on this many threads");
+  opt_register_noarg("--split-blocks", opt_set_bool, &split_blocks,
+		     "With --threads, parse each block across all the threads");
+  opt_register_arg("--open-files", opt_set_uintval, NULL, &open_files,
+		   "Keep this many block files open while iterating");
+  opt_register_arg("--max-mapped", opt_set_ulongval_bi, NULL, &max_mapped,
+		   "Keep at most this many bytes of finished blocks in memory (eg. 256M)");
+  opt_register_arg("--prefetch", opt_set_uintval, NULL, &prefetch_ahead,
+		   "Read this many blocks ahead into the page cache");
   opt_register_noarg("--quiet|-q", opt_set_bool, &quiet,
 		     "Don't output progress information");
   opt_register_noarg("--testnet|-t", opt_set_bool, &use_testnet,
@@ -155,6 +203,10 @@ int main(int argc, char *argv[])
 		   "Block number to start instead of genesis.");
   opt_register_arg("--end", opt_set_ulongval, NULL, &block_end,
 		   "Block number to end at instead of longest chain.");
+  opt_register_arg("--start-time", opt_set_time, NULL, &start_time,
+		   "Start at the first block with median time past at or after this time.");
+  opt_register_arg("--end-time", opt_set_time, NULL, &end_time,
+		   "End at the last block with median time past at or before this time.");
   opt_register_arg("--cache", opt_set_charp, NULL, &cachedir,
 		   "Cache for multiple runs.");
   opt_parse(&argc, argv, opt_log_stderr_exit);
@@ -162,34 +214,40 @@ int main(int argc, char *argv[])
   if (argc != 1)
     opt_usage_and_exit(NULL);
 
-  if (txfmt && strstr(txfmt, "%tF"))
-    needs_utxo = true;
-  if (txfmt && strstr(txfmt, "%tD"))
-    needs_utxo = true;
-  if (inputfmt && strstr(inputfmt, "%tF"))
-    needs_utxo = true;
-  if (inputfmt && strstr(inputfmt, "%tD"))
-    needs_utxo = true;
-  if (inputfmt && strstr(inputfmt, "%iB"))
-    needs_utxo = true;
-  if (inputfmt && strstr(inputfmt, "%iT"))
-    needs_utxo = true;
-  if (inputfmt && strstr(inputfmt, "%ia"))
-    needs_utxo = true;
-  if (inputfmt && strstr(inputfmt, "%ip"))
+  /* Compile the formats once, and see if any need UTXOs. */
+  if (blockfmt)
+    blockprog = compile_format(NULL, blockfmt, FORMAT_BLOCK);
+  if (txfmt)
+    txprog = compile_format(NULL, txfmt, FORMAT_TRANSACTION);
+  if (inputfmt)
+    inputprog = compile_format(NULL, inputfmt, FORMAT_INPUT);
+  if (outputfmt)
+    outputprog = compile_format(NULL, outputfmt, FORMAT_OUTPUT);
+  if (utxofmt)
+    utxoprog = compile_format(NULL, utxofmt, FORMAT_UTXO);
+
+  if (txprog && format_needs_utxo(txprog))
     needs_utxo = true;
-  if (outputfmt && strstr(outputfmt, "%tF"))
+  if (inputprog && format_needs_utxo(inputprog))
     needs_utxo = true;
-  if (outputfmt && strstr(outputfmt, "%tD"))
+  if (outputprog && format_needs_utxo(outputprog))
     needs_utxo = true;
   if (utxofmt)
     needs_utxo = true;
+
+  /* Only parse the parts of transactions which get printed. */
+  if (txprog)
+    parse_needs |= format_parse_needs(txprog);
+  if (inputprog)
+    parse_needs |= format_parse_needs(inputprog);
+  if (outputprog)
+    parse_needs |= format_parse_needs(outputprog);
   
   iterate(blockdir, cachedir,
 	  use_testnet,
-	  block_start, block_end, start_hash, tip,
-	  needs_utxo, utxo_period,
-	  use_mmap,
+	  block_start, block_end, start_time, end_time, start_hash, tip,
+	  needs_utxo, utxo_period, utxo_on_disk ? utxo_hot : 0, parse_needs,
+	  use_mmap, use_block_index, nthreads, split_blocks, prefetch_ahead, open_files, max_mapped,
 	  progress_marks, quiet,
 	  (blockfmt  ? print_block       : NULL), 
 	  (txfmt     ? print_transaction : NULL), 
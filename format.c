@@ -1,39 +1,138 @@
-#include <ccan/str/hex/hex.h>
 #include <ccan/endian/endian.h>
 #include <ccan/err/err.h>
-#include <stdio.h>
-#include <inttypes.h>
+#include <ccan/tal/str/str.h>
+#include <ccan/take/take.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "format.h"
 #include "calculations.h"
+#include "parse.h"
 #include "utxo.h"
 
-static void print_hash(const u8 *hash)
+/* Output is collected here, and written when full (and at exit).
+ * Records are only printed by the iterating thread. */
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+static char outbuf[OUTPUT_BUFFER_SIZE];
+static size_t outlen;
+
+static void flush_output(void)
 {
-	char str[hex_str_size(SHA256_DIGEST_LENGTH)];
+	size_t off = 0;
+
+	while (off < outlen) {
+		ssize_t r = write(STDOUT_FILENO, outbuf + off, outlen - off);
+		if (r <= 0)
+			break;
+		off += r;
+	}
+	outlen = 0;
+}
 
-	hex_encode(hash, SHA256_DIGEST_LENGTH, str, sizeof(str));
-	fputs(str, stdout);
+/* Returns space for at least @len bytes (at most the buffer size). */
+static char *reserve(size_t len)
+{
+	if (outlen + len > OUTPUT_BUFFER_SIZE)
+		flush_output();
+	return outbuf + outlen;
 }
 
-void print_reversed_hash(const u8 *hash)
+static void put_mem(const void *data, size_t len)
 {
-	u8 reversed[32];
-	int i; 
-	for(i=0;i<32;++i) {
-		reversed[i]=hash[32-i-1];
+	while (len) {
+		size_t n = len < OUTPUT_BUFFER_SIZE ? len : OUTPUT_BUFFER_SIZE;
+
+		memcpy(reserve(n), data, n);
+		outlen += n;
+		data = (const char *)data + n;
+		len -= n;
 	}
-	print_hash(reversed);
 }
 
-static void print_hex(const void *data, size_t len)
+static void put_char(char c)
 {
-	char str[len * 2 + 1];
+	*reserve(1) = c;
+	outlen++;
+}
 
-	hex_encode(data, len, str, sizeof(str));
-	fputs(str, stdout);
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static void put_u64(u64 v)
+{
+	char tmp[20], *p = tmp + sizeof(tmp);
+
+	while (v >= 100) {
+		p -= 2;
+		memcpy(p, digit_pairs + (v % 100) * 2, 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs + v * 2, 2);
+	} else
+		*(--p) = '0' + v;
+	put_mem(p, tmp + sizeof(tmp) - p);
 }
 
-static void print_varint(varint_t v)
+static void put_s64(s64 v)
+{
+	if (v < 0) {
+		put_char('-');
+		put_u64(-(u64)v);
+	} else
+		put_u64(v);
+}
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static void put_hex(const void *data, size_t len)
+{
+	const u8 *p = data;
+
+	while (len) {
+		size_t i, n = len < OUTPUT_BUFFER_SIZE / 2 ? len : OUTPUT_BUFFER_SIZE / 2;
+		char *out = reserve(n * 2);
+
+		for (i = 0; i < n; i++) {
+			out[i*2] = hexdigits[p[i] >> 4];
+			out[i*2+1] = hexdigits[p[i] & 0xF];
+		}
+		outlen += n * 2;
+		p += n;
+		len -= n;
+	}
+}
+
+static void put_hash(const u8 *hash)
+{
+	put_hex(hash, SHA256_DIGEST_LENGTH);
+}
+
+static void put_reversed_hash(const u8 *hash)
+{
+	char *out = reserve(SHA256_DIGEST_LENGTH * 2);
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		u8 c = hash[SHA256_DIGEST_LENGTH - i - 1];
+		out[i*2] = hexdigits[c >> 4];
+		out[i*2+1] = hexdigits[c & 0xF];
+	}
+	outlen += SHA256_DIGEST_LENGTH * 2;
+}
+
+static void put_varint(varint_t v)
 {
 	u8 buf[9], *p = buf;
 
@@ -60,63 +159,304 @@ static void print_varint(varint_t v)
 		(*p++) = v >> 48;
 		(*p++) = v >> 56;
 	}
-	print_hex(buf, p - buf);
+	put_hex(buf, p - buf);
 }
 
-static void print_le32(u32 v)
+static void put_le32(u32 v)
 {
 	le32 l = cpu_to_le32(v);
-	print_hex(&l, sizeof(l));
+	put_hex(&l, sizeof(l));
 }
 
-static void print_le64(u64 v)
+static void put_le64(u64 v)
 {
 	le64 l = cpu_to_le64(v);
-	print_hex(&l, sizeof(l));
+	put_hex(&l, sizeof(l));
 }
 
 static void dump_tx_input(const struct input *input)
 {
-	print_hash(input->txid);
-	print_le32(input->index);
-	print_varint(input->script_length);
-	print_hex(input->script, input->script_length);
-	print_le32(input->sequence_number);
+	put_hash(input->txid);
+	put_le32(input->index);
+	put_varint(input->script_length);
+	put_hex(input->script, input->script_length);
+	put_le32(input->sequence_number);
 }
 
 static void dump_tx_output(const struct output *output)
 {
-	print_le64(output->amount);
-	print_varint(output->script_length);
-	print_hex(output->script, output->script_length);
+	put_le64(output->amount);
+	put_varint(output->script_length);
+	put_hex(output->script, output->script_length);
 }
 
 static void dump_tx(const struct transaction *tx)
 {
 	varint_t i;
 
-	print_le32(tx->version);
-	print_varint(tx->input_count);
+	put_le32(tx->version);
+	put_varint(tx->input_count);
 	for (i = 0; i < tx->input_count; i++)
 		dump_tx_input(&tx->input[i]);
-	print_varint(tx->output_count);
+	put_varint(tx->output_count);
 	for (i = 0; i < tx->output_count; i++)
 		dump_tx_output(&tx->output[i]);
-	print_le32(tx->lock_time);
+	put_le32(tx->lock_time);
 }
 
 static void dump_block_header(const struct block_header *bh)
 {
-	print_le32(bh->version);
-	print_hash(bh->prev_hash);
-	print_hash(bh->merkle_hash);
-	print_le32(bh->timestamp);
-	print_le32(bh->target);
-	print_le32(bh->nonce);
+	put_le32(bh->version);
+	put_hash(bh->prev_hash);
+	put_hash(bh->merkle_hash);
+	put_le32(bh->timestamp);
+	put_le32(bh->target);
+	put_le32(bh->nonce);
+}
+
+enum format_code {
+	FMT_LITERAL,
+	FMT_BLOCK_LEN,
+	FMT_BLOCK_VERSION,
+	FMT_BLOCK_PREV_HASH,
+	FMT_BLOCK_MERKLE_HASH,
+	FMT_BLOCK_TIMESTAMP,
+	FMT_BLOCK_TARGET,
+	FMT_BLOCK_NONCE,
+	FMT_BLOCK_TX_COUNT,
+	FMT_BLOCK_HASH,
+	FMT_BLOCK_HEIGHT,
+	FMT_BLOCK_HEADER,
+	FMT_TX_HASH,
+	FMT_TX_WTXID,
+	FMT_TX_VERSION,
+	FMT_TX_INPUT_COUNT,
+	FMT_TX_OUTPUT_COUNT,
+	FMT_TX_LOCKTIME,
+	FMT_TX_TOTAL_LEN,
+	FMT_TX_NON_SWLEN,
+	FMT_TX_VLEN,
+	FMT_TX_WEIGHT,
+	FMT_TX_NUM,
+	FMT_TX_FEE,
+	FMT_TX_BDD,
+	FMT_TX_HEX,
+	FMT_TX_SEGWIT,
+	FMT_INPUT_HASH,
+	FMT_INPUT_INDEX,
+	FMT_INPUT_SCRIPT_LEN,
+	FMT_INPUT_SCRIPT,
+	FMT_INPUT_SEQUENCE,
+	FMT_INPUT_NUM,
+	FMT_INPUT_HEX,
+	FMT_INPUT_AMOUNT,
+	FMT_INPUT_HEIGHT,
+	FMT_INPUT_TXNUM,
+	FMT_INPUT_PAYMENT,
+	FMT_INPUT_UTXO_SCRIPT_LEN,
+	FMT_INPUT_UTXO_SCRIPT,
+	FMT_OUTPUT_AMOUNT,
+	FMT_OUTPUT_SCRIPT_LEN,
+	FMT_OUTPUT_SCRIPT,
+	FMT_OUTPUT_NUM,
+	FMT_OUTPUT_UNSPENDABLE,
+	FMT_OUTPUT_HEX,
+	FMT_UTXO_HASH,
+	FMT_UTXO_INDEX,
+	FMT_UTXO_TIMESTAMP,
+	FMT_UTXO_HEIGHT,
+	FMT_UTXO_AMOUNT,
+	FMT_UTXO_SCRIPT_LEN,
+	FMT_UTXO_SCRIPT,
+	FMT_UTXO_BDC
+};
+
+static const struct format_escape {
+	char escape[3];
+	enum format_code code;
+	bool needs_utxo;
+	/* PARSE_* parts of the transaction it prints. */
+	unsigned int parse_needs;
+} escapes[] = {
+	{ "bl", FMT_BLOCK_LEN },
+	{ "bv", FMT_BLOCK_VERSION },
+	{ "bp", FMT_BLOCK_PREV_HASH },
+	{ "bm", FMT_BLOCK_MERKLE_HASH },
+	{ "bs", FMT_BLOCK_TIMESTAMP },
+	{ "bt", FMT_BLOCK_TARGET },
+	{ "bn", FMT_BLOCK_NONCE },
+	{ "bc", FMT_BLOCK_TX_COUNT },
+	{ "bh", FMT_BLOCK_HASH },
+	{ "bN", FMT_BLOCK_HEIGHT },
+	{ "bH", FMT_BLOCK_HEADER },
+	{ "th", FMT_TX_HASH, false, PARSE_TXID },
+	{ "tH", FMT_TX_WTXID, false, PARSE_WTXID },
+	{ "tv", FMT_TX_VERSION },
+	{ "ti", FMT_TX_INPUT_COUNT },
+	{ "to", FMT_TX_OUTPUT_COUNT },
+	{ "tt", FMT_TX_LOCKTIME },
+	{ "tL", FMT_TX_TOTAL_LEN },
+	{ "tn", FMT_TX_NON_SWLEN },
+	{ "tl", FMT_TX_VLEN },
+	{ "tw", FMT_TX_WEIGHT },
+	{ "tN", FMT_TX_NUM },
+	{ "tF", FMT_TX_FEE, true },
+	{ "tD", FMT_TX_BDD, true },
+	{ "tX", FMT_TX_HEX, false, PARSE_SCRIPTS },
+	{ "tS", FMT_TX_SEGWIT },
+	{ "ih", FMT_INPUT_HASH },
+	{ "ii", FMT_INPUT_INDEX },
+	{ "il", FMT_INPUT_SCRIPT_LEN },
+	{ "is", FMT_INPUT_SCRIPT, false, PARSE_SCRIPTS },
+	{ "iq", FMT_INPUT_SEQUENCE },
+	{ "iN", FMT_INPUT_NUM },
+	{ "iX", FMT_INPUT_HEX, false, PARSE_SCRIPTS },
+	{ "ia", FMT_INPUT_AMOUNT, true },
+	{ "iB", FMT_INPUT_HEIGHT, true },
+	{ "iT", FMT_INPUT_TXNUM, true },
+	{ "ip", FMT_INPUT_PAYMENT, true },
+	{ "iL", FMT_INPUT_UTXO_SCRIPT_LEN, true },
+	{ "iS", FMT_INPUT_UTXO_SCRIPT, true },
+	{ "oa", FMT_OUTPUT_AMOUNT },
+	{ "ol", FMT_OUTPUT_SCRIPT_LEN },
+	{ "os", FMT_OUTPUT_SCRIPT, false, PARSE_SCRIPTS },
+	{ "oN", FMT_OUTPUT_NUM },
+	{ "oU", FMT_OUTPUT_UNSPENDABLE, false, PARSE_SCRIPTS },
+	{ "oX", FMT_OUTPUT_HEX, false, PARSE_SCRIPTS },
+	{ "uh", FMT_UTXO_HASH },
+	{ "un", FMT_UTXO_INDEX },
+	{ "ut", FMT_UTXO_TIMESTAMP },
+	{ "uN", FMT_UTXO_HEIGHT },
+	{ "ua", FMT_UTXO_AMOUNT },
+	{ "ul", FMT_UTXO_SCRIPT_LEN },
+	{ "us", FMT_UTXO_SCRIPT },
+	{ "uC", FMT_UTXO_BDC },
+};
+
+/* One step of a compiled format: a code, or a run of literal text. */
+struct format_op {
+	enum format_code code;
+	size_t off, len;
+};
+
+struct format {
+	struct format_op *ops;
+	/* The literal text, which ops point into. */
+	char *text;
+	/* Looks up the spent UTXO once for every input printed. */
+	bool needs_input_utxo;
+	bool needs_utxo;
+	unsigned int parse_needs;
+};
+
+static const char *kind_names[] = {
+	[FORMAT_BLOCK] = "block",
+	[FORMAT_TRANSACTION] = "transaction",
+	[FORMAT_INPUT] = "input",
+	[FORMAT_OUTPUT] = "output",
+	[FORMAT_UTXO] = "utxo",
+};
+
+/* Which escape classes each kind of record may use. */
+static const char *kind_classes[] = {
+	[FORMAT_BLOCK] = "b",
+	[FORMAT_TRANSACTION] = "bt",
+	[FORMAT_INPUT] = "bti",
+	[FORMAT_OUTPUT] = "bto",
+	[FORMAT_UTXO] = "bu",
+};
+
+static void add_op(struct format *format, enum format_code code,
+		   size_t off, size_t len)
+{
+	size_t n = tal_count(format->ops);
+
+	/* Merge adjacent literal text. */
+	if (code == FMT_LITERAL && n && format->ops[n-1].code == FMT_LITERAL
+	    && format->ops[n-1].off + format->ops[n-1].len == off) {
+		format->ops[n-1].len += len;
+		return;
+	}
+	tal_resize(&format->ops, n + 1);
+	format->ops[n].code = code;
+	format->ops[n].off = off;
+	format->ops[n].len = len;
+}
+
+struct format *compile_format(const tal_t *ctx, const char *fmt,
+			      enum format_kind kind)
+{
+	struct format *format = tal(ctx, struct format);
+	static bool registered;
+	const char *c;
+
+	if (!registered) {
+		atexit(flush_output);
+		registered = true;
+	}
+
+	format->text = tal_strdup(format, fmt);
+	format->ops = tal_arr(format, struct format_op, 0);
+	format->needs_input_utxo = format->needs_utxo = false;
+	format->parse_needs = 0;
+
+	for (c = fmt; *c; c++) {
+		size_t e;
+
+		if (*c != '%') {
+			add_op(format, FMT_LITERAL, c - fmt, 1);
+			continue;
+		}
+
+		/* Unknown escape classes (eg. "%%") print nothing. */
+		if (!c[1] || !strchr("btiou", c[1])) {
+			if (c[1])
+				c += c[2] ? 2 : 1;
+			continue;
+		}
+
+		if (!strchr(kind_classes[kind], c[1]))
+			goto bad_fmt;
+		for (e = 0; e < sizeof(escapes) / sizeof(escapes[0]); e++) {
+			if (escapes[e].escape[0] == c[1]
+			    && escapes[e].escape[1] == c[2])
+				break;
+		}
+		if (e == sizeof(escapes) / sizeof(escapes[0]))
+			goto bad_fmt;
+
+		add_op(format, escapes[e].code, 0, 0);
+		if (escapes[e].needs_utxo)
+			format->needs_utxo = true;
+		format->parse_needs |= escapes[e].parse_needs;
+		if (escapes[e].code == FMT_INPUT_AMOUNT
+		    || escapes[e].code == FMT_INPUT_HEIGHT
+		    || escapes[e].code == FMT_INPUT_TXNUM
+		    || escapes[e].code == FMT_INPUT_UTXO_SCRIPT_LEN
+		    || escapes[e].code == FMT_INPUT_UTXO_SCRIPT)
+			format->needs_input_utxo = true;
+		c += 2;
+	}
+	/* Every record ends with a newline. */
+	format->text = tal_strcat(format, take(format->text), "\n");
+	add_op(format, FMT_LITERAL, strlen(fmt), 1);
+	return format;
+
+bad_fmt:
+	errx(1, "Bad %s format %.3s", kind_names[kind], c);
 }
 
-/* FIXME: Speed up! */
-void print_format(const char *format,
+bool format_needs_utxo(const struct format *format)
+{
+	return format->needs_utxo;
+}
+
+unsigned int format_parse_needs(const struct format *format)
+{
+	return format->parse_needs;
+}
+
+void print_format(const struct format *format,
 		  const struct utxo_map *utxo_map,
 		  struct block *b,
 		  struct transaction *t,
@@ -126,237 +466,197 @@ void print_format(const char *format,
 		  struct utxo *u,
 		  struct block *last_utxo_block)
 {
-  const char *c;
-  for (c = format; *c; c++) {
-    if (*c != '%') {
-      fputc(*c, stdout);
-      continue;
-    }
-
-    switch (c[1]) {
-    case 'b':
-      switch (c[2]) {
-      case 'l':
-	printf("%u", b->bh.len);
-	break;
-      case 'v':
-	printf("%u", b->bh.version);
-	break;
-      case 'p':
-	print_reversed_hash(b->bh.prev_hash);
-	break;
-      case 'm':
-	print_hash(b->bh.merkle_hash);
-	break;
-      case 's':
-	printf("%u", b->bh.timestamp);
-	break;
-      case 't':
-	printf("%u", b->bh.target);
-	break;
-      case 'n':
-	printf("%u", b->bh.nonce);
-	break;
-      case 'c':
-	printf("%"PRIu64, b->bh.transaction_count);
-	break;
-      case 'h':
-	print_reversed_hash(b->id);
-	break;
-      case 'N':
-	printf("%u", b->height);
-	break;
-      case 'H':
-	dump_block_header(&b->bh);
-	break;
-      default:
-	goto bad_fmt;
-      }
-      break;
-    case 't':
-      if (!t)
-	goto bad_fmt;
-      switch (c[2]) {
-      case 'h':
-	print_reversed_hash(t->txid);
-	break;
-      case 'H':
-	print_reversed_hash(t->wtxid);
-	break;
-      case 'v':
-	printf("%u", t->version);
-	break;
-      case 'i':
-	printf("%"PRIu64, t->input_count);
-	break;
-      case 'o':
-	printf("%"PRIu64, t->output_count);
-	break;
-      case 't':
-	printf("%u", t->lock_time);
-	break;
-      case 'L':
-	printf("%u", t->total_len);
-	break;
-      case 'n':
-	printf("%u", t->non_swlen);
-	break;
-      case 'l':
-	printf("%u", segwit_length(t));
-	break;
-      case 'w':
-	printf("%u", segwit_weight(t));
-	break;
-      case 'N':
-	printf("%zu", txnum);
-	break;
-      case 'F':
-	printf("%"PRIi64,
-	       calculate_fees(utxo_map, t, txnum == 0));
-	break;
-      case 'D':
-	printf("%"PRIi64,
-	       calculate_bdd(utxo_map, t, txnum == 0, b->bh.timestamp));
-	break;
-      case 'X':
-	dump_tx(t);
-	break;
-      case 'S':
-	printf("%u", t->segwit);
-	break;
-
-      default:
-	goto bad_fmt;
-      }
-      break;
-    case 'i':
-      if (!i)
-	goto bad_fmt;
-      switch (c[2]) {
-      case 'h':
-	print_reversed_hash(i->txid);
-	break;
-      case 'i':
-	printf("%u", i->index);
-	break;
-      case 'l':
-	printf("%"PRIu64, i->script_length);
-	break;
-      case 's':
-	print_hex(i->script, i->script_length);
-	break;
-      case 'N':
-	printf("%zu", i - t->input);
-	break;
-      case 'X':
-	dump_tx_input(i);
-	break;
-      case 'a':
-	/* Coinbase doesn't have valid input. */
-	if (txnum != 0) {
-	  struct utxo *utxo = utxo_map_get(utxo_map, i->txid);
-	  printf("%"PRIu64, utxo->amount);
-	} else
-	  printf("0");
-	break;
-      case 'B':
-	/* Coinbase doesn't have valid input. */
-	if (txnum != 0) {
-	  struct utxo *utxo = utxo_map_get(utxo_map, i->txid);
-	  printf("%u", utxo->height);
-	} else
-	  printf("0");
-	break;
-      case 'T':
-	/* Coinbase doesn't have valid input. */
-	if (txnum != 0) {
-	  struct utxo *utxo = utxo_map_get(utxo_map, i->txid);
-	  printf("%u", utxo->txnum);
-	} else
-	  printf("-1");
-	break;
-      case 'p':
+	const struct utxo *spent = NULL;
+	const u8 *script = NULL;
+	u8 script_buf[UTXO_SCRIPT_MAX_STANDARD];
+	size_t n, script_len = 0;
+
 	/* Coinbase doesn't have valid input. */
-	if (txnum != 0) {
-	  struct utxo *utxo = utxo_map_get(utxo_map, i->txid);
-	  printf("%u", 1);
-	} else
-	  printf("%u", UNKNOWN_OUTPUT);
-	break;
-      default:
-	goto bad_fmt;
-      }
-      break;
-    case 'o':
-      if (!o)
-	goto bad_fmt;
-      switch (c[2]) {
-      case 'a':
-	printf("%"PRIu64, o->amount);
-	break;
-      case 'l':
-	printf("%"PRIu64, o->script_length);
-	break;
-      case 's':
-	print_hex(o->script, o->script_length);
-	break;
-      case 'q':
-	printf("%u", i->sequence_number);
-	break;
-      case 'N':
-	printf("%zu", o - t->output);
-	break;
-      case 'U':
-	printf("%u", is_unspendable(o));
-	break;
-      case 'X':
-	dump_tx_output(o);
-	break;
-      default:
-	goto bad_fmt;
-      }
-      break;
-    case 'u':
-      if (!u)
-	goto bad_fmt;
-      switch (c[2]) {
-      case 'h':
-        print_reversed_hash(u->txid);
-	break;
-      case 'n':
-        printf("%i", u->index);
-	break;
-      case 't':
-	printf("%u", u->timestamp);
-	break;
-      case 'N':
-	printf("%u", u->height);
-	break;
-      case 'a':
-	printf("%"PRIu64, u->amount);
-	break;
-      case 'C':
-	if (last_utxo_block) {
-	    printf("%"PRIi64,
-	      calculate_bdc(u, b->bh.timestamp, last_utxo_block->bh.timestamp));
-	} else {
-	    printf("0");
+	if (format->needs_input_utxo && txnum != 0) {
+		spent = i->prevout ? i->prevout
+			: utxo_map_get(utxo_map, i->txid, i->index);
+		if (!spent)
+			errx(1, "Unknown utxo for transaction "SHA_FMT" output %i",
+			     SHA_VALS(i->txid), i->index);
+		script = utxo_script(utxo_map, spent, script_buf, &script_len);
+	}
+	if (u)
+		script = utxo_script(utxo_map, u, script_buf, &script_len);
+
+	for (n = 0; n < tal_count(format->ops); n++) {
+		const struct format_op *op = &format->ops[n];
+
+		switch (op->code) {
+		case FMT_LITERAL:
+			put_mem(format->text + op->off, op->len);
+			break;
+		case FMT_BLOCK_LEN:
+			put_u64(b->bh.len);
+			break;
+		case FMT_BLOCK_VERSION:
+			put_u64(b->bh.version);
+			break;
+		case FMT_BLOCK_PREV_HASH:
+			put_reversed_hash(b->bh.prev_hash);
+			break;
+		case FMT_BLOCK_MERKLE_HASH:
+			put_hash(b->bh.merkle_hash);
+			break;
+		case FMT_BLOCK_TIMESTAMP:
+			put_u64(b->bh.timestamp);
+			break;
+		case FMT_BLOCK_TARGET:
+			put_u64(b->bh.target);
+			break;
+		case FMT_BLOCK_NONCE:
+			put_u64(b->bh.nonce);
+			break;
+		case FMT_BLOCK_TX_COUNT:
+			put_u64(b->bh.transaction_count);
+			break;
+		case FMT_BLOCK_HASH:
+			put_reversed_hash(b->id);
+			break;
+		case FMT_BLOCK_HEIGHT:
+			put_u64((unsigned int)b->height);
+			break;
+		case FMT_BLOCK_HEADER:
+			dump_block_header(&b->bh);
+			break;
+		case FMT_TX_HASH:
+			put_reversed_hash(t->txid);
+			break;
+		case FMT_TX_WTXID:
+			put_reversed_hash(t->wtxid);
+			break;
+		case FMT_TX_VERSION:
+			put_u64(t->version);
+			break;
+		case FMT_TX_INPUT_COUNT:
+			put_u64(t->input_count);
+			break;
+		case FMT_TX_OUTPUT_COUNT:
+			put_u64(t->output_count);
+			break;
+		case FMT_TX_LOCKTIME:
+			put_u64(t->lock_time);
+			break;
+		case FMT_TX_TOTAL_LEN:
+			put_u64(t->total_len);
+			break;
+		case FMT_TX_NON_SWLEN:
+			put_u64(t->non_swlen);
+			break;
+		case FMT_TX_VLEN:
+			put_u64(segwit_length(t));
+			break;
+		case FMT_TX_WEIGHT:
+			put_u64(segwit_weight(t));
+			break;
+		case FMT_TX_NUM:
+			put_u64(txnum);
+			break;
+		case FMT_TX_FEE:
+			put_s64(calculate_fees(utxo_map, t, txnum == 0));
+			break;
+		case FMT_TX_BDD:
+			put_s64(calculate_bdd(utxo_map, t, txnum == 0,
+					      b->bh.timestamp));
+			break;
+		case FMT_TX_HEX:
+			dump_tx(t);
+			break;
+		case FMT_TX_SEGWIT:
+			put_u64(t->segwit);
+			break;
+		case FMT_INPUT_HASH:
+			put_reversed_hash(i->txid);
+			break;
+		case FMT_INPUT_INDEX:
+			put_u64(i->index);
+			break;
+		case FMT_INPUT_SCRIPT_LEN:
+			put_u64(i->script_length);
+			break;
+		case FMT_INPUT_SCRIPT:
+			put_hex(i->script, i->script_length);
+			break;
+		case FMT_INPUT_SEQUENCE:
+			put_u64(i->sequence_number);
+			break;
+		case FMT_INPUT_NUM:
+			put_u64(i - t->input);
+			break;
+		case FMT_INPUT_HEX:
+			dump_tx_input(i);
+			break;
+		case FMT_INPUT_AMOUNT:
+			put_u64(spent ? spent->amount : 0);
+			break;
+		case FMT_INPUT_HEIGHT:
+			put_u64(spent ? spent->height : 0);
+			break;
+		case FMT_INPUT_TXNUM:
+			if (spent)
+				put_u64(spent->txnum);
+			else
+				put_mem("-1", 2);
+			break;
+		case FMT_INPUT_PAYMENT:
+			put_u64(txnum != 0 ? 1 : UNKNOWN_OUTPUT);
+			break;
+		case FMT_INPUT_UTXO_SCRIPT_LEN:
+			put_u64(script_len);
+			break;
+		case FMT_INPUT_UTXO_SCRIPT:
+			put_hex(script, script_len);
+			break;
+		case FMT_OUTPUT_AMOUNT:
+			put_u64(o->amount);
+			break;
+		case FMT_OUTPUT_SCRIPT_LEN:
+			put_u64(o->script_length);
+			break;
+		case FMT_OUTPUT_SCRIPT:
+			put_hex(o->script, o->script_length);
+			break;
+		case FMT_OUTPUT_NUM:
+			put_u64(o - t->output);
+			break;
+		case FMT_OUTPUT_UNSPENDABLE:
+			put_u64(is_unspendable(o));
+			break;
+		case FMT_OUTPUT_HEX:
+			dump_tx_output(o);
+			break;
+		case FMT_UTXO_HASH:
+			put_reversed_hash(u->txid);
+			break;
+		case FMT_UTXO_INDEX:
+			put_s64((s32)u->index);
+			break;
+		case FMT_UTXO_TIMESTAMP:
+			put_u64(u->timestamp);
+			break;
+		case FMT_UTXO_HEIGHT:
+			put_u64(u->height);
+			break;
+		case FMT_UTXO_AMOUNT:
+			put_u64(u->amount);
+			break;
+		case FMT_UTXO_SCRIPT_LEN:
+			put_u64(script_len);
+			break;
+		case FMT_UTXO_SCRIPT:
+			put_hex(script, script_len);
+			break;
+		case FMT_UTXO_BDC:
+			if (last_utxo_block)
+				put_s64(calculate_bdc(u, b->bh.timestamp,
+						      last_utxo_block->bh.timestamp));
+			else
+				put_char('0');
+			break;
+		}
 	}
-	break;
-      default:
-	goto bad_fmt;
-      }
-      break;
-    }
-
-    /* Skip first two escape letters; loop will skip next */
-    c += 2;
-  }
-  fputc('\n', stdout);
-  return;
-	
- bad_fmt:
-  errx(1, "Bad %s format %.3s",
-       u ? "utxo" : i ? "input" : o ? "output" : t ? "transaction" : "block",
-       c);
 }
@@ -2,20 +2,67 @@
  *
  *  = format.h
  *
- *  Defines a function for interpolating blockchain data into a
+ *  Defines functions for interpolating blockchain data into a
  *  user-provided format string.
  *
+ *  Each format string is compiled once into a list of operations,
+ *  which are then run for every record.  Output is collected in a
+ *  large buffer and written to stdout in big chunks (and at exit).
+ *
  */
 
 #ifndef BITCOIN_ITERATE_DUMP_H
 #define BITCOIN_ITERATE_DUMP_H
+#include <ccan/tal/tal.h>
 #include "types.h"
 #include "utxo.h"
 
+/* Which record a format string is printed for. */
+enum format_kind {
+	FORMAT_BLOCK,
+	FORMAT_TRANSACTION,
+	FORMAT_INPUT,
+	FORMAT_OUTPUT,
+	FORMAT_UTXO
+};
+
+struct format;
+
+/**
+ * compile_format - Compile a user-provided format string.
+ *
+ * @ctx: tal context for the compiled format
+ * @fmt: format string
+ * @kind: the record it will be printed for, which decides the valid
+ *        escape codes
+ *
+ * Exits with an error on an invalid escape code.
+ */
+struct format *compile_format(const tal_t *ctx, const char *fmt,
+			      enum format_kind kind);
+
+/**
+ * format_needs_utxo - Does a format print fees, or anything else
+ * which needs the UTXO set to be tracked?
+ *
+ * @format: the compiled format
+ */
+bool format_needs_utxo(const struct format *format);
+
 /**
- * print_format - Interpolate blockchain data into user-provided format string.
- * 
- * @format: format string
+ * format_parse_needs - Which parts of each transaction does a format
+ * print?
+ *
+ * @format: the compiled format
+ *
+ * Returns the PARSE_* flags for read_transactions().
+ */
+unsigned int format_parse_needs(const struct format *format);
+
+/**
+ * print_format - Interpolate blockchain data into a compiled format.
+ *
+ * @format: compiled format
  * @utxo_map: global UTXO map
  * @b: current block
  * @t: current transaction
@@ -30,30 +77,30 @@
  *
  * Example:
  *      // Print block b
- *	print_format(blockfmt, &utxo_map, b, NULL, 0, NULL, NULL, NULL);
+ *	print_format(blockfmt, &utxo_map, b, NULL, 0, NULL, NULL, NULL, NULL);
  *
  * Example:
- * 
+ *
  *      // Print transaction t with number txnum in block b
- *	print_format(txfmt, &utxo_map, b, t, txnum, NULL, NULL, NULL);
+ *	print_format(txfmt, &utxo_map, b, t, txnum, NULL, NULL, NULL, NULL);
  *
  * Example:
- *	
+ *
  *      // Print transaction input i in transaction t with number txnum in block b
- *	print_format(inputfmt, &utxo_map, b, t, txnum, i, NULL, NULL);
+ *	print_format(inputfmt, &utxo_map, b, t, txnum, i, NULL, NULL, NULL);
  *
  * Example:
- *	
+ *
  *      // Print transaction output o in transaction t with number txnum in block b
- *	print_format(outputfmt, &utxo_map, b, t, txnum, NULL, o, NULL);
+ *	print_format(outputfmt, &utxo_map, b, t, txnum, NULL, o, NULL, NULL);
  *
  * Example:
- *	
+ *
  *      // Print UTXO u in block b
- *	print_format(utxofmt, &utxo_map, b, NULL, 0, NULL, NULL, u);
- *		
+ *	print_format(utxofmt, &utxo_map, b, NULL, 0, NULL, NULL, u, last_utxo_block);
+ *
  */
-void print_format(const char *format,
+void print_format(const struct format *format,
 		  const struct utxo_map *utxo_map,
 		  struct block *b,
 		  struct transaction *t,
@@ -3,8 +3,46 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <assert.h>
+#include <string.h>
 #include <sys/mman.h>
 
+/* XORs 32 bytes at a time: with AVX2 if the CPU has it, otherwise
+ * with whatever vectors the compiler has (SSE2, NEON). */
+typedef u64 xor_vec __attribute__((vector_size(32)));
+
+#if defined(__x86_64__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void xor_bytes(u8 *p, size_t len, const u8 key[8])
+{
+	xor_vec k, v;
+	u64 k64;
+	size_t i;
+
+	memcpy(&k64, key, sizeof(k64));
+	k = (xor_vec){ k64, k64, k64, k64 };
+	for (; len >= sizeof(v); p += sizeof(v), len -= sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		v ^= k;
+		memcpy(p, &v, sizeof(v));
+	}
+	for (i = 0; i < len; i++)
+		p[i] ^= key[i % 8];
+}
+
+void file_unobfuscate(const struct file *f, void *buf, size_t size, off_t off)
+{
+	u8 key[8];
+	size_t i;
+
+	if (!f->xor_key)
+		return;
+	/* The key lines up with offsets in the file, not in @buf. */
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = f->xor_key[(off + i) % 8];
+	xor_bytes(buf, size, key);
+}
+
 void *file_read(struct file *f, off_t off, size_t size, void *buf)
 {
 	if (f->mmap) {
@@ -14,6 +52,7 @@ void *file_read(struct file *f, off_t off, size_t size, void *buf)
 	if (pread(f->fd, buf, size, off) != size)
 		err(1, "Reading %zu from %s offset %llu",
 		    size, f->name, (long long)off);
+	file_unobfuscate(f, buf, size, off);
 	return buf;
 }
 
@@ -58,6 +97,7 @@ void file_open(struct file *f, const char *name, off_t len, int oflags)
 	bool do_mmap = !(oflags & O_NO_MMAP);
 
 	f->name = name;
+	f->xor_key = NULL;
 	f->fd = open(name, oflags & ~O_NO_MMAP, 0600);
 	if (f->fd < 0)
 		err(1, "Opening %s", name);
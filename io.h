@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <ccan/short_types/short_types.h>
 
 /**
  * file - Struct used to wrap files.
@@ -20,6 +21,8 @@
  * @fd: file descriptor
  * @len: size
  * @mmap: mmap pointer for file
+ * @xor_key: 8-byte key the file's contents are XORed with on disk, or
+ *           NULL.  Such a file is never mapped: reads undo the XOR.
  *
  */
 struct file {
@@ -27,6 +30,7 @@ struct file {
 	int fd;
 	off_t len;
 	void *mmap;
+	const u8 *xor_key;
 };
 
 /* O_NOCTTY doesn't make sense for normal files, so overload it */
@@ -45,6 +49,18 @@ struct file {
  */
 void *file_read(struct file *f, off_t off, size_t size, void *buf);
 
+/**
+ * file_unobfuscate - Undo a file's XOR obfuscation of data read from it.
+ *
+ * @f: the file the data was read from
+ * @buf: the data
+ * @size: length of the data
+ * @off: offset the data was read from
+ *
+ * Does nothing if @f has no XOR key.  file_read() already does this.
+ */
+void file_unobfuscate(const struct file *f, void *buf, size_t size, off_t off);
+
 /**
  * file_write - Write to (possibly memory-mapped) file.
  *
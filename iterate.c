@@ -1,13 +1,20 @@
 #include <ccan/err/err.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "parse.h"
 #include "block.h"
 #include "blockfiles.h"
 #include "cache.h"
+#include "pipeline.h"
+#include "prefetch.h"
+#include "threadpool.h"
 #include "iterate.h"
 
 #define BLOCK_PROGRESS_PERIOD 10000
 
+/* Blocks whose timestamps make up a block's median time past. */
+#define MEDIAN_TIME_SPAN 11
+
 static void set_heights_and_best(struct block **best, struct block *genesis, struct block_map *block_map)
 {
   struct block *b;
@@ -39,46 +46,106 @@ static void set_blockchain_start(u8 *start_hash, struct block **start, struct bl
   }
 }
 
-static void link_blocks(struct block *best, struct block_map *block_map)
+/* Returns the chain from genesis to best, indexed by height. */
+static struct block **link_blocks(const tal_t *ctx, struct block *best, struct block_map *block_map)
 {
-  struct block *b, *next = NULL;
-  for (b = best; b; b = block_map_get(block_map, b->bh.prev_hash)) {
-    b->next = next;
-    next = b;
-  }
+  struct block **chain = tal_arr(ctx, struct block *, best->height + 1);
+  struct block *b;
+  for (b = best; b; b = block_map_get(block_map, b->bh.prev_hash))
+    chain[b->height] = b;
+  return chain;
 }  
 
-static void set_iteration_end(unsigned long block_end, struct block **best, struct block *genesis)
+static void set_iteration_end(unsigned long block_end, struct block **best, struct block ***chain)
 {
   if (block_end != -1UL) {
-    struct block *b;
-    for (b = genesis; b->height != block_end; b = b->next) {
-      if (!b->next)
-	errx(1, "No block end %lu found", block_end);
-    }
-    *best = b;
-    b->next = NULL;
+    if (block_end >= tal_count(*chain))
+      errx(1, "No block end %lu found", block_end);
+    *best = (*chain)[block_end];
+    tal_resize(chain, block_end + 1);
   }
 }
 
-static void set_iteration_start(unsigned long block_start, struct block **start, struct block *genesis)
+static void set_iteration_start(unsigned long block_start, struct block **start, struct block **chain)
 {
   if (block_start != 0) {
-    struct block *b;
-    for (b = genesis; b->height != block_start; b = b->next) {
-      if (!b->next)
-		errx(1, "No block start %lu found", block_start);
-    }
-    *start = b;
+    if (block_start >= tal_count(chain))
+      errx(1, "No block start %lu found", block_start);
+    *start = chain[block_start];
+  }
+}
+
+static int u32_cmp(const void *a, const void *b)
+{
+  const u32 *ua = a, *ub = b;
+  return *ua < *ub ? -1 : *ua > *ub;
+}
+
+/* The median of a block's timestamp and those of the blocks before
+ * it, as bitcoind uses for time locks.  Timestamps themselves can go
+ * backwards along the chain, but this never does. */
+static u32 median_time_past(struct block **chain, size_t height)
+{
+  u32 times[MEDIAN_TIME_SPAN];
+  size_t i, n = 0;
+
+  for (i = height + 1 > MEDIAN_TIME_SPAN ? height + 1 - MEDIAN_TIME_SPAN : 0;
+       i <= height;
+       i++)
+    times[n++] = chain[i]->bh.timestamp;
+  qsort(times, n, sizeof(times[0]), u32_cmp);
+  return times[n / 2];
+}
+
+/* Returns the first height whose median time past is at least @t, or
+ * the length of the chain if there is none. */
+static size_t search_chain_time(struct block **chain, unsigned long t)
+{
+  size_t lo = 0, hi = tal_count(chain);
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (median_time_past(chain, mid) < t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void set_iteration_end_time(unsigned long end_time, struct block **best, struct block ***chain)
+{
+  if (end_time != -1UL) {
+    size_t num = search_chain_time(*chain, end_time + 1);
+    if (num == 0)
+      errx(1, "No block end found at time %lu", end_time);
+    *best = (*chain)[num - 1];
+    tal_resize(chain, num);
+  }
+}
+
+static void set_iteration_start_time(unsigned long start_time, struct block **start, struct block **chain)
+{
+  if (start_time != 0) {
+    size_t height = search_chain_time(chain, start_time);
+    if (height == tal_count(chain))
+      errx(1, "No block start found at time %lu", start_time);
+    if ((s64)height > (*start)->height)
+      *start = chain[height];
   }
 }
 
 void iterate(char *blockdir, char *cachedir,
 	     bool use_testnet,
 	     unsigned long block_start, unsigned long block_end,
+	     unsigned long start_time, unsigned long end_time,
 	     u8 *start_hash, u8 *tip,
-	     bool needs_utxo, unsigned int utxo_period,
-	     bool use_mmap,
+	     bool needs_utxo, unsigned int utxo_period, unsigned long utxo_hot,
+	     unsigned int parse_needs,
+	     bool use_mmap, bool use_block_index,
+	     unsigned int nthreads, bool split_blocks,
+	     unsigned int prefetch_ahead, unsigned int open_files,
+	     unsigned long max_mapped,
 	     unsigned progress_marks, bool quiet,
 	     block_function blockfn,
 	     transaction_function txfn,
@@ -90,16 +157,30 @@ void iterate(char *blockdir, char *cachedir,
   size_t i, block_count = 0;
   bool needs_fee;
   struct block *b, *best = NULL, *genesis = NULL, *start = NULL, *last_utxo_block = NULL;
+  struct block **chain;
+  size_t first, h;
   struct block_map block_map;
   struct utxo_map utxo_map;
-  struct space space;
+  const char *utxo_dir = NULL;
+  struct space space, *split_spaces = NULL;
+  size_t num_split = 0;
+  struct block_buffer blockbuf;
+  struct block_file_pool *files;
+  struct file *cur_file = NULL;
+  struct block *cur_block = NULL;
+  struct pipeline *pipeline = NULL;
+  struct prefetch *prefetch = NULL;
+  struct thread_pool *pool;
   static char **block_fnames;
+  const u8 *xor_key;
 
   block_fnames = block_filenames(tal_ctx, blockdir, use_testnet);
+  xor_key = block_xor_key(tal_ctx, block_fnames);
+  pool = thread_pool_new(tal_ctx, nthreads);
 
   block_count = read_blockchain(tal_ctx,
-		  quiet, use_mmap,
-		  use_testnet, cachedir,
+		  quiet, use_mmap, xor_key,
+		  use_testnet, use_block_index, pool, cachedir,
 		  block_fnames,
 		  &block_map, &genesis, block_end);
 
@@ -108,10 +189,12 @@ void iterate(char *blockdir, char *cachedir,
   set_heights_and_best(&best, genesis, &block_map);
   set_blockchain_end(tip, &best, &block_map);
   set_blockchain_start(start_hash, &start, &block_map);
-  link_blocks(best, &block_map);
+  chain = link_blocks(tal_ctx, best, &block_map);
 
-  set_iteration_end(block_end, &best, genesis);
-  set_iteration_start(block_start, &start, genesis);
+  set_iteration_end(block_end, &best, &chain);
+  set_iteration_end_time(end_time, &best, &chain);
+  set_iteration_start(block_start, &start, chain);
+  set_iteration_start_time(start_time, &start, chain);
   if (!quiet) {
     fprintf(stderr, "bitcoin-iterate: Iterating between block heights %u and %u (of %zu total blocks)\n",
 	   start->height, best->height, block_count);
@@ -122,23 +205,63 @@ void iterate(char *blockdir, char *cachedir,
     }
   }
   
-  utxo_map_init(&utxo_map);
+  if (utxo_hot) {
+    utxo_dir = cachedir ? cachedir : getenv("TMPDIR");
+    if (!utxo_dir)
+      utxo_dir = "/tmp";
+  }
+  /* With threads, each block's UTXO changes are applied to shards of
+   * the set at once. */
+  if (nthreads > 1)
+    utxo_map_init_sharded(&utxo_map, nthreads, utxo_dir, utxo_hot);
+  else if (utxo_dir)
+    utxo_map_init_disk(&utxo_map, utxo_dir, utxo_hot);
+  else
+    utxo_map_init(&utxo_map);
  	
+  /* Tracking UTXOs needs txids, and output scripts for OP_RETURN. */
+  if (needs_utxo)
+    parse_needs |= PARSE_TXID | PARSE_SCRIPTS;
+
   needs_fee = needs_utxo;
   /* Do we have cache utxo? */
   if (cachedir && start && needs_utxo) {
-    if (read_utxo_cache(tal_ctx, quiet, &utxo_map, cachedir, start->id)) {
+    if (read_utxo_cache(quiet, pool, &utxo_map, cachedir, start->id)) {
       needs_fee = false;
     } else if (!quiet)
       fprintf(stderr, "bitcoin-iterate: Did not find valid UTXO cache\n");
   }
 
+  files = block_file_pool_new(tal_ctx, block_fnames, open_files, max_mapped,
+			      use_mmap, xor_key);
+
+  /* Parse ahead on worker threads: from genesis if we are rebuilding
+   * the UTXO set, otherwise from the first block we print. */
+  first = needs_fee ? 0 : start->height;
+  if (nthreads > 1 && !split_blocks && (txfn || inputfn || outputfn || utxofn) && first < tal_count(chain))
+    pipeline = pipeline_new(tal_ctx, nthreads,
+			    chain + first, tal_count(chain) - first,
+			    files, parse_needs);
+  if (prefetch_ahead && (txfn || inputfn || outputfn || utxofn) && first < tal_count(chain))
+    prefetch = prefetch_new(tal_ctx, chain + first, tal_count(chain) - first,
+			    block_fnames, prefetch_ahead);
+
+  block_buffer_init(&blockbuf);
+  space_init(&space);
+  if (split_blocks) {
+    num_split = thread_pool_size(pool);
+    split_spaces = tal_arr(tal_ctx, struct space, num_split);
+    for (i = 0; i < num_split; i++)
+      space_init(&split_spaces[i]);
+  }
   int blocks_iterated = 0;
   /* Now run forwards. */
-  for (b = genesis; b; b = b->next) {
+  for (h = 0; h < tal_count(chain); h++) {
     off_t off;
     struct transaction *tx;
 
+    b = chain[h];
+
     if (!quiet && (b->height > 0) && (b->height % BLOCK_PROGRESS_PERIOD) == 0) {
       fprintf(stderr,"bitcoin-iterate: Iterating over block number %i\n",b->height);
     }
@@ -148,7 +271,7 @@ void iterate(char *blockdir, char *cachedir,
       if (cachedir && needs_utxo) {
         if (needs_fee) {
 		  /* Save cache for next time. */
-		  write_utxo_cache(&utxo_map, quiet, cachedir, b->id);
+		  write_utxo_cache(&utxo_map, quiet, pool, cachedir, b->id);
         } else {
 		  /* We loaded cache, now we calc fee. */
 		  needs_fee = true;
@@ -171,17 +294,58 @@ void iterate(char *blockdir, char *cachedir,
     /* If we haven't started and don't need to gather UTXO, skip */
     if (start && !needs_fee)
       continue;
-		
-    off = b->pos;
 
-    space_init(&space);
-    tx = space_alloc_arr(&space, struct transaction,
-			 b->bh.transaction_count);
+    if (prefetch)
+      prefetch_advance(prefetch, h - first);
+
+    if (pipeline) {
+      tx = pipeline_next(pipeline, b);
+    } else {
+      struct file *f;
+
+      /* Hold the file until we're done with the block's transactions. */
+      if (cur_file) {
+	block_file_done(files, cur_block);
+	block_file_put(files, cur_file);
+      }
+      cur_file = block_file_get(files, b->filenum);
+      cur_block = b;
+      f = block_transactions(&blockbuf, cur_file, b, &off);
+
+      /* Have the next block read while we parse this one. */
+      if (!use_mmap && h + 1 < tal_count(chain)) {
+	struct file *next = block_file_get(files, chain[h+1]->filenum);
+	block_readahead(next, chain[h+1]);
+	block_file_put(files, next);
+      }
+
+      space_reset(&space);
+      tx = space_alloc_arr(&space, struct transaction,
+			   b->bh.transaction_count);
+      if (num_split) {
+	for (i = 0; i < num_split; i++)
+	  space_reset(&split_spaces[i]);
+	read_transactions_split(pool, split_spaces, tx,
+				b->bh.transaction_count, f, &off, parse_needs);
+      } else
+	read_transactions(&space, tx, b->bh.transaction_count, f, &off,
+			  parse_needs);
+    }
+
+    /* Add the block's outputs first, so inputs spending them later in
+     * the block can be looked up (a transaction can only spend outputs
+     * of transactions before it). */
+    if (needs_fee)
+      add_block_utxos(&utxo_map, pool, b, tx, b->bh.transaction_count);
+
+    /* Look up everything the block spends in one go, rather than an
+     * input at a time as the callbacks ask for them. */
+    if (needs_fee && !start && (txfn || inputfn))
+      resolve_block_prevouts(&utxo_map, tx, b->bh.transaction_count);
+
     for (i = 0; i < b->bh.transaction_count; i++) {
       size_t j;
 
-      read_transaction(&space, &tx[i],
-			       block_file(block_fnames, b->filenum, use_mmap), &off);
       if (!start && txfn)
 	txfn(&utxo_map, b, &tx[i], i);
 
@@ -196,37 +360,50 @@ void iterate(char *blockdir, char *cachedir,
 	  outputfn(&utxo_map, b, &tx[i], i, &tx[i].output[j]);
 	}
       }
-
-      if (needs_fee) {
-	/* Now we can release consumed utxos;
-	 * before there was a possibility of %tF */
-	/* Coinbase inputs are not real */
-	if (i != 0) {
-	  for (j = 0; j < tx[i].input_count; j++)
-	    release_utxo(&utxo_map, &tx[i].input[j]);
-	}
-
-	/* And add this tx's outputs to utxo */
-	add_utxos(tal_ctx, &utxo_map, b, &tx[i], i);
-      }
     }
+
+    /* Now we can release consumed utxos;
+     * before there was a possibility of %tF */
+    if (needs_fee)
+      release_block_utxos(&utxo_map, pool, tx, b->bh.transaction_count);
     
     if (!start) {
       blocks_iterated += 1;
     }
 
     if (!start && utxofn && ((blocks_iterated % utxo_period) == 0)) {
-      struct utxo_map_iter it;
-      struct utxo *utxo;
-      for (utxo = utxo_map_first(&utxo_map, &it);
-				 utxo;
-				 utxo = utxo_map_next(&utxo_map, &it)) {
-		 		 		utxofn(&utxo_map, b, last_utxo_block, utxo);
-	  		}
+      /* Same order with any number of threads, backend or cache. */
+      struct utxo **utxos = utxo_map_sorted(NULL, &utxo_map);
+      size_t n;
+
+      for (n = 0; n < tal_count(utxos); n++)
+        utxofn(&utxo_map, b, last_utxo_block, utxos[n]);
+      tal_free(utxos);
     }
     if (!start && utxofn) {
         last_utxo_block = b;
     }
 		
   }
+  if (!quiet && (txfn || inputfn || outputfn || utxofn)) {
+    size_t high_water = pipeline ? pipeline_space_high_water(pipeline)
+      : space_high_water(&space);
+    /* Split runs are parsed at once, so add them up. */
+    for (i = 0; i < num_split; i++)
+      high_water += space_high_water(&split_spaces[i]);
+    fprintf(stderr, "bitcoin-iterate: Parsing a block took at most %.1f MB\n",
+	    high_water / (1024.0 * 1024.0));
+  }
+  tal_free(pipeline);
+  space_free(&space);
+  for (i = 0; i < num_split; i++)
+    space_free(&split_spaces[i]);
+  if (cur_file)
+    block_file_put(files, cur_file);
+  if (!quiet && (txfn || inputfn || outputfn || utxofn))
+    block_file_pool_print_stats(files);
+  if (prefetch && !quiet)
+    prefetch_print_stats(prefetch);
+  tal_free(prefetch);
+  block_buffer_free(&blockbuf);
 }
@@ -2,6 +2,7 @@
 #define BITCOIN_ITERATE_H
 #include <stdbool.h>
 #include <ccan/short_types/short_types.h>
+#include "parse.h"
 #include "types.h"
 #include "utxo.h"
 
@@ -71,11 +72,26 @@ typedef void (*utxo_function)(const struct utxo_map *utxo_map, struct block *cur
  * @use_testnet: whether or not to use testnet
  * @block_start: starting block height
  * @block_end: ending block height
+ * @start_time: start at the first block whose median time past (the median
+ *              timestamp of it and the 10 blocks before it) is at least
+ *              this UNIX time (0 for no limit)
+ * @end_time: end at the last block whose median time past is at most this
+ *            UNIX time (-1 for no limit)
  * @start_hash: starting block hash
  * @tip: ending block hash
  * @needs_utxo: whether or not iterate needs to calculate UTXO data
  * @utxo_period: number of blocks in between successive UTXO function calls
+ * @utxo_hot: keep at most this many UTXOs in memory, spilling older ones to
+ *            files in @cachedir (or $TMPDIR); 0 to keep them all in memory
+ * @parse_needs: PARSE_* flags for the parts of transactions the functions
+ *               use (PARSE_ALL if unsure); anything else is left unset
  * @use_mmap: use mmap
+ * @use_block_index: load blocks from bitcoind's block index instead of scanning block files
+ * @nthreads: number of threads scanning block files, parsing blocks ahead of the callbacks and updating shards of the UTXO set (0 or 1 for none)
+ * @split_blocks: parse each block's transactions on all @nthreads threads, instead of parsing blocks ahead
+ * @prefetch_ahead: number of blocks to read into the page cache ahead of parsing (0 for none)
+ * @open_files: number of block files to keep open while iterating
+ * @max_mapped: bytes of already-iterated blocks to keep mapped before releasing them (0 for no limit)
  * @progress_marks: interval at which to print '.' to stderr, default is None
  * @quiet: whether or not to silence output
  * @blockfn: function used to process/print block struct data - specified by --block format strings
@@ -88,9 +104,14 @@ typedef void (*utxo_function)(const struct utxo_map *utxo_map, struct block *cur
 void iterate(char *blockdir, char *cachedir,
 	     bool use_testnet,
 	     unsigned long block_start, unsigned long block_end,
+	     unsigned long start_time, unsigned long end_time,
 	     u8 *start_hash, u8 *tip,
-	     bool needs_utxo, unsigned int utxo_period,
-	     bool use_mmap,
+	     bool needs_utxo, unsigned int utxo_period, unsigned long utxo_hot,
+	     unsigned int parse_needs,
+	     bool use_mmap, bool use_block_index,
+	     unsigned int nthreads, bool split_blocks,
+	     unsigned int prefetch_ahead, unsigned int open_files,
+	     unsigned long max_mapped,
 	     unsigned progress_marks, bool quiet,
 	     block_function blockfn,
 	     transaction_function txfn,
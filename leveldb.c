@@ -0,0 +1,646 @@
+#include <ccan/err/err.h>
+#include <ccan/endian/endian.h>
+#include <ccan/take/take.h>
+#include <ccan/tal/path/path.h>
+#include <ccan/tal/str/str.h>
+#include <ccan/tal/grab_file/grab_file.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include "leveldb.h"
+#include "snappy.h"
+
+#define TABLE_MAGIC		0xdb4775248b80fb57ULL
+#define TABLE_FOOTER_SIZE	48
+#define BLOCK_TRAILER_SIZE	5
+
+#define COMPRESSION_NONE	0
+#define COMPRESSION_SNAPPY	1
+
+#define LOG_BLOCK_SIZE		32768
+#define LOG_HEADER_SIZE		7
+
+#define LOG_ZERO		0
+#define LOG_FULL		1
+#define LOG_FIRST		2
+#define LOG_MIDDLE		3
+#define LOG_LAST		4
+
+#define TYPE_DELETION		0
+#define TYPE_VALUE		1
+
+/* Version edit tags, as found in a MANIFEST. */
+#define EDIT_COMPARATOR		1
+#define EDIT_LOG_NUMBER		2
+#define EDIT_NEXT_FILE_NUMBER	3
+#define EDIT_LAST_SEQUENCE	4
+#define EDIT_COMPACT_POINTER	5
+#define EDIT_DELETED_FILE	6
+#define EDIT_NEW_FILE		7
+#define EDIT_PREV_LOG_NUMBER	9
+
+#define NUM_LEVELS		7
+
+/* Key and value bytes are copied into chunks of this size. */
+#define ARENA_CHUNK		(1024 * 1024)
+
+/**
+ * table_file - A table named by the MANIFEST.
+ */
+struct table_file {
+	u64 level;
+	u64 number;
+};
+
+/**
+ * manifest - The live files, from replaying the MANIFEST's version edits.
+ */
+struct manifest {
+	struct table_file *tables;
+	size_t num_tables;
+	/* Logs older than this are already in tables. */
+	u64 log_number;
+	u64 prev_log_number;
+};
+
+/**
+ * entry - One version of a key, from a table or a log.
+ */
+struct entry {
+	struct leveldb_record rec;
+	u64 seq;
+	u8 type;
+};
+
+struct reader {
+	const char *name;
+	const u8 *prefix;
+	size_t prefixlen;
+
+	struct entry *entries;
+	size_t num_entries;
+
+	/* Current arena chunk (children of entries' parent). */
+	const tal_t *arena_ctx;
+	u8 *chunk;
+	size_t chunk_used;
+};
+
+static void corrupt(const struct reader *r, const char *what)
+{
+	errx(1, "Corrupt LevelDB file %s: %s", r->name, what);
+}
+
+static const u8 *arena_copy(struct reader *r, const u8 *p, size_t len)
+{
+	u8 *dst;
+
+	if (len > ARENA_CHUNK)
+		return tal_dup(r->arena_ctx, u8, p, len, 0);
+
+	if (!r->chunk || r->chunk_used + len > ARENA_CHUNK) {
+		r->chunk = tal_arr(r->arena_ctx, u8, ARENA_CHUNK);
+		r->chunk_used = 0;
+	}
+	dst = r->chunk + r->chunk_used;
+	memcpy(dst, p, len);
+	r->chunk_used += len;
+	return dst;
+}
+
+static bool pull_varint64(const u8 **p, const u8 *end, u64 *v)
+{
+	unsigned int shift;
+
+	*v = 0;
+	for (shift = 0; shift < 64 && *p < end; shift += 7) {
+		u8 c = *(*p)++;
+
+		*v |= (u64)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static size_t pull_size(const struct reader *r, const u8 **p, const u8 *end)
+{
+	u64 v;
+
+	if (!pull_varint64(p, end, &v) || v > end - *p)
+		corrupt(r, "bad length");
+	return v;
+}
+
+static void add_entry(struct reader *r,
+		      const u8 *key, size_t keylen,
+		      const u8 *value, size_t valuelen,
+		      u64 seq, u8 type)
+{
+	struct entry *e;
+
+	if (keylen < r->prefixlen || memcmp(key, r->prefix, r->prefixlen) != 0)
+		return;
+
+	if (r->num_entries == tal_count(r->entries))
+		tal_resize(&r->entries, r->num_entries * 2 + 1024);
+
+	e = &r->entries[r->num_entries++];
+	e->rec.key = arena_copy(r, key, keylen);
+	e->rec.keylen = keylen;
+	e->rec.value = type == TYPE_VALUE ? arena_copy(r, value, valuelen) : NULL;
+	e->rec.valuelen = type == TYPE_VALUE ? valuelen : 0;
+	e->seq = seq;
+	e->type = type;
+}
+
+/* Table keys are "internal keys": user key, then (seq << 8 | type). */
+static void add_internal_entry(struct reader *r,
+			       const u8 *key, size_t keylen,
+			       const u8 *value, size_t valuelen)
+{
+	le64 trailer;
+
+	if (keylen < sizeof(trailer))
+		corrupt(r, "short key");
+	keylen -= sizeof(trailer);
+	memcpy(&trailer, key + keylen, sizeof(trailer));
+	add_entry(r, key, keylen, value, valuelen,
+		  le64_to_cpu(trailer) >> 8, le64_to_cpu(trailer) & 0xFF);
+}
+
+/*
+ * == Tables ==
+ */
+
+/* Returns the contents of the block at the handle *p, decompressing
+ * into a new tal buffer (which the caller frees) if needed. */
+static const u8 *read_table_block(const tal_t *ctx, const struct reader *r,
+				  const u8 *table, size_t tablelen,
+				  const u8 **p, const u8 *end, size_t *size)
+{
+	u64 offset, len;
+	const u8 *data;
+	u8 *out;
+
+	if (!pull_varint64(p, end, &offset) || !pull_varint64(p, end, &len))
+		corrupt(r, "bad block handle");
+	if (offset > tablelen || len + BLOCK_TRAILER_SIZE > tablelen - offset)
+		corrupt(r, "block handle out of range");
+
+	data = table + offset;
+	switch (data[len]) {
+	case COMPRESSION_NONE:
+		*size = len;
+		return data;
+	case COMPRESSION_SNAPPY:
+		if (!snappy_uncompressed_length(data, len, size))
+			corrupt(r, "bad snappy length");
+		out = tal_arr(ctx, u8, *size);
+		if (!snappy_decompress(data, len, out, *size))
+			corrupt(r, "bad snappy data");
+		return out;
+	default:
+		corrupt(r, "unknown compression");
+	}
+	return NULL;
+}
+
+/* Calls @fn for each (prefix-compressed) entry in a table block. */
+static void read_block_entries(struct reader *r, const u8 *blk, size_t size,
+			       void (*fn)(struct reader *r,
+					  const u8 *key, size_t keylen,
+					  const u8 *value, size_t valuelen,
+					  void *arg),
+			       void *arg)
+{
+	const u8 *p = blk, *end;
+	le32 num_restarts;
+	u8 *key = tal_arr(NULL, u8, 0);
+	size_t keylen = 0;
+
+	if (size < sizeof(num_restarts))
+		corrupt(r, "short block");
+	memcpy(&num_restarts, blk + size - sizeof(num_restarts),
+	       sizeof(num_restarts));
+	if ((u64)le32_to_cpu(num_restarts) + 1 > size / sizeof(num_restarts))
+		corrupt(r, "bad restart count");
+	end = blk + size - (le32_to_cpu(num_restarts) + 1) * sizeof(num_restarts);
+
+	while (p < end) {
+		u64 shared, non_shared, valuelen;
+
+		if (!pull_varint64(&p, end, &shared)
+		    || !pull_varint64(&p, end, &non_shared)
+		    || !pull_varint64(&p, end, &valuelen))
+			corrupt(r, "bad entry header");
+		if (shared > keylen || non_shared > end - p
+		    || valuelen > end - p - non_shared)
+			corrupt(r, "bad entry lengths");
+
+		keylen = shared + non_shared;
+		if (keylen > tal_count(key))
+			tal_resize(&key, keylen);
+		memcpy(key + shared, p, non_shared);
+		p += non_shared;
+
+		fn(r, key, keylen, p, valuelen, arg);
+		p += valuelen;
+	}
+	tal_free(key);
+}
+
+static void add_data_entry(struct reader *r,
+			   const u8 *key, size_t keylen,
+			   const u8 *value, size_t valuelen,
+			   void *unused)
+{
+	add_internal_entry(r, key, keylen, value, valuelen);
+}
+
+/* Each index block entry's value is the handle of a data block. */
+static void read_data_block(struct reader *r,
+			    const u8 *key, size_t keylen,
+			    const u8 *value, size_t valuelen,
+			    void *arg)
+{
+	const u8 **table = arg;
+	const u8 *blk;
+	size_t size;
+
+	blk = read_table_block(NULL, r, table[0], table[1] - table[0],
+			       &value, value + valuelen, &size);
+	read_block_entries(r, blk, size, add_data_entry, NULL);
+	if (blk < table[0] || blk >= table[1])
+		tal_free(blk);
+}
+
+static void read_table(struct reader *r, const u8 *data, size_t len)
+{
+	const u8 *p, *end, *index;
+	const u8 *table[2] = { data, data + len };
+	le64 magic;
+	size_t size;
+
+	if (len < TABLE_FOOTER_SIZE)
+		corrupt(r, "short table");
+	memcpy(&magic, data + len - sizeof(magic), sizeof(magic));
+	if (le64_to_cpu(magic) != TABLE_MAGIC)
+		corrupt(r, "bad table magic");
+
+	/* Footer: metaindex handle, then index handle. */
+	p = data + len - TABLE_FOOTER_SIZE;
+	end = data + len - sizeof(magic);
+	{
+		u64 skip;
+		if (!pull_varint64(&p, end, &skip) || !pull_varint64(&p, end, &skip))
+			corrupt(r, "bad metaindex handle");
+	}
+	index = read_table_block(NULL, r, data, len, &p, end, &size);
+	read_block_entries(r, index, size, read_data_block, table);
+	if (index < table[0] || index >= table[1])
+		tal_free(index);
+}
+
+/*
+ * == Logs ==
+ */
+
+/* A log record holds a write batch: seq, count, then the updates. */
+static void read_batch(struct reader *r, const u8 *p, size_t len, void *unused)
+{
+	const u8 *end = p + len;
+	le64 seq;
+	le32 count;
+	u32 i;
+
+	if (len < sizeof(seq) + sizeof(count))
+		corrupt(r, "short write batch");
+	memcpy(&seq, p, sizeof(seq));
+	memcpy(&count, p + sizeof(seq), sizeof(count));
+	p += sizeof(seq) + sizeof(count);
+
+	for (i = 0; i < le32_to_cpu(count); i++) {
+		const u8 *key, *value = NULL;
+		size_t keylen, valuelen = 0;
+		u8 type;
+
+		if (p == end)
+			corrupt(r, "truncated write batch");
+		type = *p++;
+		keylen = pull_size(r, &p, end);
+		key = p;
+		p += keylen;
+		if (type == TYPE_VALUE) {
+			valuelen = pull_size(r, &p, end);
+			value = p;
+			p += valuelen;
+		} else if (type != TYPE_DELETION)
+			corrupt(r, "unknown write batch entry");
+		add_entry(r, key, keylen, value, valuelen,
+			  le64_to_cpu(seq) + i, type);
+	}
+}
+
+/* Calls @fn for each (reassembled) record in a log-format file. */
+static void read_log(struct reader *r, const u8 *data, size_t len,
+		     void (*fn)(struct reader *r, const u8 *p, size_t len,
+				void *arg),
+		     void *arg)
+{
+	u8 *frag = tal_arr(NULL, u8, 0);
+	size_t pos = 0, fraglen = 0;
+	bool in_frag = false;
+
+	while (pos + LOG_HEADER_SIZE <= len) {
+		size_t left = LOG_BLOCK_SIZE - pos % LOG_BLOCK_SIZE;
+		const u8 *p = data + pos;
+		size_t n;
+
+		/* Block trailers too small for a header are zero-filled. */
+		if (left < LOG_HEADER_SIZE) {
+			pos += left;
+			continue;
+		}
+
+		n = p[4] | ((size_t)p[5] << 8);
+		/* Preallocated (or partially written) tail. */
+		if (p[6] == LOG_ZERO || pos + LOG_HEADER_SIZE + n > len
+		    || LOG_HEADER_SIZE + n > left)
+			break;
+		p += LOG_HEADER_SIZE;
+		pos += LOG_HEADER_SIZE + n;
+
+		switch (p[-1]) {
+		case LOG_FULL:
+			fn(r, p, n, arg);
+			in_frag = false;
+			break;
+		case LOG_FIRST:
+			fraglen = 0;
+			in_frag = true;
+			/* fall thru */
+		case LOG_MIDDLE:
+		case LOG_LAST:
+			if (!in_frag)
+				break;
+			if (fraglen + n > tal_count(frag))
+				tal_resize(&frag, (fraglen + n) * 2);
+			memcpy(frag + fraglen, p, n);
+			fraglen += n;
+			if (p[-1] == LOG_LAST) {
+				fn(r, frag, fraglen, arg);
+				in_frag = false;
+			}
+			break;
+		default:
+			corrupt(r, "unknown log record type");
+		}
+	}
+	tal_free(frag);
+}
+
+/*
+ * == Manifest ==
+ */
+
+static u64 pull_u64(const struct reader *r, const u8 **p, const u8 *end)
+{
+	u64 v;
+
+	if (!pull_varint64(p, end, &v))
+		corrupt(r, "bad varint");
+	return v;
+}
+
+static u64 pull_level(const struct reader *r, const u8 **p, const u8 *end)
+{
+	u64 level = pull_u64(r, p, end);
+
+	if (level >= NUM_LEVELS)
+		corrupt(r, "bad level");
+	return level;
+}
+
+static void skip_slice(const struct reader *r, const u8 **p, const u8 *end)
+{
+	*p += pull_size(r, p, end);
+}
+
+static void remove_table(struct manifest *m, u64 level, u64 number)
+{
+	size_t i;
+
+	for (i = 0; i < m->num_tables; i++) {
+		if (m->tables[i].level == level
+		    && m->tables[i].number == number) {
+			m->tables[i] = m->tables[--m->num_tables];
+			return;
+		}
+	}
+}
+
+static void add_table(struct manifest *m, u64 level, u64 number)
+{
+	if (m->num_tables == tal_count(m->tables))
+		tal_resize(&m->tables, m->num_tables * 2 + 16);
+	m->tables[m->num_tables].level = level;
+	m->tables[m->num_tables].number = number;
+	m->num_tables++;
+}
+
+/* Each MANIFEST record is a version edit against the one before. */
+static void read_edit(struct reader *r, const u8 *p, size_t len, void *arg)
+{
+	struct manifest *m = arg;
+	const u8 *end = p + len;
+
+	while (p < end) {
+		u64 level, number;
+
+		switch (pull_u64(r, &p, end)) {
+		case EDIT_COMPARATOR:
+			skip_slice(r, &p, end);
+			break;
+		case EDIT_LOG_NUMBER:
+			m->log_number = pull_u64(r, &p, end);
+			break;
+		case EDIT_PREV_LOG_NUMBER:
+			m->prev_log_number = pull_u64(r, &p, end);
+			break;
+		case EDIT_NEXT_FILE_NUMBER:
+		case EDIT_LAST_SEQUENCE:
+			pull_u64(r, &p, end);
+			break;
+		case EDIT_COMPACT_POINTER:
+			pull_level(r, &p, end);
+			skip_slice(r, &p, end);
+			break;
+		case EDIT_DELETED_FILE:
+			level = pull_level(r, &p, end);
+			remove_table(m, level, pull_u64(r, &p, end));
+			break;
+		case EDIT_NEW_FILE:
+			level = pull_level(r, &p, end);
+			number = pull_u64(r, &p, end);
+			/* File size, smallest and largest keys. */
+			pull_u64(r, &p, end);
+			skip_slice(r, &p, end);
+			skip_slice(r, &p, end);
+			add_table(m, level, number);
+			break;
+		default:
+			corrupt(r, "unknown version edit tag");
+		}
+	}
+}
+
+/* CURRENT names the MANIFEST, which lists the live tables and logs. */
+static void read_manifest(struct reader *r, const tal_t *ctx,
+			  const char *dir, struct manifest *m)
+{
+	char *current, *manifest, *name;
+	u8 *data;
+
+	name = path_join(ctx, dir, "CURRENT");
+	current = grab_file(ctx, name);
+	if (!current)
+		err(1, "Reading %s", name);
+	r->name = name;
+	if (!tal_strreg(ctx, current, "^(MANIFEST-[0-9]+)\n$", &manifest))
+		corrupt(r, "bad CURRENT");
+	tal_free(current);
+	tal_free(name);
+
+	name = path_join(ctx, dir, take(manifest));
+	data = grab_file(ctx, name);
+	if (!data)
+		err(1, "Reading %s", name);
+
+	m->tables = tal_arr(ctx, struct table_file, 0);
+	m->num_tables = 0;
+	m->log_number = m->prev_log_number = 0;
+	r->name = name;
+	read_log(r, data, tal_count(data) - 1, read_edit, m);
+	tal_free(data);
+	tal_free(name);
+}
+
+/* Tables are NNNNNN.ldb, or NNNNNN.sst from older LevelDB versions. */
+static u8 *grab_table(const tal_t *ctx, const char *dir, u64 number,
+		      char **name)
+{
+	u8 *data;
+
+	*name = path_join(ctx, dir, take(tal_fmt(NULL, "%06llu.ldb",
+						 (unsigned long long)number)));
+	data = grab_file(ctx, *name);
+	if (data)
+		return data;
+	tal_free(*name);
+	*name = path_join(ctx, dir, take(tal_fmt(NULL, "%06llu.sst",
+						 (unsigned long long)number)));
+	data = grab_file(ctx, *name);
+	if (!data)
+		err(1, "Reading %s", *name);
+	return data;
+}
+
+/*
+ * == Merging ==
+ */
+
+/* By key, newest first. */
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct entry *ea = a, *eb = b;
+	size_t len = ea->rec.keylen < eb->rec.keylen ? ea->rec.keylen : eb->rec.keylen;
+	int c = memcmp(ea->rec.key, eb->rec.key, len);
+
+	if (c)
+		return c;
+	if (ea->rec.keylen != eb->rec.keylen)
+		return ea->rec.keylen < eb->rec.keylen ? -1 : 1;
+	if (ea->seq != eb->seq)
+		return ea->seq > eb->seq ? -1 : 1;
+	return 0;
+}
+
+static bool same_key(const struct entry *a, const struct entry *b)
+{
+	return a->rec.keylen == b->rec.keylen
+		&& memcmp(a->rec.key, b->rec.key, a->rec.keylen) == 0;
+}
+
+struct leveldb_record *leveldb_read(const tal_t *ctx, const char *dir,
+				    const u8 *prefix, size_t prefixlen)
+{
+	struct leveldb_record *recs;
+	struct reader r;
+	struct manifest m;
+	struct dirent *ent;
+	DIR *d;
+	size_t i, num = 0;
+
+	d = opendir(dir);
+	if (!d)
+		err(1, "Could not open LevelDB directory '%s'", dir);
+
+	recs = tal_arr(ctx, struct leveldb_record, 0);
+	r.prefix = prefix;
+	r.prefixlen = prefixlen;
+	r.entries = tal_arr(recs, struct entry, 0);
+	r.num_entries = 0;
+	r.arena_ctx = recs;
+	r.chunk = NULL;
+
+	/* Obsolete files may linger until LevelDB next cleans up. */
+	read_manifest(&r, recs, dir, &m);
+	for (i = 0; i < m.num_tables; i++) {
+		char *name;
+		u8 *data = grab_table(recs, dir, m.tables[i].number, &name);
+
+		r.name = name;
+		read_table(&r, data, tal_count(data) - 1);
+		tal_free(data);
+		tal_free(name);
+	}
+	tal_free(m.tables);
+
+	while ((ent = readdir(d)) != NULL) {
+		char *number, *name;
+		u64 n;
+		u8 *data;
+
+		if (!tal_strreg(recs, ent->d_name, "^([0-9]+)\\.log$", &number))
+			continue;
+		n = strtoull(number, NULL, 10);
+		tal_free(number);
+		if (n < m.log_number && (!n || n != m.prev_log_number))
+			continue;
+
+		name = path_join(recs, dir, ent->d_name);
+		data = grab_file(recs, name);
+		if (!data)
+			err(1, "Reading %s", name);
+
+		r.name = name;
+		read_log(&r, data, tal_count(data) - 1, read_batch, NULL);
+		tal_free(data);
+		tal_free(name);
+	}
+	closedir(d);
+
+	qsort(r.entries, r.num_entries, sizeof(*r.entries), entry_cmp);
+	tal_resize(&recs, r.num_entries);
+	for (i = 0; i < r.num_entries; i++) {
+		/* Only the newest version of each key counts. */
+		if (i && same_key(&r.entries[i], &r.entries[i-1]))
+			continue;
+		if (r.entries[i].type == TYPE_VALUE)
+			recs[num++] = r.entries[i].rec;
+	}
+	tal_free(r.entries);
+	tal_resize(&recs, num);
+	return recs;
+}
@@ -0,0 +1,50 @@
+/*******************************************************************************
+ *
+ *  = leveldb.h
+ *
+ *  Defines a minimal, read-only reader for LevelDB databases such as
+ *  the block index bitcoind keeps in blocks/index.
+ *
+ *  It follows CURRENT to the MANIFEST, reads the live tables (.ldb/.sst)
+ *  listed there plus the write-ahead logs (.log) not yet compacted into
+ *  them, and keeps the newest version of each key, so the database must
+ *  not be written to while it is being read (stop bitcoind, or read a
+ *  copy).
+ *
+ *  All these functions exit on errors.
+ */
+#ifndef BITCOIN_ITERATE_LEVELDB_H
+#define BITCOIN_ITERATE_LEVELDB_H
+#include <ccan/tal/tal.h>
+#include <ccan/short_types/short_types.h>
+
+/**
+ * leveldb_record - A live key and its value.
+ *
+ * @key: the key
+ * @keylen: length of @key
+ * @value: the value
+ * @valuelen: length of @value
+ */
+struct leveldb_record {
+	const u8 *key;
+	size_t keylen;
+	const u8 *value;
+	size_t valuelen;
+};
+
+/**
+ * leveldb_read - Read the live records of a LevelDB database.
+ *
+ * @ctx: tal context for the result
+ * @dir: the database directory
+ * @prefix: only return keys starting with these bytes
+ * @prefixlen: length of @prefix (0 for all keys)
+ *
+ * Returns a tal array of records sorted by key, holding the newest
+ * value of each key and omitting deleted keys.
+ */
+struct leveldb_record *leveldb_read(const tal_t *ctx, const char *dir,
+				    const u8 *prefix, size_t prefixlen);
+
+#endif /* BITCOIN_ITERATE_LEVELDB_H */
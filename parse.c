@@ -9,6 +9,12 @@
 #include "types.h"
 #include "parse.h"
 #include "space.h"
+#include "sha256.h"
+#include "scan.h"
+#include "threadpool.h"
+
+/* Fewest transactions worth handing to a thread of their own. */
+#define SPLIT_MIN_TXS 64
 
 //
 // == Parsing Data Types == 
@@ -23,9 +29,11 @@ static u64 pull_varint(struct file *f, off_t *poff)
 		p = f->mmap + *poff;
 	else {
 		/* We could do a short read here, that's OK. */
-		if (pread(f->fd, v, sizeof(v), *poff) < 1)
+		ssize_t n = pread(f->fd, v, sizeof(v), *poff);
+		if (n < 1)
 			err(1, "Pulling varint from %s offset %llu\n",
 			    f->name, (long long)*poff);
+		file_unobfuscate(f, v, n, *poff);
 		p = v;
 	}
 
@@ -83,57 +91,90 @@ static void pull_hash(struct file *f, off_t *poff, u8 dst[32])
 // == Parsing Inputs & Outputs == 
 // 
 
+/* Points at (or copies, if the file isn't mapped) the next @len bytes. */
+static const u8 *pull_view(struct space *space, struct file *f, off_t *poff,
+			   varint_t len)
+{
+	u8 *copy;
+
+	if (likely(f->mmap)) {
+		const u8 *view = (const u8 *)f->mmap + *poff;
+		*poff += len;
+		return view;
+	}
+	copy = space_alloc(space, len);
+	pull_bytes(f, poff, copy, len);
+	return copy;
+}
+
+/* Views a script, or skips it if it isn't needed. */
+static const u8 *pull_script(struct space *space, struct file *f, off_t *poff,
+			     varint_t len, unsigned int needs)
+{
+	if (!(needs & PARSE_SCRIPTS)) {
+		*poff += len;
+		return NULL;
+	}
+	return pull_view(space, f, poff, len);
+}
+
 static void read_input(struct transaction *t, struct space *space, struct file *f, off_t *poff,
-		       struct input *input)
+		       struct input *input, unsigned int needs)
 {
 	pull_hash(f, poff, input->txid);
 	input->index = pull_u32(f, poff);
 	input->script_length = pull_varint(f, poff);
-	input->script = space_alloc(space, input->script_length);
+	input->script = pull_script(space, f, poff, input->script_length, needs);
 	input->witness = NULL;
-	pull_bytes(f, poff, input->script, input->script_length);
+	input->num_witness = 0;
 	input->sequence_number = pull_u32(f, poff);
+	input->prevout = NULL;
 }
 
 static void read_output(struct transaction *t, struct space *space, struct file *f, off_t *poff,
-			struct output *output)
+			struct output *output, unsigned int needs)
 {
 	output->amount = pull_u64(f, poff);
 	output->script_length = pull_varint(f, poff);
-	output->script = space_alloc(space, output->script_length);
-	pull_bytes(f, poff, output->script, output->script_length);
+	output->script = pull_script(space, f, poff, output->script_length, needs);
 }
 
 //
 // == Parsing a transaction witness == 
 // 
 
-// FIXME -- this function should attempt to store and/or interpret the
-// witness data
-static void read_witness_stack_item(u8 *witness, size_t i, size_t s, struct file *f, off_t *poff,struct space *space)
+static void read_witness_stack_item(struct witness_item *item, struct file *f, off_t *poff,struct space *space)
 {
-  varint_t num_bytes = pull_varint(f, poff);
-  witness = space_alloc(space, num_bytes);
-  pull_bytes(f, poff, witness, num_bytes);
+  item->length = pull_varint(f, poff);
+  item->data = pull_view(space, f, poff, item->length);
 }
 
-static void read_witness_field(struct input *inp, size_t i, struct file *f, off_t *poff,struct space *space)
+static void read_witness_field(struct input *inp, size_t i, struct file *f, off_t *poff,struct space *space,
+			       unsigned int needs)
 {
   size_t s;
   inp->num_witness = pull_varint(f, poff);
-  if (inp->num_witness == 0) { return; }
-  inp->witness = space_alloc_arr(space, u8 *,
-				   inp->num_witness);
+  if (!(needs & PARSE_WITNESS)) {
+    /* Just walk it to find the end of the transaction. */
+    for (s=0; s<inp->num_witness;s++) {
+      varint_t num_bytes = pull_varint(f, poff);
+      *poff += num_bytes;
+    }
+    return;
+  }
+  inp->witness = space_alloc_arr(space, struct witness_item,
+				 inp->num_witness);
   for (s=0; s<inp->num_witness;s++) {
-    read_witness_stack_item(inp->witness[s], i, s, f, poff, space);
+    read_witness_stack_item(&inp->witness[s], f, poff, space);
   }
 }
 
-static void read_witness(struct transaction *trans, struct file *f, off_t *poff,struct space *space)
+static void read_witness(struct transaction *trans, struct file *f, off_t *poff,struct space *space,
+			 unsigned int needs)
 {
   size_t i;
   for (i=0; i<trans->input_count;i++) {
-    read_witness_field(&trans->input[i], i, f, poff, space);
+    read_witness_field(&trans->input[i], i, f, poff, space, needs);
   }
 }
 
@@ -142,23 +183,132 @@ static void read_witness(struct transaction *trans, struct file *f, off_t *poff,
 // 
 
 /**
- *  Appends contents of file @f between offsets @context_off and @poff
- *  to the given hash @context.
+ *  Adds the contents of file @f between offsets @start and @end to
+ *  the given hash @context.
  *
- *  Sets @context_off to the current position of @poff.
+ *  Reads through a stack buffer rather than allocating, so this is
+ *  safe to call from parsing threads.
+ */
+static void hash_file_range(struct sha256_ctx *context, struct file *f, off_t start, off_t end)
+{
+	if (likely(f->mmap)) {
+		sha256_update(context, f->mmap + start, end - start);
+		return;
+	}
+	while (start < end) {
+		u8 buf[4096];
+		size_t len = sizeof(buf);
+
+		if (end - start < len)
+			len = end - start;
+		file_read(f, start, len, buf);
+		sha256_update(context, buf, len);
+		start += len;
+	}
+}
+
+/**
+ *  Where the pieces of a transaction lie in its file.  The TXID
+ *  covers [start, start + 4) (the version), [body_start, body_end)
+ *  (inputs and outputs) and [lock_start, end) (the lock time); the
+ *  WTXID covers [start, end).
+ */
+struct tx_layout {
+	off_t start, body_start, body_end, lock_start, end;
+};
+
+/**
+ *  Describes the TXID (and WTXID, for segwit transactions) of a
+ *  transaction in a mapped file as messages for sha256d_batch().
+ *  Returns the number of messages.
+ */
+static size_t tx_hash_msgs(struct transaction *trans, const struct file *f,
+			   const struct tx_layout *lay, struct sha256_msg *msgs,
+			   unsigned int needs)
+{
+	size_t n = 0;
+
+	/* A non-segwit transaction's WTXID is its TXID. */
+	if ((needs & PARSE_TXID) || ((needs & PARSE_WTXID) && !trans->segwit)) {
+		msgs[n].seg[0] = f->mmap + lay->start;
+		msgs[n].len[0] = 4;
+		msgs[n].seg[1] = f->mmap + lay->body_start;
+		msgs[n].len[1] = lay->body_end - lay->body_start;
+		msgs[n].seg[2] = f->mmap + lay->lock_start;
+		msgs[n].len[2] = lay->end - lay->lock_start;
+		msgs[n].out = trans->txid;
+		n++;
+	}
+	if ((needs & PARSE_WTXID) && trans->segwit) {
+		memset(&msgs[n], 0, sizeof(msgs[n]));
+		msgs[n].seg[0] = f->mmap + lay->start;
+		msgs[n].len[0] = lay->end - lay->start;
+		msgs[n].out = trans->wtxid;
+		n++;
+	}
+	return n;
+}
+
+/**
+ *  Calculates the TXID and WTXID of a transaction.
  *
+ *  A file which isn't mapped is read once, with each piece added to
+ *  both hashes as it goes.
  */
-void append_to_hash_context(SHA256_CTX *context, off_t *context_off, struct file *f, off_t *poff)
+static void hash_transaction(struct transaction *trans, struct file *f,
+			     const struct tx_layout *lay, unsigned int needs)
 {
-	  if (likely(f->mmap)) {
-	    SHA256_Update(context, f->mmap + *context_off, *poff - *context_off);
-	  } else {
-	    u8 *buf = tal_arr(NULL, u8, *poff - *context_off);
-	    file_read(f, *context_off, *poff - *context_off, buf);
-	    SHA256_Update(context, buf, *poff - *context_off);
-	    tal_free(buf);
-	  }
-	  *context_off = *poff;
+	const off_t txid_ranges[3][2] = {
+		{ lay->start, lay->start + 4 },
+		{ lay->body_start, lay->body_end },
+		{ lay->lock_start, lay->end }
+	};
+	struct sha256_ctx txid, wtxid;
+	bool want_wtxid = (needs & PARSE_WTXID) && trans->segwit;
+	bool want_txid = (needs & PARSE_TXID) || ((needs & PARSE_WTXID)
+						   && !trans->segwit);
+	off_t off;
+
+	if (likely(f->mmap)) {
+		struct sha256_msg msgs[2];
+
+		sha256d_batch(msgs, tx_hash_msgs(trans, f, lay, msgs, needs));
+		goto done;
+	}
+	if (!want_txid && !want_wtxid)
+		return;
+
+	sha256_init(&txid);
+	sha256_init(&wtxid);
+	for (off = lay->start; off < lay->end; ) {
+		u8 buf[4096];
+		size_t i, len = sizeof(buf);
+
+		if (lay->end - off < len)
+			len = lay->end - off;
+		file_read(f, off, len, buf);
+		if (want_wtxid)
+			sha256_update(&wtxid, buf, len);
+		for (i = 0; i < 3 && want_txid; i++) {
+			off_t from = txid_ranges[i][0], to = txid_ranges[i][1];
+
+			if (from < off)
+				from = off;
+			if (to > off + (off_t)len)
+				to = off + len;
+			if (from < to)
+				sha256_update(&txid, buf + (from - off), to - from);
+		}
+		off += len;
+	}
+	if (want_txid)
+		sha256_double(&txid, trans->txid);
+	if (want_wtxid)
+		sha256_double(&wtxid, trans->wtxid);
+
+done:
+	if (!trans->segwit && (needs & PARSE_WTXID))
+		memcpy(trans->wtxid, trans->txid, sizeof(trans->txid));
 }
 
 /**
@@ -203,41 +353,23 @@ void append_to_hash_context(SHA256_CTX *context, off_t *context_off, struct file
  *    - https://github.com/bitcoin/bips/blob/master/bip-0141.mediawiki
  *
  */
-void read_transaction(struct space *space,
-		      struct transaction *trans,
-		      struct file *f, off_t *poff)
+static void parse_transaction(struct space *space,
+			      struct transaction *trans,
+			      struct file *f, off_t *poff,
+			      struct tx_layout *lay, unsigned int needs)
 {
 	size_t i;
 
-	// Initialize a SHA256 hash context
-	SHA256_CTX context;
-	SHA256_Init(&context);
-
 	// Track where the transaction started so we can use this
 	// position later to calculate the total length on disk.
-	off_t start = *poff;
-
-	// Track the position to start adding to the hash context
-	// from.  This separate offset is used to skip over segregated
-	// witness data so the "original serialization" can be used to
-	// calculate the TXID.
-	off_t context_off  = *poff;
-
-	// Track the size of the "non-segwit" or "original"
-	// serialization.  This separate counter is used to exclude
-	// segregated witness data.  The non-segwit serialization
-	// length and the actual serialization length are required to
-	// calculate the virtual length/weight of the transaction.
-	trans->non_swlen = 0;
+	lay->start = *poff;
 
 	//
-	// == Now start incrementally processing & hashing transaction fields ==
+	// == Now start incrementally processing transaction fields ==
 	// 
 
 	// 1. Version
 	trans->version = pull_u32(f, poff);
-	trans->non_swlen += (*poff - context_off);
-	append_to_hash_context(&context, &context_off, f, poff);
 
 	// 2. One of
 	//
@@ -252,10 +384,10 @@ void read_transaction(struct space *space,
 	  if (pull_varint(f, poff) !=1 ) {
 	    errx(1, "Unexpected flag value found while parsing segwit transaction\n");
 	  };
-	  // Update the hash context to just before the transaction
-	  // input count, as it would have been for a transaction in
-	  // the non-segwit serialization.
-	  context_off = *poff;
+	  // The TXID skips the marker and flag, resuming just before
+	  // the transaction input count, as it would have been for a
+	  // transaction in the non-segwit serialization.
+	  lay->body_start = *poff;
 	  // And now pull the transaction input count itself, leaving
 	  // the file pointer poff in the same (relative) position it
 	  // would have had at this point for a transaction in the
@@ -265,89 +397,118 @@ void read_transaction(struct space *space,
 	} else {
 	  // Mark the transaction as *not* segwit.
 	  trans->segwit = 0;
+	  lay->body_start = lay->start + 4;
 	}
 
 	// 3. Inputs
 	trans->input = space_alloc_arr(space, struct input, trans->input_count);
 	for (i = 0; i < trans->input_count; i++) {
-	  read_input(trans, space, f, poff, trans->input + i);
+	  read_input(trans, space, f, poff, trans->input + i, needs);
 	}
 
 	// 4. Output count & outputs
 	trans->output_count = pull_varint(f, poff);
 	trans->output = space_alloc_arr(space, struct output, trans->output_count);
 	for (i = 0; i < trans->output_count; i++) {
-	  read_output(trans, space, f, poff, trans->output + i);
+	  read_output(trans, space, f, poff, trans->output + i, needs);
 	}
-	trans->non_swlen += (*poff - context_off);
-	append_to_hash_context(&context, &context_off, f, poff);
+	lay->body_end = *poff;
 	
 	// 5. witness [only segwit serialization]
 	if (trans->segwit == 1) {
-	  read_witness(trans, f, poff, space);
-	  // Update the hash context to just before the lock time, as
-	  // it would have been for a transaction in the non-segwit
-	  // serialization.
-	  context_off = *poff;
+	  read_witness(trans, f, poff, space, needs);
 	}
 
-	// 6. Lock time
+	// 6. Lock time: the TXID resumes here, skipping any witness.
+	lay->lock_start = *poff;
 	trans->lock_time = pull_u32(f, poff);
-	trans->non_swlen += (*poff - context_off);
-	append_to_hash_context(&context, &context_off, f, poff);
+	lay->end = *poff;
 
 	// == Now calculate properties which depend upon serialization ==
 
 	// Length -- the total length is just the number of bytes of
 	// the serialization, regardless of whether it was non-segwit
 	// or segwit.
-	trans->total_len = *poff - start;
+	trans->total_len = lay->end - lay->start;
+
+	// The size of the "non-segwit" or "original" serialization
+	// excludes segregated witness data.  The non-segwit
+	// serialization length and the actual serialization length
+	// are required to calculate the virtual length/weight of the
+	// transaction.
+	trans->non_swlen = 4 + (lay->body_end - lay->body_start)
+		+ (lay->end - lay->lock_start);
+}
 
-	// TXID
-	// 
-	// Store single hash
-	SHA256_Final(trans->txid, &context);
-	// Now create double hash
-	SHA256_Init(&context);
-	SHA256_Update(&context, trans->txid, sizeof(trans->txid));
-	SHA256_Final(trans->txid, &context);
-	
-	// WTXID
-	//
-	if (trans->segwit == 1) {
-	  // Re-initialize the context and set the context offset to the
-	  // start of the transaction so we can capture the full
-	  // serialization.
-	  SHA256_Init(&context);
-	  context_off = start;
-	  // This function will needlessly and incorrectly modify
-	  // context_off but we're done with it at this point, so
-	  // that's actually OK...
-	  append_to_hash_context(&context, &context_off, f, poff);
-	  // Store single hash
-	  SHA256_Final(trans->wtxid, &context);
-	  // Now create double hash
-	  SHA256_Init(&context);
-	  SHA256_Update(&context, trans->wtxid, sizeof(trans->wtxid));
-	  SHA256_Final(trans->wtxid, &context);
-	} else {
-          memcpy(trans->wtxid, trans->txid, sizeof(trans->txid));
+static void read_transaction_needs(struct space *space,
+				   struct transaction *trans,
+				   struct file *f, off_t *poff,
+				   unsigned int needs)
+{
+	struct tx_layout lay;
+
+	parse_transaction(space, trans, f, poff, &lay, needs);
+	hash_transaction(trans, f, &lay, needs);
+}
+
+void read_transaction(struct space *space,
+		      struct transaction *trans,
+		      struct file *f, off_t *poff)
+{
+	read_transaction_needs(space, trans, f, poff, PARSE_ALL);
+}
+
+/* Parses transactions in a mapped file, then hashes them all together. */
+static void read_mapped_transactions(struct space *space,
+				     struct transaction *tx, size_t n,
+				     struct file *f, off_t *poff,
+				     unsigned int needs)
+{
+	struct tx_layout *lay;
+	struct sha256_msg *msgs;
+	size_t i, num_msgs = 0;
+
+	/* They only last until the block is done, like the rest of it. */
+	lay = space_alloc_arr(space, struct tx_layout, n);
+	msgs = space_alloc_arr(space, struct sha256_msg, 2 * n);
+	for (i = 0; i < n; i++) {
+		parse_transaction(space, &tx[i], f, poff, &lay[i], needs);
+		num_msgs += tx_hash_msgs(&tx[i], f, &lay[i], msgs + num_msgs,
+					 needs);
+	}
+	sha256d_batch(msgs, num_msgs);
+	for (i = 0; i < n && (needs & PARSE_WTXID); i++) {
+		if (!tx[i].segwit)
+			memcpy(tx[i].wtxid, tx[i].txid, sizeof(tx[i].txid));
 	}
 }
 
-/* Inefficient, but blk*.dat can have zero(?) padding. */
-bool next_block_header_prefix(struct file *f, off_t *off, const u32 marker)
+/* blk*.dat can have zero padding (and corruption) between blocks. */
+bool next_block_header_prefix(struct file *f, off_t *off, const u32 marker,
+			      u64 *padding)
 {
-	while (*off + sizeof(u32) <= f->len) {
-		u32 val;
+	u8 buf[65536];
 
-		/* Inefficent, but don't expect it to be far. */
-		val = pull_u32(f, off);
-		*off -= 4;
+	if (likely(f->mmap)) {
+		if (*off + sizeof(u32) > f->len)
+			return false;
+		*off += scan_marker(f->mmap + *off, f->len - *off, marker, padding);
+		return *off + sizeof(u32) <= f->len;
+	}
 
-		if (val == marker)
+	/* Scan a buffer at a time; a marker may straddle two of them. */
+	while (*off + sizeof(u32) <= f->len) {
+		size_t len = sizeof(buf), n;
+
+		if (f->len - *off < len)
+			len = f->len - *off;
+		file_read(f, *off, len, buf);
+		n = scan_marker(buf, len, marker, padding);
+		*off += n;
+		if (n + sizeof(u32) <= len)
 			return true;
-		(*off)++;
+		if (len < sizeof(buf))
+			break;
 	}
 	return false;
 }
@@ -357,7 +518,7 @@ bool read_block_header(struct block_header *bh,
 			  u8 block_md[SHA256_DIGEST_LENGTH],
 			  const u32 marker)
 {
-	SHA256_CTX sha256;
+	struct sha256_ctx sha256;
 	off_t start;
 
 	bh->D9B4BEF9 = pull_u32(f, off);
@@ -374,20 +535,9 @@ bool read_block_header(struct block_header *bh,
 	bh->nonce = pull_u32(f, off);
 
 	/* Bitcoin uses double sha (it's not quite known why...) */
-	SHA256_Init(&sha256);
-	if (likely(f->mmap)) {
-		SHA256_Update(&sha256, f->mmap + start, *off - start);
-	} else {
-		u8 *buf = tal_arr(NULL, u8, *off - start);
-		file_read(f, start, *off - start, buf);
-		SHA256_Update(&sha256, buf, *off - start);
-		tal_free(buf);
-	}
-	SHA256_Final(block_md, &sha256);
-
-	SHA256_Init(&sha256);
-	SHA256_Update(&sha256, block_md, SHA256_DIGEST_LENGTH);
-	SHA256_Final(block_md, &sha256);
+	sha256_init(&sha256);
+	hash_file_range(&sha256, f, start, *off);
+	sha256_double(&sha256, block_md);
 
 	bh->transaction_count = pull_varint(f, off);
 
@@ -400,3 +550,125 @@ void skip_transactions(const struct block_header *bh,
 {
 	*off = block_start + 8 + bh->len;
 }
+
+void read_transactions(struct space *space,
+		       struct transaction *tx, size_t n,
+		       struct file *f, off_t *poff,
+		       unsigned int needs)
+{
+	size_t i;
+
+	if (!f->mmap) {
+		for (i = 0; i < n; i++)
+			read_transaction_needs(space, &tx[i], f, poff, needs);
+		return;
+	}
+	read_mapped_transactions(space, tx, n, f, poff, needs);
+}
+
+/* Moves *poff past a transaction, decoding only what gives its length. */
+static void skip_transaction(struct file *f, off_t *poff)
+{
+	varint_t i, j, num_inputs, num_outputs, num_items, len;
+	bool segwit;
+
+	*poff += 4;
+	num_inputs = pull_varint(f, poff);
+	segwit = (num_inputs == 0);
+	if (segwit) {
+		pull_varint(f, poff);
+		num_inputs = pull_varint(f, poff);
+	}
+	for (i = 0; i < num_inputs; i++) {
+		*poff += 32 + 4;
+		len = pull_varint(f, poff);
+		*poff += len + 4;
+	}
+	num_outputs = pull_varint(f, poff);
+	for (i = 0; i < num_outputs; i++) {
+		*poff += 8;
+		len = pull_varint(f, poff);
+		*poff += len;
+	}
+	for (i = 0; segwit && i < num_inputs; i++) {
+		num_items = pull_varint(f, poff);
+		for (j = 0; j < num_items; j++) {
+			len = pull_varint(f, poff);
+			*poff += len;
+		}
+	}
+	*poff += 4;
+}
+
+/**
+ * split_batch - A block's transactions, divided into runs for threads.
+ *
+ * @tx: the transactions
+ * @starts: offset of each transaction, and of the end of the last
+ * @first: index of the first transaction of each run, and @n at the end
+ * @spaces: space for each run
+ * @f: the (mapped) file
+ * @needs: PARSE_* flags
+ */
+struct split_batch {
+	struct transaction *tx;
+	off_t *starts;
+	size_t *first;
+	struct space *spaces;
+	struct file *f;
+	unsigned int needs;
+};
+
+static void read_split(void *arg, size_t task)
+{
+	struct split_batch *batch = arg;
+	size_t first = batch->first[task], n = batch->first[task+1] - first;
+	off_t off = batch->starts[first];
+
+	if (n)
+		read_mapped_transactions(&batch->spaces[task], batch->tx + first,
+					 n, batch->f, &off, batch->needs);
+}
+
+void read_transactions_split(struct thread_pool *pool, struct space *spaces,
+			     struct transaction *tx, size_t n,
+			     struct file *f, off_t *poff,
+			     unsigned int needs)
+{
+	struct split_batch batch;
+	size_t i, task, ntasks = thread_pool_size(pool);
+	off_t per_task;
+
+	if (ntasks > n / SPLIT_MIN_TXS)
+		ntasks = n / SPLIT_MIN_TXS;
+	if (ntasks < 2 || !f->mmap) {
+		read_transactions(&spaces[0], tx, n, f, poff, needs);
+		return;
+	}
+
+	/* Allocated before the first run starts using spaces[0]. */
+	batch.starts = space_alloc_arr(&spaces[0], off_t, n + 1);
+	batch.first = space_alloc_arr(&spaces[0], size_t, ntasks + 1);
+	for (i = 0; i < n; i++) {
+		batch.starts[i] = *poff;
+		skip_transaction(f, poff);
+	}
+	batch.starts[n] = *poff;
+
+	/* Give each thread about the same number of bytes to parse. */
+	per_task = (batch.starts[n] - batch.starts[0] + ntasks - 1) / ntasks;
+	batch.first[0] = 0;
+	for (i = 0, task = 1; task < ntasks; task++) {
+		off_t end = batch.starts[0] + per_task * task;
+		while (i < n && batch.starts[i] < end)
+			i++;
+		batch.first[task] = i;
+	}
+	batch.first[ntasks] = n;
+
+	batch.tx = tx;
+	batch.spaces = spaces;
+	batch.f = f;
+	batch.needs = needs;
+	thread_pool_run(pool, ntasks, read_split, &batch);
+}
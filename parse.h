@@ -12,6 +12,18 @@
 #include "types.h"
 #include "io.h"
 #include "space.h"
+#include "threadpool.h"
+
+/* Which parts of transactions read_transactions() must fill in. */
+/* Input and output scripts (else script is NULL: only the length is set). */
+#define PARSE_SCRIPTS	0x1
+/* The txid. */
+#define PARSE_TXID	0x2
+/* The wtxid. */
+#define PARSE_WTXID	0x4
+/* Input witness stacks (else witness is NULL: only num_witness is set). */
+#define PARSE_WITNESS	0x8
+#define PARSE_ALL	(PARSE_SCRIPTS | PARSE_TXID | PARSE_WTXID | PARSE_WITNESS)
 
 /**
  * next_block_header_prefix - Fast-forward *off to head of next block,
@@ -20,12 +32,14 @@
  * @f: current file
  * @off: current file offset
  * @marker: marker for block header
+ * @padding: incremented by the number of zero (padding) bytes skipped
  *
  * This is the first step in iterating over the blockchain as it
  * allows scanning to the beginning of the block you want to iterate
  * from.
  */
-bool next_block_header_prefix(struct file *f, off_t *off, const u32 marker);
+bool next_block_header_prefix(struct file *f, off_t *off, const u32 marker,
+			      u64 *padding);
 
 /**
  * read_block_header - Reads the block header from disk into
@@ -71,8 +85,55 @@ void skip_transactions(const struct block_header *bh,
  *  This is the fourth step in iterating over the blockchain as, once
  *  the first block has been reached, this allows iterating over all
  *  subsequent transactions.
+ *
+ *  If @f is memory-mapped, scripts and witness items are not copied:
+ *  they point into the mapping, so @f must stay open while *t is used.
+ *  Otherwise they are copied into @space.
  */
 void read_transaction(struct space *space,
 				struct transaction *t,
 				struct file *f, off_t *off);
+
+/**
+ * read_transactions - Reads consecutive transactions from disk.
+ *
+ * @space: space used for allocation
+ * @tx: array of transaction data structures to populate
+ * @n: number of transactions to read
+ * @f: current file
+ * @off: current file offset
+ * @needs: PARSE_* flags for the parts which are needed
+ *
+ *  Like calling read_transaction() @n times, except that a mapped
+ *  file's transactions are all parsed first, then their TXIDs and
+ *  WTXIDs are hashed together (several at once if the CPU allows).
+ *  Parts not in @needs are skipped, and left unset.
+ */
+void read_transactions(struct space *space,
+		       struct transaction *tx, size_t n,
+		       struct file *f, off_t *off,
+		       unsigned int needs);
+
+/**
+ * read_transactions_split - Reads a block's transactions on threads.
+ *
+ * @pool: thread pool to parse on
+ * @spaces: space used for allocation, one for each of @pool's threads
+ * @tx: array of transaction data structures to populate
+ * @n: number of transactions to read
+ * @f: current file
+ * @off: current file offset
+ * @needs: PARSE_* flags for the parts which are needed
+ *
+ *  Like read_transactions(), but for a mapped file, a quick pass first
+ *  finds where each transaction starts, then runs of transactions with
+ *  about the same number of bytes are parsed and hashed on each
+ *  thread.  This cuts the time taken to read a large block, rather
+ *  than reading more blocks at once.  Small blocks are read on the
+ *  calling thread, into @spaces[0].
+ */
+void read_transactions_split(struct thread_pool *pool, struct space *spaces,
+			     struct transaction *tx, size_t n,
+			     struct file *f, off_t *off,
+			     unsigned int needs);
 #endif /* BITCOIN_PARSE_PARSE_H */
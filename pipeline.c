@@ -0,0 +1,251 @@
+#include <pthread.h>
+#include <ccan/err/err.h>
+#include <ccan/tal/tal.h>
+#include "pipeline.h"
+#include "parse.h"
+#include "blockfiles.h"
+#include "space.h"
+#include "io.h"
+#include "utils.h"
+
+/* How many blocks each worker may run ahead of the consumer. */
+#define SLOTS_PER_THREAD 2
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_BUSY,
+	SLOT_READY
+};
+
+/**
+ * slot - One parsed (or being parsed) block.
+ *
+ * @state: who owns the slot at the moment
+ * @seq: sequence number of the block allowed to fill (or filling) this slot
+ * @b: the block parsed into this slot
+ * @tx: the block's transactions, allocated from @space
+ * @space: private allocation space for this slot, reused for each block
+ * @f: the block's file (held from the block file pool), which @tx
+ *     may point into, or NULL
+ * @filenum: which block file @f is
+ * @buf: the block's transactions, if @f isn't mapped
+ *
+ * Each slot holds its block's file, so it stays mapped until the
+ * consumer is done with the slot.  Workers never share tal contexts
+ * with each other or with the consumer.
+ */
+struct slot {
+	enum slot_state state;
+	size_t seq;
+	const struct block *b;
+	struct transaction *tx;
+	struct space space;
+	struct file *f;
+	unsigned int filenum;
+	struct block_buffer buf;
+};
+
+/* A parsing thread. */
+struct worker {
+	struct pipeline *p;
+	pthread_t thread;
+};
+
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+
+	/* Blocks to hand out, and the sequence number of the next. */
+	struct block **blocks;
+	size_t num_blocks;
+	size_t next_seq;
+
+	/* Sequence number the consumer will ask for next. */
+	size_t consumed;
+
+	struct slot *slots;
+	size_t nslots;
+	struct worker *workers;
+	size_t nworkers;
+
+	struct block_file_pool *files;
+	unsigned int needs;
+};
+
+static struct file *slot_file(struct pipeline *p, struct slot *s,
+			      unsigned int filenum)
+{
+	if (s->f && s->filenum == filenum)
+		return s->f;
+
+	if (s->f)
+		block_file_put(p->files, s->f);
+	s->f = block_file_get(p->files, filenum);
+	s->filenum = filenum;
+	return s->f;
+}
+
+static void parse_block(struct worker *w, struct slot *s, const struct block *b,
+			const struct block *next)
+{
+	struct file *bf = slot_file(w->p, s, b->filenum), *f;
+	off_t off;
+
+	f = block_transactions(&s->buf, bf, b, &off);
+	/* The next block this worker is likely to get, if it's in the
+	 * same file, can be read while we parse this one. */
+	if (next && next->filenum == b->filenum)
+		block_readahead(bf, next);
+
+	space_reset(&s->space);
+	s->tx = space_alloc_arr(&s->space, struct transaction,
+				b->bh.transaction_count);
+	read_transactions(&s->space, s->tx, b->bh.transaction_count, f, &off,
+			  w->p->needs);
+	s->b = b;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct pipeline *p = w->p;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->stop && p->next_seq < p->num_blocks) {
+		size_t seq = p->next_seq++;
+		struct block *b = p->blocks[seq];
+		size_t ahead = seq + p->nslots / SLOTS_PER_THREAD;
+		struct block *next = ahead < p->num_blocks ? p->blocks[ahead] : NULL;
+		struct slot *s = &p->slots[seq % p->nslots];
+
+		/* Wait for the consumer to finish with this slot's last block. */
+		while (!p->stop && (s->state != SLOT_FREE || s->seq != seq))
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (p->stop)
+			break;
+
+		s->state = SLOT_BUSY;
+		pthread_mutex_unlock(&p->lock);
+
+		parse_block(w, s, b, next);
+
+		pthread_mutex_lock(&p->lock);
+		s->state = SLOT_READY;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void destroy_pipeline(struct pipeline *p)
+{
+	size_t i;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->nworkers; i++)
+		pthread_join(p->workers[i].thread, NULL);
+	for (i = 0; i < p->nslots; i++) {
+		if (p->slots[i].f)
+			block_file_put(p->files, p->slots[i].f);
+		block_buffer_free(&p->slots[i].buf);
+		space_free(&p->slots[i].space);
+	}
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+}
+
+struct pipeline *pipeline_new(const tal_t *ctx, unsigned int nthreads,
+			      struct block **blocks, size_t num_blocks,
+			      struct block_file_pool *files,
+			      unsigned int needs)
+{
+	struct pipeline *p = tal(ctx, struct pipeline);
+	size_t i;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->stop = false;
+	p->blocks = blocks;
+	p->num_blocks = num_blocks;
+	p->next_seq = 0;
+	p->consumed = 0;
+	p->files = files;
+	p->needs = needs;
+
+	p->nslots = (size_t)nthreads * SLOTS_PER_THREAD;
+	p->slots = tal_arr(p, struct slot, p->nslots);
+	for (i = 0; i < p->nslots; i++) {
+		p->slots[i].state = SLOT_FREE;
+		p->slots[i].seq = i;
+		p->slots[i].b = NULL;
+		p->slots[i].tx = NULL;
+		space_init(&p->slots[i].space);
+		p->slots[i].f = NULL;
+		block_buffer_init(&p->slots[i].buf);
+	}
+
+	/* Workers are created last: the destructor joins whatever started. */
+	p->workers = tal_arr(p, struct worker, nthreads);
+	p->nworkers = 0;
+	tal_add_destructor(p, destroy_pipeline);
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &p->workers[i];
+
+		w->p = p;
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+			err(1, "Creating pipeline thread %zu", i);
+		p->nworkers++;
+	}
+	return p;
+}
+
+struct transaction *pipeline_next(struct pipeline *p, const struct block *b)
+{
+	struct slot *s;
+
+	pthread_mutex_lock(&p->lock);
+
+	/* Caller is done with the previous block: hand its slot back. */
+	if (p->consumed) {
+		struct slot *prev = &p->slots[(p->consumed - 1) % p->nslots];
+		block_file_done(p->files, prev->b);
+		prev->state = SLOT_FREE;
+		prev->seq += p->nslots;
+		pthread_cond_broadcast(&p->cond);
+	}
+
+	s = &p->slots[p->consumed % p->nslots];
+	while (s->state != SLOT_READY || s->seq != p->consumed) {
+		if (p->consumed >= p->num_blocks)
+			errx(1, "Pipeline ran out of blocks before "SHA_FMT,
+			     SHA_VALS(b->id));
+		pthread_cond_wait(&p->cond, &p->lock);
+	}
+	p->consumed++;
+	pthread_mutex_unlock(&p->lock);
+
+	if (s->b != b)
+		errx(1, "Pipeline parsed "SHA_FMT" but expected "SHA_FMT,
+		     SHA_VALS(s->b->id), SHA_VALS(b->id));
+	return s->tx;
+}
+
+size_t pipeline_space_high_water(struct pipeline *p)
+{
+	size_t i, max = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < p->nslots; i++) {
+		size_t hw = space_high_water(&p->slots[i].space);
+		if (hw > max)
+			max = hw;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return max;
+}
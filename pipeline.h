@@ -0,0 +1,62 @@
+/*******************************************************************************
+ *
+ *  = pipeline.h
+ *
+ *  Defines a pipeline which parses blocks ahead of the iterator on
+ *  worker threads.
+ *
+ *  Workers claim blocks in chain order, each parsing (and hashing)
+ *  every transaction of its block into a slot with its own `struct
+ *  space`.  The single consumer (the iterator) collects the slots
+ *  strictly in chain order, so callbacks and UTXO updates happen in
+ *  the same sequence as a serial run.
+ *
+ */
+#ifndef BITCOIN_ITERATE_PIPELINE_H
+#define BITCOIN_ITERATE_PIPELINE_H
+#include <ccan/tal/tal.h>
+#include "types.h"
+#include "blockfiles.h"
+
+struct pipeline;
+
+/**
+ * pipeline_new - Start worker threads parsing @blocks.
+ *
+ * @ctx: tal context; freeing the pipeline stops and joins its workers
+ * @nthreads: number of worker threads (must be non-zero)
+ * @blocks: the blocks to parse, in chain order
+ * @num_blocks: the number of @blocks
+ * @files: pool to open block files from (which must outlive the pipeline)
+ * @needs: PARSE_* flags for read_transactions()
+ *
+ * @blocks must not change while the pipeline exists.
+ */
+struct pipeline *pipeline_new(const tal_t *ctx, unsigned int nthreads,
+			      struct block **blocks, size_t num_blocks,
+			      struct block_file_pool *files,
+			      unsigned int needs);
+
+/**
+ * pipeline_next - Wait for the transactions of the next block.
+ *
+ * @p: the pipeline
+ * @b: the block expected next (used as a sanity check)
+ *
+ * Returns an array of b->bh.transaction_count parsed transactions.
+ * The array stays valid until the following call to pipeline_next()
+ * or until @p is freed.
+ */
+struct transaction *pipeline_next(struct pipeline *p, const struct block *b);
+
+/**
+ * pipeline_space_high_water - The most space parsing one block took.
+ *
+ * @p: the pipeline
+ *
+ * Only valid once every block has been collected with pipeline_next(),
+ * as workers don't lock their slots while parsing.
+ */
+size_t pipeline_space_high_water(struct pipeline *p);
+
+#endif /* BITCOIN_ITERATE_PIPELINE_H */
@@ -0,0 +1,336 @@
+#include <ccan/err/err.h>
+#include <ccan/tal/tal.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "prefetch.h"
+#include "blockfiles.h"
+
+/* Most block files kept open for prefetching at once. */
+#define PREFETCH_FILES 16
+/* Most reads in flight (io_uring rings can't be much bigger). */
+#define PREFETCH_MAX_AHEAD 4096
+
+/**
+ * prefetch_file - An open block file.
+ *
+ * @fd: file descriptor (-1 if this entry is unused)
+ * @filenum: which block file it is
+ * @inflight: reads of it which haven't finished
+ * @used: when it was last used (counts submissions)
+ */
+struct prefetch_file {
+	int fd;
+	unsigned int filenum;
+	size_t inflight;
+	u64 used;
+};
+
+/**
+ * ring - The parts of an io_uring we use, as mapped from the kernel.
+ */
+struct ring {
+	int fd;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* SQEs filled in but not yet submitted. */
+	unsigned pending;
+};
+
+struct prefetch {
+	struct block **blocks;
+	size_t num_blocks;
+	char **block_fnames;
+	size_t ahead;
+
+	/* Next block to read, and whether each block has been read. */
+	size_t next;
+	bool *done;
+	size_t inflight;
+
+	struct prefetch_file files[PREFETCH_FILES];
+	u64 uses;
+
+	/* No ring (fd -1) means we fall back to posix_fadvise(). */
+	struct ring ring;
+	/* io_uring reads land here; nobody looks at the contents. */
+	u8 *discard;
+
+	/* Statistics. */
+	size_t blocks_read, late;
+	u64 bytes_read;
+	struct timespec start, end;
+};
+
+static double seconds_between(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static bool ring_init(struct ring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return false;
+
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = 0;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ|PROT_WRITE,
+			    MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		err(1, "Mapping io_uring submission queue");
+	if (ring->cq_size) {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ|PROT_WRITE,
+				    MAP_SHARED|MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			err(1, "Mapping io_uring completion queue");
+	} else
+		ring->cq_ptr = ring->sq_ptr;
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		err(1, "Mapping io_uring entries");
+
+	ring->sq_tail = ring->sq_ptr + params.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + params.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + params.sq_off.array;
+	ring->cq_head = ring->cq_ptr + params.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + params.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + params.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + params.cq_off.cqes;
+	ring->pending = 0;
+	return true;
+}
+
+static void ring_free(struct ring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_size)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+static int ring_enter(struct ring *ring, unsigned int min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->pending,
+			      min_complete,
+			      min_complete ? IORING_ENTER_GETEVENTS : 0,
+			      NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		err(1, "Submitting block prefetch reads");
+	ring->pending -= ret;
+	return ret;
+}
+
+static struct prefetch_file *find_file(struct prefetch *pf, unsigned int filenum)
+{
+	size_t i;
+
+	for (i = 0; i < PREFETCH_FILES; i++) {
+		if (pf->files[i].fd >= 0 && pf->files[i].filenum == filenum)
+			return &pf->files[i];
+	}
+	return NULL;
+}
+
+/* Collects finished reads; waits for at least @wait of them. */
+static void reap(struct prefetch *pf, unsigned int wait)
+{
+	struct ring *ring = &pf->ring;
+	unsigned head;
+
+	if (wait || ring->pending)
+		ring_enter(ring, wait);
+
+	head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		size_t n = cqe->user_data;
+
+		/* A failed read is only a missed hint: the real one will
+		 * report the error. */
+		if (cqe->res > 0)
+			pf->bytes_read += cqe->res;
+		pf->done[n] = true;
+		pf->blocks_read++;
+		pf->inflight--;
+		find_file(pf, pf->blocks[n]->filenum)->inflight--;
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	clock_gettime(CLOCK_MONOTONIC, &pf->end);
+}
+
+/* Opens a block file, closing the least recently used idle one. */
+static struct prefetch_file *get_file(struct prefetch *pf, unsigned int filenum)
+{
+	struct prefetch_file *f = find_file(pf, filenum);
+	size_t i;
+
+	while (!f) {
+		for (i = 0; i < PREFETCH_FILES; i++) {
+			if (pf->files[i].fd < 0) {
+				f = &pf->files[i];
+				break;
+			}
+			if (!pf->files[i].inflight
+			    && (!f || pf->files[i].used < f->used))
+				f = &pf->files[i];
+		}
+		/* All busy: wait for a read to finish. */
+		if (!f) {
+			reap(pf, 1);
+			continue;
+		}
+		if (f->fd >= 0)
+			close(f->fd);
+		f->fd = open(pf->block_fnames[filenum], O_RDONLY);
+		if (f->fd < 0)
+			err(1, "Opening %s", pf->block_fnames[filenum]);
+		f->filenum = filenum;
+		f->inflight = 0;
+	}
+	f->used = ++pf->uses;
+	return f;
+}
+
+static void start_read(struct prefetch *pf, size_t n)
+{
+	const struct block *b = pf->blocks[n];
+	struct prefetch_file *f = get_file(pf, b->filenum);
+	struct ring *ring = &pf->ring;
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	if (ring->fd < 0) {
+		posix_fadvise(f->fd, b->pos, block_tx_len(b), POSIX_FADV_WILLNEED);
+		pf->done[n] = true;
+		pf->blocks_read++;
+		pf->bytes_read += block_tx_len(b);
+		return;
+	}
+
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = f->fd;
+	sqe->off = b->pos;
+	sqe->addr = (unsigned long)pf->discard;
+	sqe->len = block_tx_len(b);
+	sqe->user_data = n;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+	f->inflight++;
+	pf->inflight++;
+}
+
+static void destroy_prefetch(struct prefetch *pf)
+{
+	size_t i;
+
+	/* Reads still in flight would land in freed memory. */
+	if (pf->ring.fd >= 0) {
+		while (pf->inflight)
+			reap(pf, 1);
+		ring_free(&pf->ring);
+	}
+	for (i = 0; i < PREFETCH_FILES; i++) {
+		if (pf->files[i].fd >= 0)
+			close(pf->files[i].fd);
+	}
+}
+
+struct prefetch *prefetch_new(const tal_t *ctx,
+			      struct block **blocks, size_t num_blocks,
+			      char **block_fnames, unsigned int ahead)
+{
+	struct prefetch *pf = tal(ctx, struct prefetch);
+	size_t i, max_len = 0;
+
+	pf->blocks = blocks;
+	pf->num_blocks = num_blocks;
+	pf->block_fnames = block_fnames;
+	pf->ahead = ahead < PREFETCH_MAX_AHEAD ? ahead : PREFETCH_MAX_AHEAD;
+	pf->next = 0;
+	pf->done = tal_arrz(pf, bool, num_blocks);
+	pf->inflight = 0;
+	for (i = 0; i < PREFETCH_FILES; i++)
+		pf->files[i].fd = -1;
+	pf->uses = 0;
+	pf->blocks_read = pf->late = 0;
+	pf->bytes_read = 0;
+	clock_gettime(CLOCK_MONOTONIC, &pf->start);
+	pf->end = pf->start;
+
+	if (ring_init(&pf->ring, pf->ahead)) {
+		for (i = 0; i < num_blocks; i++) {
+			if (block_tx_len(blocks[i]) > max_len)
+				max_len = block_tx_len(blocks[i]);
+		}
+		pf->discard = tal_arr(pf, u8, max_len);
+	} else
+		pf->discard = NULL;
+	tal_add_destructor(pf, destroy_prefetch);
+	return pf;
+}
+
+void prefetch_advance(struct prefetch *pf, size_t n)
+{
+	if (pf->ring.fd >= 0)
+		reap(pf, 0);
+	if (n < pf->num_blocks && !pf->done[n])
+		pf->late++;
+
+	if (pf->next < n)
+		pf->next = n;
+	while (pf->next < pf->num_blocks && pf->next <= n + pf->ahead
+	       && pf->inflight < pf->ahead)
+		start_read(pf, pf->next++);
+	if (pf->ring.fd >= 0 && pf->ring.pending)
+		ring_enter(&pf->ring, 0);
+}
+
+void prefetch_print_stats(const struct prefetch *pf)
+{
+	double secs = seconds_between(&pf->start, &pf->end);
+	double mb = pf->bytes_read / (1024.0 * 1024.0);
+
+	if (pf->ring.fd < 0) {
+		fprintf(stderr, "bitcoin-iterate: Prefetched %zu blocks (%.1f MB) with posix_fadvise, %zu reached before prefetching\n",
+			pf->blocks_read, mb, pf->late);
+		return;
+	}
+	fprintf(stderr, "bitcoin-iterate: Prefetched %zu blocks (%.1f MB at %.1f MB/s) with io_uring, %zu reached before they were read\n",
+		pf->blocks_read, mb, secs > 0 ? mb / secs : 0.0, pf->late);
+}
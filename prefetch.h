@@ -0,0 +1,60 @@
+/*******************************************************************************
+ *
+ *  = prefetch.h
+ *
+ *  Defines a prefetcher which reads upcoming blocks into the page
+ *  cache, in chain order, before the iterator gets to them.
+ *
+ *  Chain order jumps between block files (blocks are stored in the
+ *  order they were downloaded), so without this every jump stalls on
+ *  a cold read.  Reads are issued asynchronously through io_uring,
+ *  many at once, which helps most when storage latency rather than
+ *  bandwidth is the limit.  If io_uring isn't available, the kernel is
+ *  asked to read ahead with posix_fadvise() instead.
+ *
+ */
+#ifndef BITCOIN_ITERATE_PREFETCH_H
+#define BITCOIN_ITERATE_PREFETCH_H
+#include <stdbool.h>
+#include <ccan/tal/tal.h>
+#include "types.h"
+
+struct prefetch;
+
+/**
+ * prefetch_new - Create a prefetcher for @blocks.
+ *
+ * @ctx: tal context; freeing the prefetcher cancels its reads
+ * @blocks: the blocks which will be read, in chain order
+ * @num_blocks: the number of @blocks
+ * @block_fnames: array of block filenames
+ * @ahead: how many blocks to keep reading ahead (must be non-zero)
+ *
+ * @blocks must not change while the prefetcher exists.
+ */
+struct prefetch *prefetch_new(const tal_t *ctx,
+			      struct block **blocks, size_t num_blocks,
+			      char **block_fnames, unsigned int ahead);
+
+/**
+ * prefetch_advance - Note that the iterator has reached a block.
+ *
+ * @pf: the prefetcher
+ * @n: the index of the block in the prefetcher's @blocks
+ *
+ * Collects finished reads, and starts reads for blocks up to @ahead
+ * past @n.
+ */
+void prefetch_advance(struct prefetch *pf, size_t n);
+
+/**
+ * prefetch_print_stats - Print how the prefetcher did to stderr.
+ *
+ * @pf: the prefetcher
+ *
+ * Gives the amount read, the throughput of the reads, and how many
+ * blocks were reached by the iterator before they had been read.
+ */
+void prefetch_print_stats(const struct prefetch *pf);
+
+#endif /* BITCOIN_ITERATE_PREFETCH_H */
@@ -0,0 +1,166 @@
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+/* Searches byte by byte, from @i. */
+static size_t scan_generic(const u8 *buf, size_t len, const u8 m[4],
+			   u64 *zeroes, size_t i)
+{
+	for (; i + 4 <= len; i++) {
+		if (buf[i] == m[0] && buf[i+1] == m[1]
+		    && buf[i+2] == m[2] && buf[i+3] == m[3])
+			return i;
+		*zeroes += (buf[i] == 0);
+	}
+	return i;
+}
+
+/*
+ * The SIMD versions compare a vector of offsets at a time: the marker
+ * starts at an offset if its first byte matches there, its second
+ * byte matches one further on, and so on.  A vector of all zeroes
+ * (the padding bitcoind preallocates files with) can't hold the start
+ * of a marker, so it is just counted.
+ */
+#ifdef HAVE_X86
+#ifdef __SSE2__
+static size_t scan_sse2(const u8 *buf, size_t len, const u8 m[4], u64 *zeroes)
+{
+	const __m128i m0 = _mm_set1_epi8(m[0]), m1 = _mm_set1_epi8(m[1]);
+	const __m128i m2 = _mm_set1_epi8(m[2]), m3 = _mm_set1_epi8(m[3]);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 + 3 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		unsigned int z = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		unsigned int hit;
+
+		if (z == 0xFFFF && m[0]) {
+			*zeroes += 16;
+			continue;
+		}
+		hit = _mm_movemask_epi8(_mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(v, m0),
+				      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 1)), m1)),
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 2)), m2),
+				      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 3)), m3))));
+		if (hit) {
+			unsigned int n = __builtin_ctz(hit);
+
+			*zeroes += __builtin_popcount(z & ((1U << n) - 1));
+			return i + n;
+		}
+		*zeroes += __builtin_popcount(z);
+	}
+	return scan_generic(buf, len, m, zeroes, i);
+}
+#endif /* __SSE2__ */
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const u8 *buf, size_t len, const u8 m[4], u64 *zeroes)
+{
+	const __m256i m0 = _mm256_set1_epi8(m[0]), m1 = _mm256_set1_epi8(m[1]);
+	const __m256i m2 = _mm256_set1_epi8(m[2]), m3 = _mm256_set1_epi8(m[3]);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i;
+
+	for (i = 0; i + 32 + 3 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		u32 z = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+		u32 hit;
+
+		if (z == 0xFFFFFFFF && m[0]) {
+			*zeroes += 32;
+			continue;
+		}
+		hit = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_and_si256(_mm256_cmpeq_epi8(v, m0),
+					 _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 1)), m1)),
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 2)), m2),
+					 _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 3)), m3))));
+		if (hit) {
+			unsigned int n = __builtin_ctz(hit);
+
+			*zeroes += __builtin_popcount(z & ((1U << n) - 1));
+			return i + n;
+		}
+		*zeroes += __builtin_popcount(z);
+	}
+	return scan_generic(buf, len, m, zeroes, i);
+}
+#endif /* HAVE_X86 */
+
+#ifdef HAVE_NEON
+/* NEON has no movemask: narrow each byte's compare result to 4 bits. */
+static u64 neon_mask(uint8x16_t eq)
+{
+	return vget_lane_u64(vreinterpret_u64_u8(
+		vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static size_t scan_neon(const u8 *buf, size_t len, const u8 m[4], u64 *zeroes)
+{
+	const uint8x16_t m0 = vdupq_n_u8(m[0]), m1 = vdupq_n_u8(m[1]);
+	const uint8x16_t m2 = vdupq_n_u8(m[2]), m3 = vdupq_n_u8(m[3]);
+	size_t i;
+
+	for (i = 0; i + 16 + 3 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(buf + i);
+		u64 z = neon_mask(vceqzq_u8(v)), hit;
+
+		if (z == ~0ULL && m[0]) {
+			*zeroes += 16;
+			continue;
+		}
+		hit = neon_mask(vandq_u8(vandq_u8(vceqq_u8(v, m0),
+						  vceqq_u8(vld1q_u8(buf + i + 1), m1)),
+					 vandq_u8(vceqq_u8(vld1q_u8(buf + i + 2), m2),
+						  vceqq_u8(vld1q_u8(buf + i + 3), m3))));
+		if (hit) {
+			unsigned int n = __builtin_ctzll(hit) / 4;
+
+			*zeroes += __builtin_popcountll(z & ((1ULL << (n * 4)) - 1)) / 4;
+			return i + n;
+		}
+		*zeroes += __builtin_popcountll(z) / 4;
+	}
+	return scan_generic(buf, len, m, zeroes, i);
+}
+#endif /* HAVE_NEON */
+
+static size_t scan_default(const u8 *buf, size_t len, const u8 m[4], u64 *zeroes)
+{
+#if defined(HAVE_X86) && defined(__SSE2__)
+	return scan_sse2(buf, len, m, zeroes);
+#elif defined(HAVE_NEON)
+	return scan_neon(buf, len, m, zeroes);
+#else
+	return scan_generic(buf, len, m, zeroes, 0);
+#endif
+}
+
+static size_t (*scan)(const u8 *buf, size_t len, const u8 m[4], u64 *zeroes)
+	= scan_default;
+
+__attribute__((constructor))
+static void select_scan(void)
+{
+#ifdef HAVE_X86
+	if (__builtin_cpu_supports("avx2"))
+		scan = scan_avx2;
+#endif
+}
+
+size_t scan_marker(const u8 *buf, size_t len, u32 marker, u64 *zeroes)
+{
+	const u8 m[4] = { marker, marker >> 8, marker >> 16, marker >> 24 };
+
+	return scan(buf, len, m, zeroes);
+}
@@ -0,0 +1,31 @@
+/*******************************************************************************
+ *
+ *  = scan.h
+ *
+ *  Defines a fast search for a block's network marker in raw block
+ *  file data, comparing many offsets at once with SIMD (AVX2 or SSE2
+ *  on x86, NEON on ARM) where the CPU has it.
+ *
+ *  Safe to call from any thread.
+ *
+ */
+#ifndef BITCOIN_ITERATE_SCAN_H
+#define BITCOIN_ITERATE_SCAN_H
+#include <stddef.h>
+#include <ccan/short_types/short_types.h>
+
+/**
+ * scan_marker - Find the first place a (little-endian) marker starts.
+ *
+ * @buf: the data to search
+ * @len: the length of @buf
+ * @marker: the marker to look for
+ * @zeroes: incremented by the number of zero bytes before the marker
+ *
+ * Returns the offset of the first marker which lies wholly in @buf,
+ * or, if there is none, the first offset at which one could not fit
+ * (so the last three bytes can be searched again with more data).
+ */
+size_t scan_marker(const u8 *buf, size_t len, u32 marker, u64 *zeroes);
+
+#endif /* BITCOIN_ITERATE_SCAN_H */
@@ -0,0 +1,490 @@
+#include <stdint.h>
+#include <string.h>
+#include <ccan/endian/endian.h>
+#include "sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+/* Widest SIMD batch: 16 lanes of 32 bits for AVX-512. */
+#define MAX_LANES 16
+
+static const u32 K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const u32 IV[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define BSIG0(x)	(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define BSIG1(x)	(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SSIG0(x)	(ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SSIG1(x)	(ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static u32 load_be32(const u8 *p)
+{
+	be32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return be32_to_cpu(v);
+}
+
+static void store_be32(u8 *p, u32 v)
+{
+	be32 b = cpu_to_be32(v);
+
+	memcpy(p, &b, sizeof(b));
+}
+
+static void transform_generic(u32 s[8], const u8 *data, size_t nblocks)
+{
+	while (nblocks--) {
+		u32 w[64], a, b, c, d, e, f, g, h;
+		int t;
+
+		for (t = 0; t < 16; t++)
+			w[t] = load_be32(data + t * 4);
+		for (t = 16; t < 64; t++)
+			w[t] = SSIG1(w[t-2]) + w[t-7] + SSIG0(w[t-15]) + w[t-16];
+
+		a = s[0]; b = s[1]; c = s[2]; d = s[3];
+		e = s[4]; f = s[5]; g = s[6]; h = s[7];
+		for (t = 0; t < 64; t++) {
+			u32 t1 = h + BSIG1(e) + CH(e, f, g) + K[t] + w[t];
+			u32 t2 = BSIG0(a) + MAJ(a, b, c);
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+		s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+		data += 64;
+	}
+}
+
+#ifdef HAVE_X86
+/* The SHA extensions keep the state as ABEF and CDGH, and do two
+ * rounds per instruction: four rounds use four message words, which
+ * are scheduled from the previous sixteen. */
+#define LOAD_WORDS(data, i) \
+	_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)((data) + (i) * 16)), mask)
+#define ROUNDS4(g, w)							\
+	do {								\
+		m = _mm_add_epi32(w, _mm_loadu_si128((const __m128i *)&K[(g) * 4])); \
+		s1 = _mm_sha256rnds2_epu32(s1, s0, m);			\
+		m = _mm_shuffle_epi32(m, 0x0E);				\
+		s0 = _mm_sha256rnds2_epu32(s0, s1, m);			\
+	} while (0)
+#define SCHEDULE(w0, w1, w2, w3)					\
+	w0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), \
+						_mm_alignr_epi8(w3, w2, 4)), w3)
+
+__attribute__((target("sha,sse4.1")))
+static void transform_shani(u32 s[8], const u8 *data, size_t nblocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					    0x0405060700010203ULL);
+	__m128i tmp = _mm_loadu_si128((const __m128i *)&s[0]);
+	__m128i s1 = _mm_loadu_si128((const __m128i *)&s[4]);
+	__m128i s0;
+
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	s1 = _mm_shuffle_epi32(s1, 0x1B);
+	s0 = _mm_alignr_epi8(tmp, s1, 8);
+	s1 = _mm_blend_epi16(s1, tmp, 0xF0);
+
+	while (nblocks--) {
+		__m128i abef = s0, cdgh = s1, w0, w1, w2, w3, m;
+		int g;
+
+		w0 = LOAD_WORDS(data, 0);
+		ROUNDS4(0, w0);
+		w1 = LOAD_WORDS(data, 1);
+		ROUNDS4(1, w1);
+		w2 = LOAD_WORDS(data, 2);
+		ROUNDS4(2, w2);
+		w3 = LOAD_WORDS(data, 3);
+		ROUNDS4(3, w3);
+		for (g = 4; g < 16; g += 4) {
+			SCHEDULE(w0, w1, w2, w3);
+			ROUNDS4(g, w0);
+			SCHEDULE(w1, w2, w3, w0);
+			ROUNDS4(g + 1, w1);
+			SCHEDULE(w2, w3, w0, w1);
+			ROUNDS4(g + 2, w2);
+			SCHEDULE(w3, w0, w1, w2);
+			ROUNDS4(g + 3, w3);
+		}
+		s0 = _mm_add_epi32(s0, abef);
+		s1 = _mm_add_epi32(s1, cdgh);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(s0, 0x1B);
+	s1 = _mm_shuffle_epi32(s1, 0xB1);
+	s0 = _mm_blend_epi16(tmp, s1, 0xF0);
+	s1 = _mm_alignr_epi8(s1, tmp, 8);
+	_mm_storeu_si128((__m128i *)&s[0], s0);
+	_mm_storeu_si128((__m128i *)&s[4], s1);
+}
+
+/* One block for each of @lanes messages at once, each lane of a
+ * vector holding a different message's word.  @st[i] holds word i of
+ * every lane's state. */
+#define TRANSFORM_LANES(name, vec, lanes, isa)				\
+__attribute__((target(isa)))						\
+static void name(u32 st[8][MAX_LANES], const u8 *blocks[MAX_LANES])	\
+{									\
+	u32 words[16][lanes];						\
+	vec w[16], s[8], a, b, c, d, e, f, g, h;			\
+	int t, l;							\
+									\
+	for (t = 0; t < 16; t++)					\
+		for (l = 0; l < lanes; l++)				\
+			words[t][l] = load_be32(blocks[l] + t * 4);	\
+	memcpy(w, words, sizeof(w));					\
+	for (t = 0; t < 8; t++)						\
+		memcpy(&s[t], st[t], sizeof(vec));			\
+									\
+	a = s[0]; b = s[1]; c = s[2]; d = s[3];				\
+	e = s[4]; f = s[5]; g = s[6]; h = s[7];				\
+	for (t = 0; t < 64; t++) {					\
+		vec t1, t2;						\
+									\
+		if (t >= 16)						\
+			w[t & 15] += SSIG1(w[(t - 2) & 15])		\
+				+ w[(t - 7) & 15]			\
+				+ SSIG0(w[(t - 15) & 15]);		\
+		t1 = h + BSIG1(e) + CH(e, f, g) + K[t] + w[t & 15];	\
+		t2 = BSIG0(a) + MAJ(a, b, c);				\
+		h = g; g = f; f = e; e = d + t1;			\
+		d = c; c = b; b = a; a = t1 + t2;			\
+	}								\
+	s[0] += a; s[1] += b; s[2] += c; s[3] += d;			\
+	s[4] += e; s[5] += f; s[6] += g; s[7] += h;			\
+	for (t = 0; t < 8; t++)						\
+		memcpy(st[t], &s[t], sizeof(vec));			\
+}
+
+typedef u32 vec8 __attribute__((vector_size(32)));
+typedef u32 vec16 __attribute__((vector_size(64)));
+TRANSFORM_LANES(transform_avx2, vec8, 8, "avx2")
+TRANSFORM_LANES(transform_avx512, vec16, 16, "avx512f")
+#endif /* HAVE_X86 */
+
+static void (*transform)(u32 s[8], const u8 *data, size_t nblocks)
+	= transform_generic;
+static void (*transform_lanes)(u32 st[8][MAX_LANES],
+			       const u8 *blocks[MAX_LANES]);
+static unsigned int num_lanes;
+
+__attribute__((constructor))
+static void select_backend(void)
+{
+#ifdef HAVE_X86
+	unsigned int eax, ebx, ecx, edx;
+	bool sse41, xsave_avx = false, xsave_avx512 = false;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return;
+	sse41 = ecx & bit_SSE4_1;
+	/* The OS must save the wider registers, too. */
+	if (ecx & bit_OSXSAVE) {
+		u32 xcr0_lo, xcr0_hi;
+
+		__asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+		xsave_avx = (xcr0_lo & 0x6) == 0x6;
+		xsave_avx512 = (xcr0_lo & 0xe6) == 0xe6;
+	}
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return;
+
+	/* SHA-NI hashes a block faster than SIMD lanes hash a block each
+	 * (which need AVX-512 to even match it), so lanes are only for
+	 * CPUs without it. */
+	if ((ebx & bit_SHA) && sse41) {
+		transform = transform_shani;
+		return;
+	}
+	if (xsave_avx512 && (ebx & bit_AVX512F)) {
+		transform_lanes = transform_avx512;
+		num_lanes = 16;
+	} else if (xsave_avx && (ebx & bit_AVX2)) {
+		transform_lanes = transform_avx2;
+		num_lanes = 8;
+	}
+#endif
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	memcpy(ctx->state, IV, sizeof(IV));
+	ctx->bytes = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *p, size_t len)
+{
+	const u8 *data = p;
+	size_t used = ctx->bytes % 64;
+
+	ctx->bytes += len;
+	if (used) {
+		size_t n = 64 - used < len ? 64 - used : len;
+
+		memcpy(ctx->buf + used, data, n);
+		data += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		transform(ctx->state, ctx->buf, 1);
+	}
+	if (len >= 64) {
+		transform(ctx->state, data, len / 64);
+		data += len / 64 * 64;
+		len %= 64;
+	}
+	memcpy(ctx->buf, data, len);
+}
+
+void sha256_final(struct sha256_ctx *ctx, u8 out[32])
+{
+	static const u8 pad[64] = { 0x80 };
+	be64 bits = cpu_to_be64(ctx->bytes * 8);
+	int i;
+
+	sha256_update(ctx, pad, 1 + (119 - ctx->bytes % 64) % 64);
+	sha256_update(ctx, &bits, sizeof(bits));
+	for (i = 0; i < 8; i++)
+		store_be32(out + i * 4, ctx->state[i]);
+}
+
+void sha256_double(struct sha256_ctx *ctx, u8 out[32])
+{
+	u8 first[32];
+
+	sha256_final(ctx, first);
+	sha256_init(ctx);
+	sha256_update(ctx, first, sizeof(first));
+	sha256_final(ctx, out);
+}
+
+/* A message being hashed in one SIMD lane. */
+struct lane {
+	const struct sha256_msg *msg;
+	/* Next unread byte. */
+	size_t seg, off;
+	u64 total;
+	/* 0: more to read, 1: only the length block left, 2: finished. */
+	int pad;
+	/* Hashing the first hash (in @inner)? */
+	bool second;
+	u8 *out;
+	struct sha256_msg inner;
+	u8 digest[32];
+	u8 buf[64];
+};
+
+static void lane_start(struct lane *l, const struct sha256_msg *msg)
+{
+	size_t i;
+
+	l->msg = msg;
+	l->seg = l->off = 0;
+	l->pad = 0;
+	l->total = 0;
+	for (i = 0; i < SHA256_MSG_SEGS; i++)
+		l->total += msg->len[i];
+}
+
+/* Returns the next 64-byte blocks (with padding) of the lane's
+ * message: up to @max of them, if they lie together. */
+static const u8 *lane_next_blocks(struct lane *l, size_t max, size_t *num)
+{
+	const struct sha256_msg *m = l->msg;
+	be64 bits;
+	size_t n = 0;
+
+	*num = 1;
+	if (l->pad == 1) {
+		memset(l->buf, 0, 56);
+		goto length;
+	}
+
+	while (l->seg < SHA256_MSG_SEGS && l->off == m->len[l->seg]) {
+		l->seg++;
+		l->off = 0;
+	}
+	/* Most blocks can be hashed where they are. */
+	if (l->seg < SHA256_MSG_SEGS && m->len[l->seg] - l->off >= 64) {
+		const u8 *p = m->seg[l->seg] + l->off;
+
+		*num = (m->len[l->seg] - l->off) / 64;
+		if (*num > max)
+			*num = max;
+		l->off += *num * 64;
+		return p;
+	}
+
+	while (n < 64 && l->seg < SHA256_MSG_SEGS) {
+		size_t take = m->len[l->seg] - l->off;
+
+		if (!take) {
+			/* Empty segments may have a NULL pointer. */
+			l->seg++;
+			l->off = 0;
+			continue;
+		}
+		if (take > 64 - n)
+			take = 64 - n;
+		memcpy(l->buf + n, m->seg[l->seg] + l->off, take);
+		n += take;
+		l->off += take;
+		if (l->off == m->len[l->seg]) {
+			l->seg++;
+			l->off = 0;
+		}
+	}
+	if (n == 64)
+		return l->buf;
+
+	l->buf[n++] = 0x80;
+	if (n > 56) {
+		memset(l->buf + n, 0, 64 - n);
+		l->pad = 1;
+		return l->buf;
+	}
+	memset(l->buf + n, 0, 56 - n);
+length:
+	bits = cpu_to_be64(l->total * 8);
+	memcpy(l->buf + 56, &bits, sizeof(bits));
+	l->pad = 2;
+	return l->buf;
+}
+
+/* Called once a lane's hash is finished: starts the second hash, or
+ * writes the result.  Returns true if the lane is done. */
+static bool lane_finished(struct lane *l, u32 s[8])
+{
+	u8 *dst = l->second ? l->out : l->digest;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		store_be32(dst + i * 4, s[i]);
+	if (l->second)
+		return true;
+
+	memset(&l->inner, 0, sizeof(l->inner));
+	l->inner.seg[0] = l->digest;
+	l->inner.len[0] = sizeof(l->digest);
+	lane_start(l, &l->inner);
+	l->second = true;
+	memcpy(s, IV, sizeof(IV));
+	return false;
+}
+
+static void lane_begin(struct lane *l, const struct sha256_msg *msg, u32 s[8])
+{
+	lane_start(l, msg);
+	l->second = false;
+	l->out = msg->out;
+	memcpy(s, IV, sizeof(IV));
+}
+
+/* Finishes a lane's double hash one block at a time. */
+static void lane_run(struct lane *l, u32 s[8])
+{
+	do {
+		size_t num;
+		const u8 *p = lane_next_blocks(l, SIZE_MAX, &num);
+
+		transform(s, p, num);
+	} while (l->pad != 2 || !lane_finished(l, s));
+}
+
+void sha256d_batch(const struct sha256_msg *msgs, size_t n)
+{
+	static const u8 idle_block[64];
+	struct lane lanes[MAX_LANES];
+	u32 st[8][MAX_LANES], s[8];
+	const u8 *blocks[MAX_LANES];
+	bool active[MAX_LANES];
+	size_t next = 0, num_active = 0;
+	unsigned int l;
+	int i;
+
+	if (!transform_lanes || n < 2) {
+		for (next = 0; next < n; next++) {
+			lane_begin(&lanes[0], &msgs[next], s);
+			lane_run(&lanes[0], s);
+		}
+		return;
+	}
+
+	for (l = 0; l < num_lanes; l++) {
+		active[l] = next < n;
+		if (active[l]) {
+			lane_begin(&lanes[l], &msgs[next++], s);
+			for (i = 0; i < 8; i++)
+				st[i][l] = s[i];
+			num_active++;
+		}
+	}
+
+	/* Once lanes run dry, finish the stragglers one at a time. */
+	while (num_active > num_lanes / 2 || (num_active && next < n)) {
+		for (l = 0; l < num_lanes; l++) {
+			size_t num;
+
+			blocks[l] = active[l]
+				? lane_next_blocks(&lanes[l], 1, &num) : idle_block;
+		}
+		transform_lanes(st, blocks);
+
+		for (l = 0; l < num_lanes; l++) {
+			if (!active[l] || lanes[l].pad != 2)
+				continue;
+			for (i = 0; i < 8; i++)
+				s[i] = st[i][l];
+			if (lane_finished(&lanes[l], s)) {
+				if (next < n)
+					lane_begin(&lanes[l], &msgs[next++], s);
+				else {
+					active[l] = false;
+					num_active--;
+				}
+			}
+			for (i = 0; i < 8; i++)
+				st[i][l] = s[i];
+		}
+	}
+
+	for (l = 0; l < num_lanes; l++) {
+		if (!active[l])
+			continue;
+		for (i = 0; i < 8; i++)
+			s[i] = st[i][l];
+		lane_run(&lanes[l], s);
+	}
+}
@@ -0,0 +1,63 @@
+/*******************************************************************************
+ *
+ *  = sha256.h
+ *
+ *  Defines SHA256, with the fastest implementation this CPU supports
+ *  picked at startup: the SHA extensions (SHA-NI) if present, else
+ *  portable C.  Batches of double-SHA256 hashes (txids) can also be
+ *  computed several at a time in SIMD lanes (AVX2 or AVX-512).
+ *
+ *  All of these are safe to call from any thread.
+ *
+ */
+#ifndef BITCOIN_ITERATE_SHA256_H
+#define BITCOIN_ITERATE_SHA256_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <ccan/short_types/short_types.h>
+
+/* Most pieces a message to be hashed in a batch can be made of. */
+#define SHA256_MSG_SEGS 3
+
+struct sha256_ctx {
+	u32 state[8];
+	u8 buf[64];
+	u64 bytes;
+};
+
+/**
+ * sha256_msg - A message for sha256d_batch().
+ *
+ * @seg: the pieces of the message, concatenated in order
+ * @len: the length of each piece (0 for unused pieces)
+ * @out: where to write the double-SHA256 of the message
+ */
+struct sha256_msg {
+	const u8 *seg[SHA256_MSG_SEGS];
+	size_t len[SHA256_MSG_SEGS];
+	u8 *out;
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *p, size_t len);
+void sha256_final(struct sha256_ctx *ctx, u8 out[32]);
+
+/**
+ * sha256_double - Finish a hash, then hash the result again.
+ *
+ * @ctx: the context, with the whole message added
+ * @out: the double-SHA256 of the message
+ */
+void sha256_double(struct sha256_ctx *ctx, u8 out[32]);
+
+/**
+ * sha256d_batch - Compute the double-SHA256 of several messages.
+ *
+ * @msgs: the messages
+ * @n: the number of messages
+ *
+ * With AVX2 (or AVX-512), 8 (or 16) messages are hashed at a time.
+ */
+void sha256d_batch(const struct sha256_msg *msgs, size_t n);
+
+#endif /* BITCOIN_ITERATE_SHA256_H */
@@ -0,0 +1,105 @@
+#include <string.h>
+#include "snappy.h"
+
+/* Element tags, in the low two bits of each tag byte. */
+#define TAG_LITERAL	0
+#define TAG_COPY_1	1
+#define TAG_COPY_2	2
+#define TAG_COPY_4	3
+
+static bool pull_preamble(const u8 **p, const u8 *end, size_t *len)
+{
+	unsigned int shift;
+
+	*len = 0;
+	for (shift = 0; shift < 32 && *p < end; shift += 7) {
+		u8 c = *(*p)++;
+
+		*len |= (size_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool snappy_uncompressed_length(const u8 *src, size_t srclen, size_t *len)
+{
+	return pull_preamble(&src, src + srclen, len);
+}
+
+/* Little-endian value of @n (1 to 4) bytes. */
+static size_t pull_le(const u8 *p, size_t n)
+{
+	size_t v = 0;
+
+	while (n--)
+		v = (v << 8) | p[n];
+	return v;
+}
+
+bool snappy_decompress(const u8 *src, size_t srclen, u8 *dst, size_t dstlen)
+{
+	const u8 *p = src, *end = src + srclen;
+	size_t len, op = 0;
+
+	if (!pull_preamble(&p, end, &len) || len != dstlen)
+		return false;
+
+	while (p < end) {
+		u8 tag = *p++;
+		size_t n, offset;
+
+		switch (tag & 3) {
+		case TAG_LITERAL:
+			n = tag >> 2;
+			if (n >= 60) {
+				size_t bytes = n - 59;
+				if (end - p < bytes)
+					return false;
+				n = pull_le(p, bytes);
+				p += bytes;
+			}
+			n++;
+			if (end - p < n || dstlen - op < n)
+				return false;
+			memcpy(dst + op, p, n);
+			p += n;
+			op += n;
+			continue;
+		case TAG_COPY_1:
+			if (end - p < 1)
+				return false;
+			n = ((tag >> 2) & 7) + 4;
+			offset = ((size_t)(tag >> 5) << 8) | *p++;
+			break;
+		case TAG_COPY_2:
+			if (end - p < 2)
+				return false;
+			n = (tag >> 2) + 1;
+			offset = pull_le(p, 2);
+			p += 2;
+			break;
+		default:
+			if (end - p < 4)
+				return false;
+			n = (tag >> 2) + 1;
+			offset = pull_le(p, 4);
+			p += 4;
+			break;
+		}
+
+		if (offset == 0 || offset > op || dstlen - op < n)
+			return false;
+		/* Copies may overlap their own output (runs). */
+		if (offset >= n) {
+			memcpy(dst + op, dst + op - offset, n);
+			op += n;
+		} else {
+			while (n--) {
+				dst[op] = dst[op - offset];
+				op++;
+			}
+		}
+	}
+	return op == dstlen;
+}
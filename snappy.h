@@ -0,0 +1,41 @@
+/*******************************************************************************
+ *
+ *  = snappy.h
+ *
+ *  Defines functions for decoding Snappy-compressed buffers, as
+ *  found in LevelDB tables.
+ *
+ *  Only the raw block format is supported (not the framing format).
+ *
+ */
+#ifndef BITCOIN_ITERATE_SNAPPY_H
+#define BITCOIN_ITERATE_SNAPPY_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <ccan/short_types/short_types.h>
+
+/**
+ * snappy_uncompressed_length - Read the length a buffer decompresses to.
+ *
+ * @src: compressed data
+ * @srclen: length of compressed data
+ * @len: set to the uncompressed length
+ *
+ * Returns false if @src doesn't start with a valid length.
+ */
+bool snappy_uncompressed_length(const u8 *src, size_t srclen, size_t *len);
+
+/**
+ * snappy_decompress - Decompress a buffer.
+ *
+ * @src: compressed data
+ * @srclen: length of compressed data
+ * @dst: buffer for the result, of snappy_uncompressed_length() bytes
+ * @dstlen: length of @dst
+ *
+ * Returns false if @src is corrupt or doesn't decompress to exactly
+ * @dstlen bytes.
+ */
+bool snappy_decompress(const u8 *src, size_t srclen, u8 *dst, size_t dstlen);
+
+#endif /* BITCOIN_ITERATE_SNAPPY_H */
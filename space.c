@@ -0,0 +1,112 @@
+#include <ccan/err/err.h>
+#include <sys/mman.h>
+#include "space.h"
+
+/* Big enough for most blocks' parse, and a whole number of huge pages. */
+#define SPACE_CHUNK_SIZE (4 * 1024 * 1024)
+#define SPACE_HUGE_PAGE (2 * 1024 * 1024)
+
+/**
+ * space_chunk - A mapping which space is allocated from.
+ *
+ * @next: the next chunk to use
+ * @size: size of the mapping, including this header
+ */
+struct space_chunk {
+	struct space_chunk *next;
+	size_t size;
+};
+
+#define CHUNK_HDR ((sizeof(struct space_chunk) + SPACE_ALIGN - 1) \
+		   & ~(size_t)(SPACE_ALIGN - 1))
+
+static struct space_chunk *new_chunk(size_t bytes)
+{
+	struct space_chunk *c;
+	size_t size = CHUNK_HDR + bytes;
+
+	if (size < SPACE_CHUNK_SIZE)
+		size = SPACE_CHUNK_SIZE;
+	else
+		size = (size + SPACE_HUGE_PAGE - 1) & ~(size_t)(SPACE_HUGE_PAGE - 1);
+
+	c = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+		 -1, 0);
+	if (c == MAP_FAILED)
+		err(1, "Allocating %zu bytes of parse space", size);
+#ifdef MADV_HUGEPAGE
+	/* Only a hint: fewer TLB misses walking a big block's parse. */
+	madvise(c, size, MADV_HUGEPAGE);
+#endif
+	c->next = NULL;
+	c->size = size;
+	return c;
+}
+
+void space_init(struct space *space)
+{
+	space->chunks = space->cur = NULL;
+	space->off = space->end = 0;
+	space->used = space->high_water = 0;
+}
+
+void space_reset(struct space *space)
+{
+	space->high_water = space_high_water(space);
+	space->used = 0;
+	space->cur = space->chunks;
+	if (space->cur) {
+		space->off = CHUNK_HDR;
+		space->end = space->cur->size;
+	}
+}
+
+void space_free(struct space *space)
+{
+	struct space_chunk *c, *next;
+
+	for (c = space->chunks; c; c = next) {
+		next = c->next;
+		munmap(c, c->size);
+	}
+	space->chunks = space->cur = NULL;
+	space->off = space->end = 0;
+}
+
+size_t space_high_water(const struct space *space)
+{
+	size_t used = space->used;
+
+	if (space->cur)
+		used += space->off - CHUNK_HDR;
+	return used > space->high_water ? used : space->high_water;
+}
+
+void *space_grow(struct space *space, size_t bytes)
+{
+	struct space_chunk *next;
+
+	if (space->cur) {
+		space->used += space->off - CHUNK_HDR;
+		next = space->cur->next;
+	} else
+		next = space->chunks;
+
+	/* Chunks kept from earlier blocks are used in order; if the next
+	 * one is too small, a bigger one goes in front of it. */
+	if (!next || next->size - CHUNK_HDR < bytes) {
+		struct space_chunk *c = new_chunk(bytes);
+
+		c->next = next;
+		if (space->cur)
+			space->cur->next = c;
+		else
+			space->chunks = c;
+		next = c;
+	}
+
+	space->cur = next;
+	space->off = CHUNK_HDR + bytes;
+	space->end = next->size;
+	return (char *)next + CHUNK_HDR;
+}
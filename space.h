@@ -7,29 +7,65 @@
  */
 #ifndef BITCOIN_ITERATE_SPACE_H
 #define BITCOIN_ITERATE_SPACE_H
-#include <ccan/tal/tal.h>
-#include <assert.h>
+#include <stddef.h>
+
+/* Allocations are rounded up to this, so structs stay aligned. */
+#define SPACE_ALIGN 8
+
+struct space_chunk;
 
 /**
- * space - Simple bump allocator used to label space acquired via tal.
+ * space - Bump allocator for everything parsed out of one block.
+ *
+ * @chunks: the chunks allocated so far, in the order they are used
+ * @cur: the chunk currently being allocated from
+ * @off: offset of the next allocation in @cur
+ * @end: size of @cur
+ * @used: bytes allocated from the chunks before @cur since the last reset
+ * @high_water: the most bytes allocated between any two resets
  *
- * Set to 3MB because blocks are capped at 1MB (as of
- * 2016-03-24 ¯\_(ツ)_/¯).
- * 
+ * Space grows by whole chunks (mapped with transparent huge pages
+ * where the kernel has them) when a block needs more, so large blocks
+ * fit however big they get.  Resetting keeps the chunks for the next
+ * block, without zeroing or unmapping them.
+ *
+ * Chunks are not allocated with tal, so each thread can have its own
+ * space.
  */
 struct space {
-	char buf[3 * 1024 * 1024];
-	size_t off;
+	struct space_chunk *chunks, *cur;
+	size_t off, end;
+	size_t used, high_water;
 };
 
 /**
- * space_init - Initialize new space
- * @space: Allocated space
+ * space_init - Initialize new (empty) space
+ * @space: Space to initialize
  */
-static inline void space_init(struct space *space)
-{
-	space->off = 0;
-}
+void space_init(struct space *space);
+
+/**
+ * space_reset - Make all of the space's chunks available again
+ * @space: Space to reset
+ *
+ * Everything allocated from @space before is invalid afterwards.
+ */
+void space_reset(struct space *space);
+
+/**
+ * space_free - Release all of the space's chunks
+ * @space: Space to free
+ */
+void space_free(struct space *space);
+
+/**
+ * space_high_water - Most bytes allocated between two resets
+ * @space: Space to check
+ */
+size_t space_high_water(const struct space *space);
+
+/* Moves on to a chunk with room for @bytes, and allocates them there. */
+void *space_grow(struct space *space, size_t bytes);
 
 /**
  * space_alloc - Allocate new space
@@ -38,10 +74,13 @@ static inline void space_init(struct space *space)
  */
 static inline void *space_alloc(struct space *space, size_t bytes)
 {
-	void *p = space->buf + space->off;
-	/* If this fails, enlarge buf[] above */
-	assert(space->off + bytes <= sizeof(space->buf) && "message");
+	char *p;
+
+	bytes = (bytes + SPACE_ALIGN - 1) & ~(size_t)(SPACE_ALIGN - 1);
+	if (!space->cur || bytes > space->end - space->off)
+		return space_grow(space, bytes);
 
+	p = (char *)space->cur + space->off;
 	space->off += bytes;
 	return p;
 }
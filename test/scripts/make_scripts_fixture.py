@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+# Writes fixtures/scripts/blk00000.dat: a tiny mainnet-magic chain whose
+# outputs cover every kind of script the UTXO set compresses, then spends
+# them.  Deterministic, so rerunning it gives the same file.
+#
+#  Block 0: one output of each standard type, plus look-alikes which must
+#           be kept raw, an empty script and an OP_RETURN.
+#  Block 1: spends all of block 0; creates 12 large raw scripts.
+#  Block 2: spends the large scripts, so the raw script arena (and the
+#           disk store's script file, with --utxo-hot) gets packed.
+#  Block 3: spends the rest, out of the packed arena.
+import hashlib, os, struct
+
+MAGIC = 0xD9B4BEF9
+COIN = 100000000
+
+def sha(b): return hashlib.sha256(b).digest()
+def dsha(b): return sha(sha(b))
+
+def pseudo(tag, n):
+    out = b''
+    while len(out) < n:
+        out += sha(tag.encode() + struct.pack('<I', len(out)))
+    return out[:n]
+
+def varint(n):
+    if n < 0xfd: return bytes([n])
+    if n <= 0xffff: return b'\xfd' + struct.pack('<H', n)
+    return b'\xfe' + struct.pack('<I', n)
+
+def tx(inputs, outputs):
+    ser = struct.pack('<I', 1) + varint(len(inputs))
+    for txid, index, sig in inputs:
+        ser += txid + struct.pack('<I', index) + varint(len(sig)) + sig + b'\xff\xff\xff\xff'
+    ser += varint(len(outputs))
+    for amount, script in outputs:
+        ser += struct.pack('<Q', amount) + varint(len(script)) + script
+    ser += struct.pack('<I', 0)
+    return ser, dsha(ser)
+
+def merkle(ids):
+    while len(ids) > 1:
+        if len(ids) % 2:
+            ids.append(ids[-1])
+        ids = [dsha(ids[i] + ids[i + 1]) for i in range(0, len(ids), 2)]
+    return ids[0]
+
+def coinbase(height, outputs):
+    return tx([(b'\0' * 32, 0xffffffff, struct.pack('<I', height))], outputs)
+
+def spend(prevs, outputs, tag):
+    return tx([(t, i, pseudo(tag + str(n), 72)) for n, (t, i) in enumerate(prevs)], outputs)
+
+h20 = lambda t: pseudo(t, 20)
+h32 = lambda t: pseudo(t, 32)
+standard = [
+    b'\x76\xa9\x14' + h20('p2pkh') + b'\x88\xac',		# P2PKH
+    b'\xa9\x14' + h20('p2sh') + b'\x87',			# P2SH
+    b'\x00\x14' + h20('p2wpkh'),				# P2WPKH
+    b'\x00\x20' + h32('p2wsh'),					# P2WSH
+    b'\x51\x20' + h32('p2tr'),					# P2TR
+    b'\x21\x02' + h32('even') + b'\xac',			# P2PK, even key
+    b'\x21\x03' + h32('odd') + b'\xac',				# P2PK, odd key
+    b'\x41\x04' + pseudo('uncompressed', 64) + b'\xac',		# raw: uncompressed P2PK
+    b'',							# raw: empty
+    b'\x51\x21\x02' + h32('m1') + b'\x21\x03' + h32('m2') + b'\x52\xae', # raw: bare multisig
+    b'\x00\x14' + h20('short')[:19],				# raw: short witness program
+    b'\x21\x04' + h32('badkey') + b'\xac',			# raw: 33 bytes, not 02/03
+    b'\x76\xa9\x14' + h20('nearly') + b'\x88\xad',		# raw: P2PKH but CHECKSIGVERIFY
+]
+
+blocks = []
+prev = b'\0' * 32
+
+def add_block(txs):
+    global prev
+    height = len(blocks)
+    hdr = struct.pack('<I', 1) + prev + merkle([t[1] for t in txs]) \
+        + struct.pack('<III', 1231006505 + 600 * height, 0x1d00ffff, height)
+    blocks.append(hdr + varint(len(txs)) + b''.join(t[0] for t in txs))
+    prev = dsha(hdr)
+
+cb0 = coinbase(0, [(COIN, s) for s in standard] + [(0, b'\x6a\x04' + b'data')])
+add_block([cb0])
+
+big = [pseudo('big%d' % n, 2000) for n in range(12)]
+cb1 = coinbase(1, [(50 * COIN, standard[0])])
+t1 = spend([(cb0[1], i) for i in range(len(standard))],
+           [(COIN // 2, s) for s in big] + [(COIN // 2, s) for s in standard[3:8]], 't1')
+add_block([cb1, t1])
+
+cb2 = coinbase(2, [(50 * COIN, standard[4])])
+t2 = spend([(t1[1], i) for i in range(len(big))], [(6 * COIN, standard[2])], 't2')
+add_block([cb2, t2])
+
+cb3 = coinbase(3, [(50 * COIN, standard[9])])
+t3 = spend([(t1[1], len(big) + i) for i in range(5)] + [(cb1[1], 0)],
+           [(COIN, s) for s in standard[:8]], 't3')
+add_block([cb3, t3])
+
+out = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'fixtures', 'scripts')
+os.makedirs(out, exist_ok=True)
+with open(os.path.join(out, 'blk00000.dat'), 'wb') as f:
+    for b in blocks:
+        f.write(struct.pack('<II', MAGIC, len(b)) + b)
@@ -0,0 +1,139 @@
+#include <pthread.h>
+#include <ccan/err/err.h>
+#include "threadpool.h"
+
+struct thread_pool {
+	/* Serializes thread_pool_run() callers. */
+	pthread_mutex_t run_lock;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	bool stop;
+
+	/* The current batch. */
+	void (*fn)(void *arg, size_t task);
+	void *arg;
+	size_t ntasks, next_task, finished;
+	/* Bumped for every batch, so idle threads notice a new one. */
+	size_t generation;
+
+	pthread_t *threads;
+	size_t nthreads;
+};
+
+/* Run tasks from the current batch until none are left.  Called with
+ * the lock held, returns with it held. */
+static void run_tasks(struct thread_pool *pool)
+{
+	while (pool->next_task < pool->ntasks) {
+		size_t task = pool->next_task++;
+		void (*fn)(void *arg, size_t task) = pool->fn;
+		void *arg = pool->arg;
+
+		pthread_mutex_unlock(&pool->lock);
+		fn(arg, task);
+		pthread_mutex_lock(&pool->lock);
+
+		if (++pool->finished == pool->ntasks)
+			pthread_cond_broadcast(&pool->done);
+	}
+}
+
+static void *pool_thread(void *arg)
+{
+	struct thread_pool *pool = arg;
+	size_t seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->stop)
+			break;
+		seen = pool->generation;
+		run_tasks(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void destroy_thread_pool(struct thread_pool *pool)
+{
+	size_t i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->run_lock);
+}
+
+struct thread_pool *thread_pool_new(const tal_t *ctx, unsigned int nthreads)
+{
+	struct thread_pool *pool;
+	size_t i;
+
+	if (nthreads < 2)
+		return NULL;
+
+	pool = tal(ctx, struct thread_pool);
+	pthread_mutex_init(&pool->run_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->stop = false;
+	pool->ntasks = pool->next_task = pool->finished = 0;
+	pool->generation = 0;
+
+	/* The thread calling thread_pool_run() is the last worker. */
+	pool->threads = tal_arr(pool, pthread_t, nthreads - 1);
+	pool->nthreads = 0;
+	tal_add_destructor(pool, destroy_thread_pool);
+	for (i = 0; i < nthreads - 1; i++) {
+		if (pthread_create(&pool->threads[i], NULL, pool_thread, pool) != 0)
+			err(1, "Creating pool thread %zu", i);
+		pool->nthreads++;
+	}
+	return pool;
+}
+
+void thread_pool_run(struct thread_pool *pool, size_t ntasks,
+		     void (*fn)(void *arg, size_t task), void *arg)
+{
+	size_t i;
+
+	if (!pool || ntasks < 2) {
+		for (i = 0; i < ntasks; i++)
+			fn(arg, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->run_lock);
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->ntasks = ntasks;
+	pool->next_task = 0;
+	pool->finished = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work);
+
+	run_tasks(pool);
+	while (pool->finished != pool->ntasks)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pool->run_lock);
+}
+
+unsigned int thread_pool_size(const struct thread_pool *pool)
+{
+	return pool ? pool->nthreads + 1 : 1;
+}
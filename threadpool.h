@@ -0,0 +1,51 @@
+/*******************************************************************************
+ *
+ *  = threadpool.h
+ *
+ *  Defines a minimal pool of threads for running batches of
+ *  independent tasks.
+ *
+ *  Task functions run on arbitrary threads: they must not allocate
+ *  from tal, and must only touch state belonging to their own task.
+ *
+ */
+#ifndef BITCOIN_ITERATE_THREADPOOL_H
+#define BITCOIN_ITERATE_THREADPOOL_H
+#include <ccan/tal/tal.h>
+
+struct thread_pool;
+
+/**
+ * thread_pool_new - Start a pool of threads.
+ *
+ * @ctx: tal context; freeing the pool stops and joins its threads
+ * @nthreads: total threads to run tasks on, including the caller of
+ *            thread_pool_run()
+ *
+ * Returns NULL if @nthreads is less than 2: thread_pool_run() then
+ * simply runs every task on the calling thread.
+ */
+struct thread_pool *thread_pool_new(const tal_t *ctx, unsigned int nthreads);
+
+/**
+ * thread_pool_run - Run @fn for every task number in [0, @ntasks).
+ *
+ * @pool: the pool (or NULL to run serially)
+ * @ntasks: number of tasks
+ * @fn: task function, called as fn(@arg, task)
+ * @arg: argument for @fn
+ *
+ * Tasks are handed out in ascending order; returns once all of them
+ * have completed.  Calls from different threads are serialized.
+ */
+void thread_pool_run(struct thread_pool *pool, size_t ntasks,
+		     void (*fn)(void *arg, size_t task), void *arg);
+
+/**
+ * thread_pool_size - Number of threads tasks run on (1 for NULL).
+ *
+ * @pool: the pool
+ */
+unsigned int thread_pool_size(const struct thread_pool *pool);
+
+#endif /* BITCOIN_ITERATE_THREADPOOL_H */
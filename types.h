@@ -50,16 +50,16 @@ struct block_header {
  * @height: Height in the blockchain (-1 for not-yet-known)
  * @filenum: Which block file index contained this block
  * @pos: The position within this block's file of its first transaction
- * @next: pointer to the next block struct in the blockchain
  * @bh: this block's header
  *
+ * This holds no pointers and has no padding, so the block cache can
+ * store it as-is and use it in place.
  */
 struct block {
 	u8 id[SHA256_DIGEST_LENGTH];
 	s32 height;
 	unsigned int filenum;
 	off_t pos;
-	struct block *next;
 	struct block_header bh;
 };
 
@@ -101,11 +101,25 @@ struct transaction {
  * @script_length: The length of this output's script
  * @script: This output's script
  *
+ * For a memory-mapped block file, @script points into the mapping.
  */
 struct output {
 	u64 amount;
 	varint_t script_length;
-	u8 *script;
+	const u8 *script;
+};
+
+/**
+ * witness_item - One item of an input's witness stack
+ *
+ * @length: The length of this item
+ * @data: This item's contents
+ *
+ * For a memory-mapped block file, @data points into the mapping.
+ */
+struct witness_item {
+	varint_t length;
+	const u8 *data;
 };
 
 /**
@@ -115,19 +129,46 @@ struct output {
  * @index: The index of the output in the transaction this input is spending
  * @script_length: The length of this input's script
  * @script: This input's script
+ * @num_witness: The number of items in this input's witness stack
+ * @witness: This input's witness stack (NULL if not segwit)
  * @sequence_number: This input's sequence number.
+ * @prevout: The UTXO this input spends, once its block's inputs have
+ *           been resolved (see resolve_block_prevouts()), else NULL
  *
+ * For a memory-mapped block file, @script points into the mapping.
+ * @prevout points into the UTXO map, so is only valid until the map
+ * next changes.
  */
 struct input {
 	u8 txid[SHA256_DIGEST_LENGTH];
 	u32 index; /* output number referred to by above */
 	varint_t script_length;
-	u8 *script;
+	const u8 *script;
 	varint_t num_witness;
-	u8 **witness;
+	struct witness_item *witness;
 	u32 sequence_number;
+	struct utxo *prevout;
 };
  
+/* How a UTXO's output script is stored: standard scripts are reduced
+ * to the hash (or key) they commit to, anything else is kept raw. */
+#define UTXO_SCRIPT_RAW		0
+#define UTXO_SCRIPT_P2PKH	1
+#define UTXO_SCRIPT_P2SH	2
+#define UTXO_SCRIPT_P2WPKH	3
+#define UTXO_SCRIPT_P2WSH	4
+#define UTXO_SCRIPT_P2TR	5
+/* Pay to a compressed public key: its X coordinate, with an even or
+ * odd Y. */
+#define UTXO_SCRIPT_P2PK_EVEN	6
+#define UTXO_SCRIPT_P2PK_ODD	7
+
+/* Longest script that a non-raw UTXO script expands to. */
+#define UTXO_SCRIPT_MAX_STANDARD 35
+
+/* Longest hash kept in a UTXO itself. */
+#define UTXO_SCRIPT_INLINE	20
+
 /**
  * utxo -- An unspent transaction output.
  *
@@ -137,8 +178,16 @@ struct input {
  * @height: the block height in which the transaction was mined
  * @txnum: the index of the transaction within the block
  * @type: guesses at output type
+ * @script_type: how the output script is stored (UTXO_SCRIPT_*)
+ * @script_cold: whether @script's bytes outside the UTXO are in the
+ *               disk store (see utxostore.h) rather than the UTXO map
  * @o: the output corresponding to this UTXO
- * 
+ * @script: the output script: the hash of a standard script if it
+ *          fits, or else where the key or raw script is in an arena
+ *
+ * Use utxo_script() to get the script back.  Only the 20-byte hashes
+ * of the commonest scripts are kept inline, so every UTXO doesn't pay
+ * for the longest.
  */
 struct utxo {
 	u8 txid[SHA256_DIGEST_LENGTH];
@@ -147,15 +196,27 @@ struct utxo {
 	unsigned int height;
 	unsigned int txnum;
 	u8  type;
+	u8  script_type;
+	u8  script_cold;
+	union {
+		u8 hash[UTXO_SCRIPT_INLINE];
+		struct {
+			u32 len;
+			u64 off;
+		} __attribute__((packed)) ext;
+	} script;
   u64 amount;
 };
 
+#define OP_0		0x00
 #define OP_PUSHDATA1	0x4C
 #define OP_PUSHDATA2	0x4D
 #define OP_PUSHDATA4	0x4E
+#define OP_1		0x51
 #define OP_NOP		0x61
 #define OP_RETURN	0x6A
 #define OP_DUP		0x76
+#define OP_EQUAL	0x87
 #define OP_EQUALVERIFY	0x88
 #define OP_CHECKSIG	0xAC
 #define OP_HASH160	0xA9
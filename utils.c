@@ -1,6 +1,8 @@
 #include <ccan/tal/tal.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/tal/str/str.h>
+#include <stdlib.h>
+#include <time.h>
 #include "utils.h"
 
 char *opt_set_hash(const char *arg, u8 *h)
@@ -17,6 +19,30 @@ char *opt_set_hash(const char *arg, u8 *h)
 	return NULL;
 }
 
+char *opt_set_time(const char *arg, unsigned long *t)
+{
+	static const char *formats[] = {
+		"%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S", "%Y-%m-%d"
+	};
+	struct tm tm;
+	char *end;
+	size_t i;
+
+	*t = strtoul(arg, &end, 10);
+	if (end != arg && !*end)
+		return NULL;
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(arg, formats[i], &tm);
+		if (end && !*end) {
+			*t = timegm(&tm);
+			return NULL;
+		}
+	}
+	return "Bad time (needs UNIX seconds or YYYY-MM-DD[THH:MM:SS] UTC)";
+}
+
 bool is_zero(u8 hash[SHA256_DIGEST_LENGTH])
 {
   unsigned int i;
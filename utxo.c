@@ -1,23 +1,686 @@
 #include <ccan/err/err.h>
+#include <assert.h>
+#include <stdlib.h>
 #include "utxo.h"
+#include "utxostore.h"
 #include "utils.h"
 #include "types.h"
 
-const u8 *keyof_utxo(const struct utxo *utxo)
+/* Grow once more than this fraction of slots are in use. */
+#define UTXO_MAP_LOAD_NUM 3
+#define UTXO_MAP_LOAD_DEN 4
+#define UTXO_MAP_MIN_SLOTS 1024
+/* Fewest changes in a block worth spreading over threads. */
+#define UTXO_SHARD_MIN_OPS 256
+/* Don't bother packing the raw script arena until the dead bytes are
+ * at least this fraction of the table it walks. */
+#define UTXO_SCRIPTS_DEAD_DEN 4
+
+/* What a standard script looks like around the hash (or key) in it. */
+static const struct script_template {
+	u8 prefix[3], prefix_len;
+	u8 hash_len;
+	u8 suffix[2], suffix_len;
+} script_templates[] = {
+	[UTXO_SCRIPT_P2PKH] = { { OP_DUP, OP_HASH160, 20 }, 3, 20,
+				{ OP_EQUALVERIFY, OP_CHECKSIG }, 2 },
+	[UTXO_SCRIPT_P2SH] = { { OP_HASH160, 20 }, 2, 20, { OP_EQUAL }, 1 },
+	[UTXO_SCRIPT_P2WPKH] = { { OP_0, 20 }, 2, 20 },
+	[UTXO_SCRIPT_P2WSH] = { { OP_0, 32 }, 2, 32 },
+	[UTXO_SCRIPT_P2TR] = { { OP_1, 32 }, 2, 32 },
+	[UTXO_SCRIPT_P2PK_EVEN] = { { 33, 0x02 }, 2, 32, { OP_CHECKSIG }, 1 },
+	[UTXO_SCRIPT_P2PK_ODD] = { { 33, 0x03 }, 2, 32, { OP_CHECKSIG }, 1 },
+};
+
+/* The txid is already a hash, but outputs of one transaction share
+ * it: mix in the index, then finalize (splitmix64). */
+static u64 utxo_hash(const u8 *txid, u32 index)
+{
+	u64 h;
+
+	memcpy(&h, txid, sizeof(h));
+	h ^= (u64)index * 0x9E3779B97F4A7C15ULL;
+	h ^= h >> 30;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 27;
+	h *= 0x94D049BB133111EBULL;
+	h ^= h >> 31;
+	return h;
+}
+
+/* Which shard a txid's UTXOs are in.  These bytes of the txid aren't
+ * the ones utxo_hash() mostly uses, so each shard's slots stay evenly
+ * used. */
+static size_t shard_num(const struct utxo_map *utxo_map, const u8 *txid)
+{
+	u32 v;
+
+	memcpy(&v, txid + 16, sizeof(v));
+	return v % utxo_map->num_shards;
+}
+
+static struct utxo_map *shard_for(const struct utxo_map *utxo_map,
+				  const u8 *txid)
+{
+	return &utxo_map->shards[shard_num(utxo_map, txid)];
+}
+
+static u8 utxo_tag(u64 h)
+{
+	return 0x80 | (h >> 57);
+}
+
+static size_t slots_for(size_t size)
+{
+	size_t num_slots = UTXO_MAP_MIN_SLOTS;
+
+	while (num_slots * UTXO_MAP_LOAD_NUM / UTXO_MAP_LOAD_DEN < size)
+		num_slots *= 2;
+	return num_slots;
+}
+
+static void alloc_slots(struct utxo_map *utxo_map, size_t num_slots)
+{
+	utxo_map->ctrl = calloc(num_slots, sizeof(*utxo_map->ctrl));
+	utxo_map->entries = malloc(num_slots * sizeof(*utxo_map->entries));
+	if (!utxo_map->ctrl || !utxo_map->entries)
+		err(1, "Allocating %zu UTXO slots", num_slots);
+	utxo_map->mask = num_slots - 1;
+	utxo_map->count = 0;
+}
+
+void utxo_map_init_sized(struct utxo_map *utxo_map, size_t size)
+{
+	alloc_slots(utxo_map, slots_for(size));
+	utxo_map->cold = NULL;
+	utxo_map->hot_max = 0;
+	utxo_map->shards = NULL;
+	utxo_map->num_shards = 0;
+	utxo_map->scripts = NULL;
+	utxo_map->scripts_len = utxo_map->scripts_cap = 0;
+	utxo_map->scripts_dead = 0;
+}
+
+void utxo_map_init(struct utxo_map *utxo_map)
+{
+	utxo_map_init_sized(utxo_map, 0);
+}
+
+void utxo_map_init_disk(struct utxo_map *utxo_map, const char *dir,
+			size_t hot_max)
+{
+	utxo_map_init(utxo_map);
+	utxo_map->cold = utxo_store_new(NULL, dir);
+	utxo_map->hot_max = hot_max;
+}
+
+void utxo_map_init_sharded(struct utxo_map *utxo_map, size_t num_shards,
+			   const char *dir, size_t hot_max)
+{
+	size_t i;
+
+	utxo_map->ctrl = NULL;
+	utxo_map->entries = NULL;
+	utxo_map->mask = utxo_map->count = 0;
+	utxo_map->cold = NULL;
+	utxo_map->hot_max = 0;
+	utxo_map->scripts = NULL;
+	utxo_map->scripts_len = utxo_map->scripts_cap = 0;
+	utxo_map->scripts_dead = 0;
+	utxo_map->num_shards = num_shards;
+	utxo_map->shards = malloc(num_shards * sizeof(*utxo_map->shards));
+	if (!utxo_map->shards)
+		err(1, "Allocating %zu UTXO shards", num_shards);
+	for (i = 0; i < num_shards; i++) {
+		if (dir)
+			utxo_map_init_disk(&utxo_map->shards[i], dir,
+					   hot_max / num_shards + 1);
+		else
+			utxo_map_init(&utxo_map->shards[i]);
+	}
+}
+
+void utxo_map_clear(struct utxo_map *utxo_map)
+{
+	size_t i;
+
+	for (i = 0; i < utxo_map->num_shards; i++)
+		utxo_map_clear(&utxo_map->shards[i]);
+	free(utxo_map->shards);
+	utxo_map->shards = NULL;
+	utxo_map->num_shards = 0;
+	free(utxo_map->ctrl);
+	free(utxo_map->entries);
+	utxo_map->ctrl = NULL;
+	utxo_map->entries = NULL;
+	utxo_map->mask = utxo_map->count = 0;
+	utxo_map->cold = tal_free(utxo_map->cold);
+	free(utxo_map->scripts);
+	utxo_map->scripts = NULL;
+	utxo_map->scripts_len = utxo_map->scripts_cap = 0;
+	utxo_map->scripts_dead = 0;
+}
+
+void utxo_map_reset(struct utxo_map *utxo_map)
+{
+	size_t i;
+
+	if (utxo_map->shards) {
+		for (i = 0; i < utxo_map->num_shards; i++)
+			utxo_map_reset(&utxo_map->shards[i]);
+		return;
+	}
+	memset(utxo_map->ctrl, 0, utxo_map->mask + 1);
+	utxo_map->count = 0;
+	utxo_map->scripts_len = utxo_map->scripts_dead = 0;
+	if (utxo_map->cold)
+		utxo_store_reset(utxo_map->cold);
+}
+
+size_t utxo_map_count(const struct utxo_map *utxo_map)
+{
+	size_t i, count = 0;
+
+	if (utxo_map->shards) {
+		for (i = 0; i < utxo_map->num_shards; i++)
+			count += utxo_map_count(&utxo_map->shards[i]);
+		return count;
+	}
+	return utxo_map->count
+		+ (utxo_map->cold ? utxo_store_count(utxo_map->cold) : 0);
+}
+
+/* Slot holding this key, or the empty slot ending its probe. */
+static size_t find_slot(const struct utxo_map *utxo_map,
+			const u8 *txid, u32 index, u64 h)
+{
+	size_t slot = h & utxo_map->mask;
+	u8 tag = utxo_tag(h);
+
+	while (utxo_map->ctrl[slot]) {
+		const struct utxo *u = &utxo_map->entries[slot];
+
+		if (utxo_map->ctrl[slot] == tag && u->index == index
+		    && memcmp(u->txid, txid, sizeof(u->txid)) == 0)
+			break;
+		slot = (slot + 1) & utxo_map->mask;
+	}
+	return slot;
+}
+
+/* Is the UTXO's script (or its hash) in the arena, not the UTXO? */
+static bool script_in_arena(const struct utxo *u)
+{
+	return script_templates[u->script_type].hash_len > UTXO_SCRIPT_INLINE
+		|| u->script_type == UTXO_SCRIPT_RAW;
+}
+
+/* Notes that a UTXO's bytes in the arena (if any) are no longer used. */
+static void release_script(struct utxo_map *utxo_map, const struct utxo *u)
+{
+	if (script_in_arena(u))
+		utxo_map->scripts_dead += u->script.ext.len;
+}
+
+/* Packs the live scripts together, once most of the arena is dead. */
+static void compact_scripts(struct utxo_map *utxo_map)
+{
+	size_t i, len = 0, live = utxo_map->scripts_len - utxo_map->scripts_dead;
+	u8 *scripts;
+
+	if (utxo_map->scripts_dead < (utxo_map->mask + 1) * sizeof(struct utxo)
+				     / UTXO_SCRIPTS_DEAD_DEN
+	    || utxo_map->scripts_dead < live)
+		return;
+
+	scripts = malloc(live ? live : 1);
+	if (!scripts)
+		err(1, "Allocating %zu bytes of UTXO scripts", live);
+	/* Only UTXOs in memory use the map's arena. */
+	for (i = 0; i <= utxo_map->mask; i++) {
+		struct utxo *u = &utxo_map->entries[i];
+
+		if (!utxo_map->ctrl[i] || !script_in_arena(u) || !u->script.ext.len)
+			continue;
+		memcpy(scripts + len, utxo_map->scripts + u->script.ext.off,
+		       u->script.ext.len);
+		u->script.ext.off = len;
+		len += u->script.ext.len;
+	}
+	free(utxo_map->scripts);
+	utxo_map->scripts = scripts;
+	utxo_map->scripts_len = utxo_map->scripts_cap = len;
+	utxo_map->scripts_dead = 0;
+}
+
+/* Moves the entries to a table of this many slots, except that any
+ * below height @spill_below go to the cold store instead. */
+static void rehash(struct utxo_map *utxo_map, size_t num_slots,
+		   unsigned int spill_below)
+{
+	u8 *old_ctrl = utxo_map->ctrl;
+	struct utxo *old_entries = utxo_map->entries;
+	size_t i, old_slots = utxo_map->mask + 1;
+
+	alloc_slots(utxo_map, num_slots);
+	for (i = 0; i < old_slots; i++) {
+		const struct utxo *u = &old_entries[i];
+		u64 h;
+		size_t slot;
+
+		if (!old_ctrl[i])
+			continue;
+		h = utxo_hash(u->txid, u->index);
+		if (u->height < spill_below) {
+			/* Its script bytes go to disk with it. */
+			utxo_store_add(utxo_map->cold, u, h,
+				       script_in_arena(u) && u->script.ext.len
+				       ? utxo_map->scripts + u->script.ext.off
+				       : NULL);
+			release_script(utxo_map, u);
+			continue;
+		}
+		for (slot = h & utxo_map->mask;
+		     utxo_map->ctrl[slot];
+		     slot = (slot + 1) & utxo_map->mask);
+		utxo_map->ctrl[slot] = utxo_tag(h);
+		utxo_map->entries[slot] = *u;
+		utxo_map->count++;
+	}
+	free(old_ctrl);
+	free(old_entries);
+}
+
+/* Moves at least the older half of the in-memory UTXOs to disk. */
+static void spill(struct utxo_map *utxo_map)
+{
+	unsigned int min = -1U, max = 0, below;
+	size_t i, *counts, seen = 0;
+
+	for (i = 0; i <= utxo_map->mask; i++) {
+		if (!utxo_map->ctrl[i])
+			continue;
+		if (utxo_map->entries[i].height < min)
+			min = utxo_map->entries[i].height;
+		if (utxo_map->entries[i].height > max)
+			max = utxo_map->entries[i].height;
+	}
+
+	counts = calloc(max - min + 1, sizeof(*counts));
+	if (!counts)
+		err(1, "Allocating UTXO height histogram");
+	for (i = 0; i <= utxo_map->mask; i++) {
+		if (utxo_map->ctrl[i])
+			counts[utxo_map->entries[i].height - min]++;
+	}
+	for (below = min; seen < utxo_map->count / 2; below++)
+		seen += counts[below - min];
+	if (below == min)
+		below++;
+	free(counts);
+
+	rehash(utxo_map, utxo_map->mask + 1, below);
+	compact_scripts(utxo_map);
+}
+
+void utxo_map_reserve(struct utxo_map *utxo_map, size_t size)
+{
+	size_t i, num_slots;
+
+	if (utxo_map->shards) {
+		for (i = 0; i < utxo_map->num_shards; i++)
+			utxo_map_reserve(&utxo_map->shards[i],
+					 size / utxo_map->num_shards + 1);
+		return;
+	}
+	if (utxo_map->cold && size > utxo_map->hot_max)
+		size = utxo_map->hot_max;
+	num_slots = slots_for(utxo_map->count + size);
+	if (num_slots > utxo_map->mask + 1)
+		rehash(utxo_map, num_slots, 0);
+}
+
+struct utxo *utxo_map_add(struct utxo_map *utxo_map, const u8 *txid, u32 index)
+{
+	struct utxo *u;
+	u64 h;
+	size_t slot;
+
+	if (utxo_map->shards)
+		utxo_map = shard_for(utxo_map, txid);
+	h = utxo_hash(txid, index);
+
+	if (utxo_map->cold && utxo_map->count >= utxo_map->hot_max)
+		spill(utxo_map);
+	if ((utxo_map->count + 1) * UTXO_MAP_LOAD_DEN
+	    > (utxo_map->mask + 1) * UTXO_MAP_LOAD_NUM)
+		rehash(utxo_map, (utxo_map->mask + 1) * 2, 0);
+
+	slot = find_slot(utxo_map, txid, index, h);
+	u = &utxo_map->entries[slot];
+	if (!utxo_map->ctrl[slot]) {
+		utxo_map->ctrl[slot] = utxo_tag(h);
+		memcpy(u->txid, txid, sizeof(u->txid));
+		u->index = index;
+		utxo_map->count++;
+	} else
+		release_script(utxo_map, u);
+	u->script_type = UTXO_SCRIPT_RAW;
+	u->script_cold = false;
+	u->script.ext.len = 0;
+	u->script.ext.off = 0;
+	return u;
+}
+
+/* Which standard script this is, if any. */
+static u8 script_type(const u8 *script, size_t len)
+{
+	u8 type;
+
+	for (type = UTXO_SCRIPT_P2PKH; type <= UTXO_SCRIPT_P2PK_ODD; type++) {
+		const struct script_template *t = &script_templates[type];
+
+		if (len == t->prefix_len + t->hash_len + t->suffix_len
+		    && memcmp(script, t->prefix, t->prefix_len) == 0
+		    && memcmp(script + len - t->suffix_len, t->suffix,
+			      t->suffix_len) == 0)
+			return type;
+	}
+	return UTXO_SCRIPT_RAW;
+}
+
+void utxo_set_script(struct utxo_map *utxo_map, struct utxo *u,
+		     const u8 *script, size_t len)
+{
+	const struct script_template *t;
+
+	u->script_type = script_type(script, len);
+	u->script_cold = false;
+	t = &script_templates[u->script_type];
+	/* Standard scripts keep just their hash (or key). */
+	if (u->script_type != UTXO_SCRIPT_RAW) {
+		script += t->prefix_len;
+		len = t->hash_len;
+	}
+	if (!script_in_arena(u)) {
+		memcpy(u->script.hash, script, len);
+		return;
+	}
+
+	u->script.ext.len = len;
+	u->script.ext.off = 0;
+	if (!len)
+		return;
+
+	if (utxo_map->shards)
+		utxo_map = shard_for(utxo_map, u->txid);
+	if (utxo_map->scripts_len + len > utxo_map->scripts_cap) {
+		size_t cap = utxo_map->scripts_cap * 2;
+
+		if (cap < utxo_map->scripts_len + len)
+			cap = utxo_map->scripts_len + len;
+		utxo_map->scripts = realloc(utxo_map->scripts, cap);
+		if (!utxo_map->scripts)
+			err(1, "Allocating %zu bytes of UTXO scripts", cap);
+		utxo_map->scripts_cap = cap;
+	}
+	memcpy(utxo_map->scripts + utxo_map->scripts_len, script, len);
+	u->script.ext.off = utxo_map->scripts_len;
+	utxo_map->scripts_len += len;
+}
+
+const u8 *utxo_script(const struct utxo_map *utxo_map, const struct utxo *u,
+		      u8 buf[UTXO_SCRIPT_MAX_STANDARD], size_t *len)
+{
+	const struct script_template *t = &script_templates[u->script_type];
+	const u8 *hash = u->script.hash;
+
+	if (script_in_arena(u)) {
+		if (utxo_map->shards)
+			utxo_map = shard_for(utxo_map, u->txid);
+		/* Only raw scripts can be empty. */
+		*len = u->script.ext.len;
+		if (!*len)
+			return buf;
+		if (u->script_cold)
+			hash = utxo_store_script(utxo_map->cold, u);
+		else
+			hash = utxo_map->scripts + u->script.ext.off;
+		if (u->script_type == UTXO_SCRIPT_RAW)
+			return hash;
+	}
+	memcpy(buf, t->prefix, t->prefix_len);
+	memcpy(buf + t->prefix_len, hash, t->hash_len);
+	memcpy(buf + t->prefix_len + t->hash_len, t->suffix, t->suffix_len);
+	*len = t->prefix_len + t->hash_len + t->suffix_len;
+	return buf;
+}
+
+struct utxo *utxo_map_get(const struct utxo_map *utxo_map, const u8 *txid, u32 index)
+{
+	u64 h;
+	size_t slot;
+
+	if (utxo_map->shards)
+		utxo_map = shard_for(utxo_map, txid);
+	h = utxo_hash(txid, index);
+	slot = find_slot(utxo_map, txid, index, h);
+
+	if (utxo_map->ctrl[slot])
+		return &utxo_map->entries[slot];
+	if (utxo_map->cold)
+		return utxo_store_get(utxo_map->cold, txid, index, h);
+	return NULL;
+}
+
+/* Looks up to UTXO_MAP_BATCH inputs' UTXOs, prefetching them all
+ * first so the cache misses overlap. */
+static void lookup_batch(const struct utxo_map *utxo_map,
+			 const struct input *const *inputs, size_t num,
+			 struct utxo **found)
+{
+	const struct utxo_map *maps[UTXO_MAP_BATCH];
+	u64 h[UTXO_MAP_BATCH];
+	size_t j;
+
+	for (j = 0; j < num; j++) {
+		size_t slot;
+
+		maps[j] = utxo_map->shards
+			? shard_for(utxo_map, inputs[j]->txid) : utxo_map;
+		h[j] = utxo_hash(inputs[j]->txid, inputs[j]->index);
+		slot = h[j] & maps[j]->mask;
+		__builtin_prefetch(&maps[j]->ctrl[slot]);
+		__builtin_prefetch(&maps[j]->entries[slot]);
+	}
+	for (j = 0; j < num; j++) {
+		size_t slot = find_slot(maps[j], inputs[j]->txid,
+					inputs[j]->index, h[j]);
+
+		found[j] = maps[j]->ctrl[slot] ? &maps[j]->entries[slot] : NULL;
+	}
+	/* Same again on disk for the misses. */
+	for (j = 0; j < num; j++) {
+		if (!found[j] && maps[j]->cold)
+			utxo_store_prefetch(maps[j]->cold, h[j]);
+	}
+	for (j = 0; j < num; j++) {
+		if (!found[j] && maps[j]->cold)
+			found[j] = utxo_store_get(maps[j]->cold,
+						  inputs[j]->txid,
+						  inputs[j]->index, h[j]);
+	}
+}
+
+void utxo_map_get_batch(const struct utxo_map *utxo_map,
+			const struct input *inputs, size_t n,
+			struct utxo **found)
+{
+	const struct input *batch[UTXO_MAP_BATCH];
+	size_t i, j, num;
+
+	for (i = 0; i < n; i += num) {
+		num = n - i < UTXO_MAP_BATCH ? n - i : UTXO_MAP_BATCH;
+		for (j = 0; j < num; j++)
+			batch[j] = &inputs[i+j];
+		lookup_batch(utxo_map, batch, num, found + i);
+	}
+}
+
+static void resolve_batch(const struct utxo_map *utxo_map,
+			  struct input **batch, size_t num)
+{
+	struct utxo *found[UTXO_MAP_BATCH];
+	size_t j;
+
+	lookup_batch(utxo_map, (const struct input *const *)batch, num, found);
+	for (j = 0; j < num; j++)
+		batch[j]->prevout = found[j];
+}
+
+void resolve_block_prevouts(const struct utxo_map *utxo_map,
+			    struct transaction *tx, size_t n)
+{
+	struct input *batch[UTXO_MAP_BATCH];
+	size_t i, j, num = 0;
+
+	/* Batches run across transactions, which mostly have few inputs.
+	 * Coinbase inputs are not real. */
+	for (i = 1; i < n; i++) {
+		for (j = 0; j < tx[i].input_count; j++) {
+			batch[num++] = &tx[i].input[j];
+			if (num == UTXO_MAP_BATCH) {
+				resolve_batch(utxo_map, batch, num);
+				num = 0;
+			}
+		}
+	}
+	resolve_batch(utxo_map, batch, num);
+}
+
+/* Empties a slot, shifting back later entries of its probe run which
+ * may then be found earlier (so no tombstones are needed). */
+static void delete_slot(struct utxo_map *utxo_map, size_t hole)
+{
+	size_t slot = hole;
+
+	for (;;) {
+		const struct utxo *u;
+		size_t home;
+
+		slot = (slot + 1) & utxo_map->mask;
+		if (!utxo_map->ctrl[slot])
+			break;
+		u = &utxo_map->entries[slot];
+		home = utxo_hash(u->txid, u->index) & utxo_map->mask;
+		/* Stays put if its home lies cyclically in (hole, slot]. */
+		if (((slot - home) & utxo_map->mask) < ((slot - hole) & utxo_map->mask))
+			continue;
+		utxo_map->ctrl[hole] = utxo_map->ctrl[slot];
+		utxo_map->entries[hole] = *u;
+		hole = slot;
+	}
+	utxo_map->ctrl[hole] = 0;
+	utxo_map->count--;
+}
+
+bool utxo_map_delkey(struct utxo_map *utxo_map, const u8 *txid, u32 index)
+{
+	u64 h;
+	size_t slot;
+
+	if (utxo_map->shards)
+		utxo_map = shard_for(utxo_map, txid);
+	h = utxo_hash(txid, index);
+	slot = find_slot(utxo_map, txid, index, h);
+
+	if (!utxo_map->ctrl[slot])
+		return utxo_map->cold
+			&& utxo_store_del(utxo_map->cold, txid, index, h);
+	release_script(utxo_map, &utxo_map->entries[slot]);
+	delete_slot(utxo_map, slot);
+	compact_scripts(utxo_map);
+	return true;
+}
+
+struct utxo *utxo_map_next(const struct utxo_map *utxo_map,
+			   struct utxo_map_iter *it)
 {
-  return utxo->txid;
+	if (utxo_map->shards) {
+		for (; it->shard < utxo_map->num_shards; it->shard++) {
+			struct utxo *u = utxo_map_next(&utxo_map->shards[it->shard], it);
+			if (u)
+				return u;
+			it->i = 0;
+		}
+		return NULL;
+	}
+	while (it->i <= utxo_map->mask) {
+		size_t i = it->i++;
+
+		if (utxo_map->ctrl[i])
+			return &utxo_map->entries[i];
+	}
+	/* Then the log positions of the cold store, after the slots. */
+	if (utxo_map->cold) {
+		size_t pos = it->i - (utxo_map->mask + 1);
+		struct utxo *u = utxo_store_next(utxo_map->cold, &pos);
+
+		it->i = pos + utxo_map->mask + 1;
+		return u;
+	}
+	return NULL;
+}
+
+struct utxo *utxo_map_first(const struct utxo_map *utxo_map,
+			    struct utxo_map_iter *it)
+{
+	it->shard = 0;
+	it->i = 0;
+	return utxo_map_next(utxo_map, it);
+}
+
+static size_t utxo_map_total(const struct utxo_map *utxo_map)
+{
+	size_t i, n = 0;
+
+	if (utxo_map->shards) {
+		for (i = 0; i < utxo_map->num_shards; i++)
+			n += utxo_map_total(&utxo_map->shards[i]);
+		return n;
+	}
+	return utxo_map->count
+		+ (utxo_map->cold ? utxo_store_count(utxo_map->cold) : 0);
 }
 
-size_t hashof_utxo(const u8 *key)
+/* Creation order: by block, then transaction, then output. */
+static int utxo_order_cmp(const void *a, const void *b)
 {
-  size_t ret;
-  memcpy(&ret, key, (SHA256_DIGEST_LENGTH + 1) * sizeof(u32));
-  return ret;
+	const struct utxo *ua = *(struct utxo * const *)a;
+	const struct utxo *ub = *(struct utxo * const *)b;
+
+	if (ua->height != ub->height)
+		return ua->height < ub->height ? -1 : 1;
+	if (ua->txnum != ub->txnum)
+		return ua->txnum < ub->txnum ? -1 : 1;
+	if (ua->index != ub->index)
+		return ua->index < ub->index ? -1 : 1;
+	return 0;
 }
 
-bool utxohash_eq(const struct utxo *utxo, const u8 *key)
+struct utxo **utxo_map_sorted(const tal_t *ctx, const struct utxo_map *utxo_map)
 {
-  return memcmp(&utxo->txid, key, sizeof(utxo->txid) + sizeof(utxo->index)) == 0;
+	struct utxo **utxos = tal_arr(ctx, struct utxo *,
+				      utxo_map_total(utxo_map));
+	struct utxo_map_iter it;
+	struct utxo *u;
+	size_t n = 0;
+
+	for (u = utxo_map_first(utxo_map, &it); u; u = utxo_map_next(utxo_map, &it))
+		utxos[n++] = u;
+	assert(n == tal_count(utxos));
+	qsort(utxos, n, sizeof(*utxos), utxo_order_cmp);
+	return utxos;
 }
 
 bool is_unspendable(const struct output *o)
@@ -53,8 +716,7 @@ static void guess_output_types(const struct transaction *t, u8 *types)
   memset(types, UNKNOWN_OUTPUT, t->output_count);
 }
 
-static void add_utxo(const tal_t *tal_ctx,
-	      struct utxo_map *utxo_map,
+static void add_utxo(struct utxo_map *utxo_map,
 	      const struct block *b,
 	      const struct transaction *t,
 	      u32 txnum,
@@ -66,19 +728,17 @@ static void add_utxo(const tal_t *tal_ctx,
 	  return;
 	}
 	struct utxo *utxo;
-  utxo = tal_alloc_(tal_ctx, sizeof(*utxo), false, TAL_LABEL(struct utxo, ""));
-  memcpy(utxo->txid, t->txid, sizeof(utxo->txid));
-	utxo->index     = index;
+  utxo = utxo_map_add(utxo_map, t->txid, index);
   utxo->height    = b->height;
   utxo->timestamp = b->bh.timestamp;
 	utxo->txnum     = txnum;
 	utxo->amount    = t->output[index].amount;
 	utxo->type      = types[index];
-	utxo_map_add(utxo_map, utxo);
+	utxo_set_script(utxo_map, utxo, t->output[index].script,
+			t->output[index].script_length);
 }
 
-void add_utxos(const tal_t *tal_ctx,
-	       struct utxo_map *utxo_map,
+void add_utxos(struct utxo_map *utxo_map,
 	       const struct block *b,
 	       const struct transaction *t,
 	       u32 txnum)
@@ -87,19 +747,131 @@ void add_utxos(const tal_t *tal_ctx,
   u8 types[t->output_count];
   guess_output_types(t, types);
   for (i=0; i<t->output_count; i++) {
-	  add_utxo(tal_ctx, utxo_map, b, t, txnum, i, types);
+	  add_utxo(utxo_map, b, t, txnum, i, types);
 	}
 }
 
-void release_utxo(struct utxo_map *utxo_map, const struct input *i)
+/* Removes the UTXOs spent by some inputs. */
+static void release_inputs(struct utxo_map *utxo_map,
+			   const struct input *inputs, size_t n)
 {
-  struct utxo *utxo;
+  struct utxo *found[UTXO_MAP_BATCH];
+  size_t i, j, num;
 
-  utxo = utxo_map_get(utxo_map, i->txid);
-  if (!utxo) {
-	  errx(1, "Unknown utxo for transaction "SHA_FMT" output %i", SHA_VALS(i->txid), i->index);
-	}
+  /* Deleting moves entries, so look up (and prefetch) a batch first,
+   * then delete each by key while its cache lines are warm. */
+  for (i = 0; i < n; i += num) {
+    num = n - i < UTXO_MAP_BATCH ? n - i : UTXO_MAP_BATCH;
+    utxo_map_get_batch(utxo_map, &inputs[i], num, found);
+    for (j = 0; j < num; j++) {
+      const struct input *in = &inputs[i+j];
+
+      if (!found[j] || !utxo_map_delkey(utxo_map, in->txid, in->index))
+	errx(1, "Unknown utxo for transaction "SHA_FMT" output %i", SHA_VALS(in->txid), in->index);
+    }
+  }
+}
+
+void release_utxos(struct utxo_map *utxo_map, const struct transaction *t)
+{
+  release_inputs(utxo_map, t->input, t->input_count);
+}
+
+/**
+ * block_utxos - A block's changes to a UTXO map.
+ *
+ * @utxo_map: the map
+ * @b: the block
+ * @tx: the block's transactions
+ * @n: number of @tx
+ *
+ * Each task applies the changes for one shard (or all of them, for an
+ * unsharded map), in block order.
+ */
+struct block_utxos {
+  struct utxo_map *utxo_map;
+  const struct block *b;
+  const struct transaction *tx;
+  size_t n;
+};
+
+static void add_shard_utxos(void *arg, size_t task)
+{
+  struct block_utxos *bu = arg;
+  struct utxo_map *utxo_map = bu->utxo_map;
+  size_t i;
+
+  if (utxo_map->shards)
+    utxo_map = &utxo_map->shards[task];
+  for (i = 0; i < bu->n; i++) {
+    if (bu->utxo_map->shards && shard_num(bu->utxo_map, bu->tx[i].txid) != task)
+      continue;
+    add_utxos(utxo_map, bu->b, &bu->tx[i], i);
+  }
+}
+
+static void release_shard_utxos(void *arg, size_t task)
+{
+  struct block_utxos *bu = arg;
+  struct utxo_map *utxo_map = bu->utxo_map;
+  struct input batch[UTXO_MAP_BATCH];
+  size_t i, j, num = 0;
+
+  if (!utxo_map->shards) {
+    for (i = 1; i < bu->n; i++)
+      release_utxos(utxo_map, &bu->tx[i]);
+    return;
+  }
+
+  /* Gather this shard's inputs into batches, so lookups still overlap. */
+  for (i = 1; i < bu->n; i++) {
+    for (j = 0; j < bu->tx[i].input_count; j++) {
+      const struct input *in = &bu->tx[i].input[j];
+
+      if (shard_num(utxo_map, in->txid) != task)
+	continue;
+      batch[num++] = *in;
+      if (num == UTXO_MAP_BATCH) {
+	release_inputs(&utxo_map->shards[task], batch, num);
+	num = 0;
+      }
+    }
+  }
+  release_inputs(&utxo_map->shards[task], batch, num);
+}
+
+/* Runs a task for each shard, on the pool if there's enough to do. */
+static void run_shards(struct utxo_map *utxo_map, struct thread_pool *pool,
+		       size_t num_ops, void (*fn)(void *arg, size_t task),
+		       struct block_utxos *bu)
+{
+  if (!utxo_map->shards) {
+    fn(bu, 0);
+    return;
+  }
+  thread_pool_run(num_ops < UTXO_SHARD_MIN_OPS ? NULL : pool,
+		  utxo_map->num_shards, fn, bu);
+}
+
+void add_block_utxos(struct utxo_map *utxo_map, struct thread_pool *pool,
+		     const struct block *b,
+		     const struct transaction *tx, size_t n)
+{
+  struct block_utxos bu = { utxo_map, b, tx, n };
+  size_t i, num_ops = 0;
+
+  for (i = 0; i < n; i++)
+    num_ops += tx[i].output_count;
+  run_shards(utxo_map, pool, num_ops, add_shard_utxos, &bu);
+}
+
+void release_block_utxos(struct utxo_map *utxo_map, struct thread_pool *pool,
+			 const struct transaction *tx, size_t n)
+{
+  struct block_utxos bu = { utxo_map, NULL, tx, n };
+  size_t i, num_ops = 0;
 
-  utxo_map_del(utxo_map, utxo);
-  tal_free(utxo);
+  for (i = 1; i < n; i++)
+    num_ops += tx[i].input_count;
+  run_shards(utxo_map, pool, num_ops, release_shard_utxos, &bu);
 }
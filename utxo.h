@@ -2,81 +2,302 @@
 #define BITCOIN_ITERATE_UTXO_H
 #include <sys/types.h>
 #include <ccan/tal/tal.h>
-#include <ccan/htable/htable_type.h>
 #include <ccan/short_types/short_types.h>
 #include "types.h"
 #include "utils.h"
+#include "threadpool.h"
+
+/* Lookups to prefetch ahead in batched operations. */
+#define UTXO_MAP_BATCH 16
+
+struct utxo_store;
+
+/**
+ * utxo_map - The set of unspent outputs, keyed by (txid, index).
+ *
+ * @ctrl: one byte per slot: 0 if empty, otherwise 0x80 plus 7 bits
+ *        of the entry's hash (so most mismatches never touch @entries)
+ * @entries: the UTXOs themselves, stored inline
+ * @mask: number of slots, minus one
+ * @count: number of UTXOs in memory
+ * @cold: with the disk backend, the UTXOs spilled to disk (else NULL)
+ * @hot_max: with the disk backend, most UTXOs to keep in memory
+ * @shards: if not NULL, the map holds no UTXOs itself: each is in the
+ *          shard its txid picks, and every function here uses that
+ * @num_shards: number of @shards
+ * @scripts: arena of the keys and raw scripts too long for the UTXOs
+ * @scripts_len: bytes used in @scripts
+ * @scripts_cap: bytes allocated for @scripts
+ * @scripts_dead: bytes of @scripts belonging to spent UTXOs
+ *
+ * An open-addressed (linear probing) table hashing both the txid and
+ * the output index.  Deletion shifts later entries back rather than
+ * leaving tombstones, so pointers to entries are only valid until the
+ * map is next changed.
+ *
+ * With the disk backend, once @hot_max UTXOs are in memory the older
+ * half (by height) are moved to @cold: most spends are of recent
+ * outputs, so most lookups still stay in memory.
+ *
+ * A sharded map's shards are independent maps, so a block's changes
+ * can be applied to all of them at once (see add_block_utxos()).
+ *
+ * Output scripts are kept like Bitcoin Core does in its coins
+ * database: standard scripts are reduced to a type and the hash (or
+ * key) they pay to.  20-byte hashes are kept in the UTXO itself; the
+ * 32-byte ones and any other scripts are copied to @scripts.
+ * Spent scripts are left where they are until most of @scripts is
+ * dead, then the live ones are packed together again.  With the disk
+ * backend, a UTXO's bytes in @scripts move to disk along with it.
+ */
+struct utxo_map {
+	u8 *ctrl;
+	struct utxo *entries;
+	size_t mask;
+	size_t count;
+	struct utxo_store *cold;
+	size_t hot_max;
+	struct utxo_map *shards;
+	size_t num_shards;
+	u8 *scripts;
+	size_t scripts_len, scripts_cap, scripts_dead;
+};
+
+struct utxo_map_iter {
+	size_t shard;
+	size_t i;
+};
+
+/**
+ * Initializes an empty UTXO map.
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ */
+void utxo_map_init(struct utxo_map *utxo_map);
+
+/**
+ * Initializes an empty UTXO map with room for some number of UTXOs.
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param size     -- expected number of UTXOs
+ */
+void utxo_map_init_sized(struct utxo_map *utxo_map, size_t size);
+
+/**
+ * Initializes an empty UTXO map which keeps at most some number of
+ * UTXOs in memory, and the rest in files in a directory.
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param dir      -- directory for the (unlinked) files
+ *  @param hot_max  -- most UTXOs to keep in memory
+ */
+void utxo_map_init_disk(struct utxo_map *utxo_map, const char *dir,
+			size_t hot_max);
 
 /**
- * This function is used to map UTXO structs to keys in the utxo_map.
+ * Initializes an empty UTXO map split into shards by txid, each with
+ * the memory or disk backend.
  *
- * @param utxo -- pointer to a UTXO struct 
- * @return pointer to the UTXO struct's `txid` member
- * 
+ *  @param utxo_map   -- pointer to the utxo map
+ *  @param num_shards -- number of shards
+ *  @param dir        -- directory for the disk backend (NULL for memory)
+ *  @param hot_max    -- with the disk backend, most UTXOs to keep in
+ *                       memory (shared equally between the shards)
  */
-const u8 *keyof_utxo(const struct utxo *utxo);
+void utxo_map_init_sharded(struct utxo_map *utxo_map, size_t num_shards,
+			   const char *dir, size_t hot_max);
 
 /**
- * This function is used to map UTXO structs keys to hash values
- * utxo_map.
+ * Makes room for some number of UTXOs, so adding them doesn't need
+ * the map to be resized repeatedly.
  *
- * Reads the contents of the transaction TXID as well as the output
- * index (which are laid out sequentially in the `utxo` struct).
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param size     -- expected number of UTXOs
+ */
+void utxo_map_reserve(struct utxo_map *utxo_map, size_t size);
+
+/**
+ * Removes every UTXO from the map, keeping its backend.
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ */
+void utxo_map_reset(struct utxo_map *utxo_map);
+
+/**
+ * Returns the number of UTXOs in the map.
  *
- *  @param key -- pointer to a UTXO's key (its `txid` member)
+ *  @param utxo_map -- pointer to the utxo map
  */
-size_t hashof_utxo(const u8 *key);
+size_t utxo_map_count(const struct utxo_map *utxo_map);
 
 /**
- * Does the given UTXO match the given key/hash?
+ * Frees the UTXO map's memory.  It must be initialized again before
+ * it is used.
  *
- *  @param utxo -- pointer to a UTXO struct
- *  @param key  -- pointer to a SHA256 block hash
+ *  @param utxo_map -- pointer to the utxo map
  */
-bool utxohash_eq(const struct utxo *utxo, const u8 *key);
+void utxo_map_clear(struct utxo_map *utxo_map);
 
 /**
- * Defines the utxo_map and the following methods:
+ * Adds a UTXO to the map and returns it, with its txid and index
+ * set and an empty script; the caller fills in the rest.  If the
+ * UTXO is already present it is returned to be overwritten (as
+ * bitcoind does for duplicate coinbase transactions), unless the
+ * disk backend has spilled it.
  *
- *   utxo_map_init
- *   utxo_map_clear
- *   utxo_map_add
- *   utxo_map_del
- *   utxo_map_get
- *   utxo_map_first
- *   utxo_map_next
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param txid     -- TXID of the transaction containing the UTXO
+ *  @param index    -- index of the output within that transaction
+ */
+struct utxo *utxo_map_add(struct utxo_map *utxo_map, const u8 *txid, u32 index);
+
+/**
+ * Sets the output script of a UTXO just added to the map, compressing
+ * it if it is standard.
  *
- * See ccan/htable/htable_type.h for more details.
- * 
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param u        -- the UTXO, as returned by utxo_map_add()
+ *  @param script   -- the output script
+ *  @param len      -- length of the script
  */
-HTABLE_DEFINE_TYPE(struct utxo, keyof_utxo, hash_sha, utxohash_eq, utxo_map);
+void utxo_set_script(struct utxo_map *utxo_map, struct utxo *u,
+		     const u8 *script, size_t len);
+
+/**
+ * Returns a UTXO's output script: either expanded into a buffer, or
+ * in the map's arena (valid until the map next changes).
+ *
+ *  @param utxo_map -- pointer to the utxo map holding the UTXO
+ *  @param u        -- the UTXO
+ *  @param buf      -- buffer for a standard script
+ *  @param len      -- set to the length of the script
+ */
+const u8 *utxo_script(const struct utxo_map *utxo_map, const struct utxo *u,
+		      u8 buf[UTXO_SCRIPT_MAX_STANDARD], size_t *len);
+
+/**
+ * Finds a UTXO (NULL if not present).
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param txid     -- TXID of the transaction containing the UTXO
+ *  @param index    -- index of the output within that transaction
+ */
+struct utxo *utxo_map_get(const struct utxo_map *utxo_map, const u8 *txid, u32 index);
+
+/**
+ * Finds the UTXOs spent by some inputs, prefetching ahead so lookups
+ * overlap their cache misses.
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param inputs   -- array of inputs
+ *  @param n        -- number of inputs
+ *  @param found    -- set to each input's UTXO (or NULL if not present)
+ */
+void utxo_map_get_batch(const struct utxo_map *utxo_map,
+			const struct input *inputs, size_t n,
+			struct utxo **found);
+
+/**
+ * Sets the prevout of every input of a block's transactions (except
+ * the coinbase) to the UTXO it spends (or NULL if not present),
+ * looking them all up in batches so their cache misses overlap.
+ *
+ * The prevouts are only valid until the map next changes: resolve a
+ * block after adding its outputs (so inputs spending them are found)
+ * and before removing the outputs it spends.
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param tx       -- the block's transactions
+ *  @param n        -- number of transactions
+ */
+void resolve_block_prevouts(const struct utxo_map *utxo_map,
+			    struct transaction *tx, size_t n);
+
+/**
+ * Removes a UTXO from the map, returning false if it wasn't present.
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param txid     -- TXID of the transaction containing the UTXO
+ *  @param index    -- index of the output within that transaction
+ */
+bool utxo_map_delkey(struct utxo_map *utxo_map, const u8 *txid, u32 index);
+
+/**
+ * Iterates over every UTXO in the map (in no particular order).  The
+ * map must not be changed during iteration.
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param it       -- pointer to the iterator
+ */
+struct utxo *utxo_map_first(const struct utxo_map *utxo_map,
+			    struct utxo_map_iter *it);
+struct utxo *utxo_map_next(const struct utxo_map *utxo_map,
+			   struct utxo_map_iter *it);
+
+/**
+ * Returns every UTXO in the map in the order they were created (by
+ * height, then transaction number, then output index), whatever the
+ * shards or backend.  The pointers are valid until the map is next
+ * changed.
+ *
+ *  @param ctx      -- tal context for the returned array
+ *  @param utxo_map -- pointer to the utxo map
+ */
+struct utxo **utxo_map_sorted(const tal_t *ctx, const struct utxo_map *utxo_map);
 
 /**
  * Defines UTXO structs from the given transaction & block, then adds
  * them to the UTXO map utxo_map.
  *
- *  @param tal_ctx  -- tal
  *  @param utxo_map -- pointer to the utxo map that this utxo will be added to.
  *  @param b        -- pointer to the block containing creating UTXOs
  *  @param t        -- pointer to the transaction creating these UTXOs
  *  @param txnum    -- index of the transaction in the containing block.
  *  
  */
-void add_utxos(const tal_t *tal_ctx,
-	      struct utxo_map *utxo_map,
+void add_utxos(struct utxo_map *utxo_map,
 	      const struct block *b,
 	      const struct transaction *t,
 	      u32 txnum);
   
 /**
- * Removes UTXO from UTXO map, indiciating it was spent by the given
- * input.
+ * Removes the UTXOs spent by a transaction's inputs from the UTXO
+ * map (which must not be a coinbase).
  *
  *  @param utxo_map -- pointer to the utxo map
- *  @param i        -- pointer to the input
+ *  @param t        -- pointer to the spending transaction
  *  
  */
-void release_utxo(struct utxo_map *utxo_map, const struct input *i);
+void release_utxos(struct utxo_map *utxo_map, const struct transaction *t);
+
+/**
+ * Adds the UTXOs created by all of a block's transactions, like
+ * add_utxos() for each.  The shards of a sharded map are updated at
+ * once on the thread pool (for blocks with enough outputs to be worth
+ * it).
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param pool     -- thread pool (may be NULL)
+ *  @param b        -- pointer to the block
+ *  @param tx       -- the block's transactions
+ *  @param n        -- number of transactions
+ */
+void add_block_utxos(struct utxo_map *utxo_map, struct thread_pool *pool,
+		     const struct block *b,
+		     const struct transaction *tx, size_t n);
+
+/**
+ * Removes the UTXOs spent by all of a block's transactions (except the
+ * coinbase), like release_utxos() for each.  The shards of a sharded
+ * map are updated at once on the thread pool.
+ *
+ *  @param utxo_map -- pointer to the utxo map
+ *  @param pool     -- thread pool (may be NULL)
+ *  @param tx       -- the block's transactions
+ *  @param n        -- number of transactions
+ */
+void release_block_utxos(struct utxo_map *utxo_map, struct thread_pool *pool,
+			 const struct transaction *tx, size_t n);
 
 /**
  * Returns true if an output is unspendable.
@@ -0,0 +1,349 @@
+#include <ccan/err/err.h>
+#include <ccan/tal/str/str.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "utxostore.h"
+
+/* Log records (and index slots) to start with; both double as needed. */
+#define UTXO_STORE_MIN_RECORDS	(1 << 20)
+#define UTXO_STORE_MIN_SLOTS	(1 << 21)
+/* Script bytes to start with; doubles as needed. */
+#define UTXO_STORE_MIN_SCRIPTS	(1 << 24)
+/* Grow the index once more than this fraction of slots are in use. */
+#define UTXO_STORE_LOAD_NUM	3
+#define UTXO_STORE_LOAD_DEN	4
+/* Pack the script file once the dead bytes are this fraction of the log. */
+#define UTXO_STORE_SCRIPTS_DEAD_DEN 4
+/* Spent records have this type until the log is compacted. */
+#define UTXO_STORE_DEAD		0xFF
+
+/* An index slot: @rec is 0 if empty, otherwise log record number + 1. */
+struct utxo_store_slot {
+	u64 hash;
+	u64 rec;
+};
+
+struct utxo_store {
+	const char *dir;
+	int log_fd;
+	struct utxo *log;
+	size_t log_len, log_cap;
+	size_t dead;
+	int index_fd;
+	struct utxo_store_slot *slots;
+	size_t mask;
+	size_t count;
+	int scripts_fd;
+	u8 *scripts;
+	size_t scripts_len, scripts_cap, scripts_dead;
+};
+
+/* Creates an unlinked file of this size in the store's directory,
+ * and maps it.  Doesn't use tal, as shards of a UTXO map grow their
+ * stores on different threads. */
+static void *map_new_file(const struct utxo_store *store, size_t size, int *fd)
+{
+	char *file = malloc(strlen(store->dir) + sizeof("/utxostore-XXXXXX"));
+	void *p;
+
+	if (!file)
+		err(1, "Allocating UTXO store name");
+	strcpy(file, store->dir);
+	strcat(file, "/utxostore-XXXXXX");
+	*fd = mkstemp(file);
+	if (*fd < 0)
+		err(1, "Creating %s", file);
+	unlink(file);
+	if (ftruncate(*fd, size) != 0)
+		err(1, "Extending %s to %zu bytes", file, size);
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (p == MAP_FAILED)
+		err(1, "Mapping %s", file);
+	free(file);
+	return p;
+}
+
+static void unmap_file(void *p, size_t size, int fd)
+{
+	munmap(p, size);
+	close(fd);
+}
+
+static size_t index_size(size_t num_slots)
+{
+	return num_slots * sizeof(struct utxo_store_slot);
+}
+
+static void insert_slot(struct utxo_store *store, u64 h, u64 rec)
+{
+	size_t slot;
+
+	for (slot = h & store->mask;
+	     store->slots[slot].rec;
+	     slot = (slot + 1) & store->mask);
+	store->slots[slot].hash = h;
+	store->slots[slot].rec = rec;
+}
+
+static void grow_index(struct utxo_store *store)
+{
+	struct utxo_store_slot *old = store->slots;
+	size_t i, old_slots = store->mask + 1;
+	int old_fd = store->index_fd;
+
+	store->slots = map_new_file(store, index_size(old_slots * 2),
+				    &store->index_fd);
+	store->mask = old_slots * 2 - 1;
+	for (i = 0; i < old_slots; i++) {
+		if (old[i].rec)
+			insert_slot(store, old[i].hash, old[i].rec);
+	}
+	unmap_file(old, index_size(old_slots), old_fd);
+}
+
+static void grow_log(struct utxo_store *store)
+{
+	size_t old_size = store->log_cap * sizeof(*store->log);
+	void *p;
+
+	if (ftruncate(store->log_fd, old_size * 2) != 0)
+		err(1, "Extending UTXO store to %zu bytes", old_size * 2);
+	p = mremap(store->log, old_size, old_size * 2, MREMAP_MAYMOVE);
+	if (p == MAP_FAILED)
+		err(1, "Remapping UTXO store");
+	store->log = p;
+	store->log_cap *= 2;
+}
+
+static void grow_scripts(struct utxo_store *store, size_t len)
+{
+	size_t cap = store->scripts_cap;
+	void *p;
+
+	while (cap < store->scripts_len + len)
+		cap *= 2;
+	if (ftruncate(store->scripts_fd, cap) != 0)
+		err(1, "Extending UTXO store scripts to %zu bytes", cap);
+	p = mremap(store->scripts, store->scripts_cap, cap, MREMAP_MAYMOVE);
+	if (p == MAP_FAILED)
+		err(1, "Remapping UTXO store scripts");
+	store->scripts = p;
+	store->scripts_cap = cap;
+}
+
+/* Copies the live records' scripts to a new file. */
+static void compact_scripts(struct utxo_store *store)
+{
+	u8 *old = store->scripts;
+	size_t i, old_cap = store->scripts_cap, len = 0;
+	size_t live = store->scripts_len - store->scripts_dead;
+	int old_fd = store->scripts_fd;
+
+	store->scripts_cap = UTXO_STORE_MIN_SCRIPTS;
+	while (store->scripts_cap < live * 2)
+		store->scripts_cap *= 2;
+	store->scripts = map_new_file(store, store->scripts_cap,
+				      &store->scripts_fd);
+	for (i = 0; i < store->log_len; i++) {
+		struct utxo *u = &store->log[i];
+
+		if (u->type == UTXO_STORE_DEAD || !u->script_cold)
+			continue;
+		memcpy(store->scripts + len, old + u->script.ext.off,
+		       u->script.ext.len);
+		u->script.ext.off = len;
+		len += u->script.ext.len;
+	}
+	store->scripts_len = len;
+	store->scripts_dead = 0;
+	unmap_file(old, old_cap, old_fd);
+}
+
+/* Copies the live records to a new log, in order.  Each copied
+ * record's new number is left in its old amount field so the index
+ * can be renumbered in place. */
+static void compact_log(struct utxo_store *store)
+{
+	struct utxo *old = store->log;
+	size_t i, old_cap = store->log_cap, n = 0;
+	int old_fd = store->log_fd;
+
+	store->log_cap = UTXO_STORE_MIN_RECORDS;
+	while (store->log_cap < store->count * 2)
+		store->log_cap *= 2;
+	store->log = map_new_file(store, store->log_cap * sizeof(*store->log),
+				  &store->log_fd);
+	for (i = 0; i < store->log_len; i++) {
+		if (old[i].type == UTXO_STORE_DEAD)
+			continue;
+		store->log[n] = old[i];
+		old[i].amount = n++;
+	}
+	for (i = 0; i <= store->mask; i++) {
+		if (store->slots[i].rec)
+			store->slots[i].rec = old[store->slots[i].rec - 1].amount + 1;
+	}
+	store->log_len = n;
+	store->dead = 0;
+	unmap_file(old, old_cap * sizeof(*old), old_fd);
+}
+
+static void destroy_utxo_store(struct utxo_store *store)
+{
+	unmap_file(store->log, store->log_cap * sizeof(*store->log),
+		   store->log_fd);
+	unmap_file(store->slots, index_size(store->mask + 1), store->index_fd);
+	unmap_file(store->scripts, store->scripts_cap, store->scripts_fd);
+}
+
+struct utxo_store *utxo_store_new(const tal_t *ctx, const char *dir)
+{
+	struct utxo_store *store = tal(ctx, struct utxo_store);
+
+	store->dir = tal_strdup(store, dir);
+	store->log_cap = UTXO_STORE_MIN_RECORDS;
+	store->log = map_new_file(store, store->log_cap * sizeof(*store->log),
+				  &store->log_fd);
+	store->log_len = store->dead = store->count = 0;
+	store->slots = map_new_file(store, index_size(UTXO_STORE_MIN_SLOTS),
+				    &store->index_fd);
+	store->mask = UTXO_STORE_MIN_SLOTS - 1;
+	store->scripts_cap = UTXO_STORE_MIN_SCRIPTS;
+	store->scripts = map_new_file(store, store->scripts_cap,
+				      &store->scripts_fd);
+	store->scripts_len = store->scripts_dead = 0;
+	tal_add_destructor(store, destroy_utxo_store);
+	return store;
+}
+
+size_t utxo_store_count(const struct utxo_store *store)
+{
+	return store->count;
+}
+
+void utxo_store_add(struct utxo_store *store, const struct utxo *u, u64 h,
+		    const u8 *script)
+{
+	struct utxo *rec;
+
+	if ((store->count + 1) * UTXO_STORE_LOAD_DEN
+	    > (store->mask + 1) * UTXO_STORE_LOAD_NUM)
+		grow_index(store);
+	if (store->log_len == store->log_cap)
+		grow_log(store);
+
+	rec = &store->log[store->log_len];
+	*rec = *u;
+	rec->script_cold = (script != NULL);
+	if (script) {
+		if (store->scripts_len + u->script.ext.len > store->scripts_cap)
+			grow_scripts(store, u->script.ext.len);
+		memcpy(store->scripts + store->scripts_len, script,
+		       u->script.ext.len);
+		rec->script.ext.off = store->scripts_len;
+		store->scripts_len += u->script.ext.len;
+	}
+	insert_slot(store, h, ++store->log_len);
+	store->count++;
+}
+
+const u8 *utxo_store_script(const struct utxo_store *store,
+			    const struct utxo *u)
+{
+	return store->scripts + u->script.ext.off;
+}
+
+void utxo_store_prefetch(const struct utxo_store *store, u64 h)
+{
+	__builtin_prefetch(&store->slots[h & store->mask]);
+}
+
+/* Slot holding this key, or the empty slot ending its probe. */
+static size_t find_slot(const struct utxo_store *store,
+			const u8 *txid, u32 index, u64 h)
+{
+	size_t slot = h & store->mask;
+
+	while (store->slots[slot].rec) {
+		const struct utxo *u;
+
+		if (store->slots[slot].hash == h) {
+			u = &store->log[store->slots[slot].rec - 1];
+			if (u->index == index
+			    && memcmp(u->txid, txid, sizeof(u->txid)) == 0)
+				break;
+		}
+		slot = (slot + 1) & store->mask;
+	}
+	return slot;
+}
+
+struct utxo *utxo_store_get(const struct utxo_store *store,
+			    const u8 *txid, u32 index, u64 h)
+{
+	size_t slot = find_slot(store, txid, index, h);
+
+	if (!store->slots[slot].rec)
+		return NULL;
+	return &store->log[store->slots[slot].rec - 1];
+}
+
+bool utxo_store_del(struct utxo_store *store,
+		    const u8 *txid, u32 index, u64 h)
+{
+	size_t hole = find_slot(store, txid, index, h), slot = hole;
+	struct utxo *rec;
+
+	if (!store->slots[hole].rec)
+		return false;
+
+	rec = &store->log[store->slots[hole].rec - 1];
+	if (rec->script_cold)
+		store->scripts_dead += rec->script.ext.len;
+	rec->type = UTXO_STORE_DEAD;
+	store->dead++;
+	store->count--;
+
+	/* Shift back later entries of the probe run, as utxo_map does. */
+	for (;;) {
+		size_t home;
+
+		slot = (slot + 1) & store->mask;
+		if (!store->slots[slot].rec)
+			break;
+		home = store->slots[slot].hash & store->mask;
+		if (((slot - home) & store->mask) < ((slot - hole) & store->mask))
+			continue;
+		store->slots[hole] = store->slots[slot];
+		hole = slot;
+	}
+	store->slots[hole].rec = 0;
+
+	if (store->dead > UTXO_STORE_MIN_RECORDS && store->dead > store->count)
+		compact_log(store);
+	if (store->scripts_dead > store->log_len * sizeof(struct utxo)
+				  / UTXO_STORE_SCRIPTS_DEAD_DEN
+	    && store->scripts_dead > store->scripts_len - store->scripts_dead)
+		compact_scripts(store);
+	return true;
+}
+
+struct utxo *utxo_store_next(const struct utxo_store *store, size_t *pos)
+{
+	while (*pos < store->log_len) {
+		struct utxo *u = &store->log[(*pos)++];
+
+		if (u->type != UTXO_STORE_DEAD)
+			return u;
+	}
+	return NULL;
+}
+
+void utxo_store_reset(struct utxo_store *store)
+{
+	memset(store->slots, 0, index_size(store->mask + 1));
+	store->log_len = store->dead = store->count = 0;
+	store->scripts_len = store->scripts_dead = 0;
+}
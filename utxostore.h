@@ -0,0 +1,115 @@
+/*******************************************************************************
+ *
+ *  = utxostore.h
+ *
+ *  Defines a disk-backed store for UTXOs which don't fit in memory.
+ *
+ *  UTXOs are appended to a log file, and found through an
+ *  open-addressed hash index in a second file; both are mapped, so
+ *  the kernel keeps recently used pages in memory and writes the rest
+ *  back to disk.  Spent UTXOs are marked dead in the log, which is
+ *  compacted once most of it is dead.
+ *
+ *  The bytes of a UTXO's script which don't fit in the UTXO are
+ *  appended to a third file, compacted the same way.
+ *
+ *  The files are unlinked as soon as they are created: nothing is
+ *  left behind when the program exits.
+ *
+ */
+#ifndef BITCOIN_ITERATE_UTXOSTORE_H
+#define BITCOIN_ITERATE_UTXOSTORE_H
+#include <ccan/tal/tal.h>
+#include <ccan/short_types/short_types.h>
+#include "types.h"
+
+struct utxo_store;
+
+/**
+ * utxo_store_new - Create an empty store.
+ *
+ * @ctx: tal context; freeing the store unmaps and closes its files
+ * @dir: directory to create the files in
+ */
+struct utxo_store *utxo_store_new(const tal_t *ctx, const char *dir);
+
+/**
+ * utxo_store_count - Number of UTXOs in the store.
+ */
+size_t utxo_store_count(const struct utxo_store *store);
+
+/**
+ * utxo_store_add - Append a UTXO to the store.
+ *
+ * @store: the store
+ * @u: the UTXO, which must not already be in the store
+ * @h: utxo_hash() of its txid and index
+ * @script: if not NULL, the UTXO's u->script.ext.len script bytes
+ *          kept outside it, which are copied to the store
+ */
+void utxo_store_add(struct utxo_store *store, const struct utxo *u, u64 h,
+		    const u8 *script);
+
+/**
+ * utxo_store_script - Find a UTXO's script bytes kept in the store.
+ *
+ * @store: the store
+ * @u: a UTXO in the store, with u->script_cold set
+ *
+ * The result points into a mapped file, and is only valid until the
+ * store is next changed.
+ */
+const u8 *utxo_store_script(const struct utxo_store *store,
+			    const struct utxo *u);
+
+/**
+ * utxo_store_prefetch - Start reading the index slot for a lookup.
+ *
+ * @store: the store
+ * @h: utxo_hash() of the txid and index to be looked up
+ */
+void utxo_store_prefetch(const struct utxo_store *store, u64 h);
+
+/**
+ * utxo_store_get - Find a UTXO (NULL if not present).
+ *
+ * @store: the store
+ * @txid: TXID of the transaction containing the UTXO
+ * @index: index of the output within that transaction
+ * @h: utxo_hash() of @txid and @index
+ *
+ * The result points into the mapped log, and is only valid until
+ * the store is next changed.
+ */
+struct utxo *utxo_store_get(const struct utxo_store *store,
+			    const u8 *txid, u32 index, u64 h);
+
+/**
+ * utxo_store_del - Remove a UTXO, returning false if it wasn't present.
+ *
+ * @store: the store
+ * @txid: TXID of the transaction containing the UTXO
+ * @index: index of the output within that transaction
+ * @h: utxo_hash() of @txid and @index
+ */
+bool utxo_store_del(struct utxo_store *store,
+		    const u8 *txid, u32 index, u64 h);
+
+/**
+ * utxo_store_next - Iterate over the UTXOs in the store.
+ *
+ * @store: the store
+ * @pos: position in the log: start at 0; it is advanced past the
+ *       UTXO returned
+ *
+ * Returns NULL once every UTXO has been returned.  The store must
+ * not be changed during iteration.
+ */
+struct utxo *utxo_store_next(const struct utxo_store *store, size_t *pos);
+
+/**
+ * utxo_store_reset - Remove every UTXO from the store.
+ */
+void utxo_store_reset(struct utxo_store *store);
+
+#endif /* BITCOIN_ITERATE_UTXOSTORE_H */